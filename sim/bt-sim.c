@@ -0,0 +1,1340 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Simulated Bluetooth HAL
+ *
+ * Implements the Bluetooth module of libhardware, bt_interface_t and
+ * btsock_interface_t without a controller, so that bluetoothd runs on
+ * a host. Like Bluedroid, each call returns at once and its results
+ * arrive later from the simulator's callback thread.
+ *
+ * The simulated adapter sees a number of fake remote devices. While
+ * the adapter is enabled, each of them can report property updates,
+ * ACL connects and disconnects and bond-state changes on its own.
+ * The environment configures the simulation:
+ *
+ *  BTSIM_DEVICES          number of remote devices (16, at most 65536)
+ *  BTSIM_LATENCY_USEC     time that each call blocks the caller (0)
+ *  BTSIM_DISCOVERY_MSEC   duration of a discovery (10240)
+ *  BTSIM_DEVICE_FOUND_HZ  device-found callbacks per second while
+ *                         discovering (100)
+ *  BTSIM_PROPERTIES_HZ    unsolicited remote-properties callbacks
+ *                         per second (0)
+ *  BTSIM_ACL_HZ           ACL-state callbacks per second (0)
+ *  BTSIM_BOND_HZ          unsolicited bond-state callbacks per second (0)
+ *
+ * Remote device i has the address 02:00:00:00:ii:ii.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <hardware/bluetooth.h>
+#include <hardware/bt_sock.h>
+#include "log.h"
+
+#define MAX_DEVICES 65536
+
+/* Callbacks that a generator delivers before it checks for new
+ * events again. Keeps high rates from starving HAL calls. */
+#define GENERATOR_BURST 64
+
+/* Maximum number of addresses in BT_PROPERTY_ADAPTER_BONDED_DEVICES */
+#define MAX_BONDED_REPORTED 256
+
+#define SIM_CLASS_OF_DEVICE 0x5a020c /* smartphone */
+#define SIM_PASSKEY 123456
+
+static struct {
+  unsigned long ndevices;
+  unsigned long latency_usec;
+  unsigned long discovery_msec;
+  unsigned long device_found_hz;
+  unsigned long properties_hz;
+  unsigned long acl_hz;
+  unsigned long bond_hz;
+} config;
+
+static unsigned long
+getenv_ulong(const char* name, unsigned long value)
+{
+  const char* str;
+  char* end;
+  unsigned long res;
+
+  str = getenv(name);
+  if (!str)
+    return value;
+
+  errno = 0;
+  res = strtoul(str, &end, 0);
+  if (errno || !*str || *end) {
+    ALOGW("invalid value for %s: %s", name, str);
+    return value;
+  }
+  return res;
+}
+
+static void
+read_config(void)
+{
+  config.ndevices = getenv_ulong("BTSIM_DEVICES", 16);
+  config.latency_usec = getenv_ulong("BTSIM_LATENCY_USEC", 0);
+  config.discovery_msec = getenv_ulong("BTSIM_DISCOVERY_MSEC", 10240);
+  config.device_found_hz = getenv_ulong("BTSIM_DEVICE_FOUND_HZ", 100);
+  config.properties_hz = getenv_ulong("BTSIM_PROPERTIES_HZ", 0);
+  config.acl_hz = getenv_ulong("BTSIM_ACL_HZ", 0);
+  config.bond_hz = getenv_ulong("BTSIM_BOND_HZ", 0);
+
+  if (config.ndevices > MAX_DEVICES) {
+    ALOGW("limiting BTSIM_DEVICES to %d", MAX_DEVICES);
+    config.ndevices = MAX_DEVICES;
+  }
+
+  ALOGI("simulating %lu devices, %lu usec latency, discovery %lu msec, "
+        "%lu/%lu/%lu/%lu Hz found/properties/ACL/bond",
+        config.ndevices, config.latency_usec, config.discovery_msec,
+        config.device_found_hz, config.properties_hz, config.acl_hz,
+        config.bond_hz);
+}
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Blocks the caller like a HAL call that waits for the stack */
+static void
+simulate_latency(void)
+{
+  struct timespec ts;
+
+  if (!config.latency_usec)
+    return;
+
+  ts.tv_sec = config.latency_usec / 1000000;
+  ts.tv_nsec = (config.latency_usec % 1000000) * 1000;
+
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+/*
+ * Simulated devices
+ *
+ * All state below is only used on the callback thread.
+ */
+
+struct remote {
+  uint8_t bond_state;
+  uint8_t acl_state;
+  uint8_t rssi_step;
+};
+
+static struct remote* remote;
+
+static struct {
+  int enabled;
+  int discovering;
+  uint64_t discovery_end;
+  bt_bdname_t name;
+  uint32_t scan_mode;
+  uint32_t discovery_timeout;
+} adapter;
+
+static const bt_bdaddr_t adapter_addr = {
+  { 0x02, 0x00, 0x01, 0x00, 0x00, 0x00 }
+};
+
+static void
+get_remote_addr(unsigned long i, bt_bdaddr_t* addr)
+{
+  addr->address[0] = 0x02;
+  addr->address[1] = 0x00;
+  addr->address[2] = 0x00;
+  addr->address[3] = 0x00;
+  addr->address[4] = i >> 8;
+  addr->address[5] = i;
+}
+
+/* Returns -1 if |addr| is not a simulated device */
+static long
+find_remote(const bt_bdaddr_t* addr)
+{
+  unsigned long i;
+
+  if (addr->address[0] != 0x02 || addr->address[1] || addr->address[2] ||
+      addr->address[3])
+    return -1;
+
+  i = (addr->address[4] << 8) | addr->address[5];
+  if (i >= config.ndevices)
+    return -1;
+
+  return i;
+}
+
+static void
+init_property(bt_property_t* prop, bt_property_type_t type, void* val,
+              int len)
+{
+  prop->type = type;
+  prop->len = len;
+  prop->val = val;
+}
+
+struct remote_values {
+  bt_bdaddr_t addr;
+  bt_bdname_t name;
+  uint32_t cod;
+  uint32_t type;
+  int8_t rssi;
+};
+
+#define NREMOTE_PROPERTIES 5
+
+static int
+build_remote_properties(unsigned long i, struct remote_values* v,
+                        bt_property_t* prop)
+{
+  get_remote_addr(i, &v->addr);
+  snprintf((char*)v->name.name, sizeof(v->name.name), "sim-%05lu", i);
+  v->cod = SIM_CLASS_OF_DEVICE;
+  v->type = BT_DEVICE_DEVTYPE_BREDR;
+  v->rssi = -40 - (int8_t)((i * 7 + remote[i].rssi_step) % 50);
+
+  init_property(prop + 0, BT_PROPERTY_BDADDR, &v->addr, sizeof(v->addr));
+  init_property(prop + 1, BT_PROPERTY_BDNAME, v->name.name,
+                strlen((char*)v->name.name));
+  init_property(prop + 2, BT_PROPERTY_CLASS_OF_DEVICE, &v->cod,
+                sizeof(v->cod));
+  init_property(prop + 3, BT_PROPERTY_TYPE_OF_DEVICE, &v->type,
+                sizeof(v->type));
+  init_property(prop + 4, BT_PROPERTY_REMOTE_RSSI, &v->rssi,
+                sizeof(v->rssi));
+
+  return NREMOTE_PROPERTIES;
+}
+
+struct adapter_values {
+  uint32_t cod;
+  uint32_t type;
+  bt_bdaddr_t bonded[MAX_BONDED_REPORTED];
+};
+
+#define NADAPTER_PROPERTIES 7
+
+static int
+build_adapter_properties(struct adapter_values* v, bt_property_t* prop)
+{
+  unsigned long i, nbonded;
+
+  for (i = 0, nbonded = 0;
+       i < config.ndevices && nbonded < MAX_BONDED_REPORTED; ++i) {
+    if (remote[i].bond_state == BT_BOND_STATE_BONDED)
+      get_remote_addr(i, v->bonded + nbonded++);
+  }
+  v->cod = SIM_CLASS_OF_DEVICE;
+  v->type = BT_DEVICE_DEVTYPE_DUAL;
+
+  init_property(prop + 0, BT_PROPERTY_BDADDR, (void*)&adapter_addr,
+                sizeof(adapter_addr));
+  init_property(prop + 1, BT_PROPERTY_BDNAME, adapter.name.name,
+                strlen((char*)adapter.name.name));
+  init_property(prop + 2, BT_PROPERTY_CLASS_OF_DEVICE, &v->cod,
+                sizeof(v->cod));
+  init_property(prop + 3, BT_PROPERTY_TYPE_OF_DEVICE, &v->type,
+                sizeof(v->type));
+  init_property(prop + 4, BT_PROPERTY_ADAPTER_SCAN_MODE, &adapter.scan_mode,
+                sizeof(adapter.scan_mode));
+  init_property(prop + 5, BT_PROPERTY_ADAPTER_DISCOVERY_TIMEOUT,
+                &adapter.discovery_timeout,
+                sizeof(adapter.discovery_timeout));
+  init_property(prop + 6, BT_PROPERTY_ADAPTER_BONDED_DEVICES, v->bonded,
+                nbonded * sizeof(v->bonded[0]));
+
+  return NADAPTER_PROPERTIES;
+}
+
+/* Returns the property of |type| in |prop|, or NULL */
+static bt_property_t*
+find_property(bt_property_t* prop, int n, uint32_t type)
+{
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    if (prop[i].type == type)
+      return prop + i;
+  }
+  return NULL;
+}
+
+/*
+ * Callback generators
+ *
+ * A generator delivers one kind of callback at a fixed rate. Each
+ * call to |fire| delivers one callback.
+ */
+
+static bt_callbacks_t* callbacks;
+
+struct generator {
+  const unsigned long* hz;
+  void (*fire)(void);
+  int active;
+  uint64_t next;
+};
+
+static void
+fire_device_found(void)
+{
+  static unsigned long next;
+  struct remote_values v;
+  bt_property_t prop[NREMOTE_PROPERTIES];
+  unsigned long i;
+  int n;
+
+  /* discovery finds the devices round-robin; Bluedroid reports
+   * a device again when its name or RSSI changes */
+  i = next++ % config.ndevices;
+  ++remote[i].rssi_step;
+
+  n = build_remote_properties(i, &v, prop);
+  callbacks->device_found_cb(n, prop);
+}
+
+static void
+fire_properties(void)
+{
+  static unsigned long next;
+  struct remote_values v;
+  bt_property_t prop[NREMOTE_PROPERTIES];
+  unsigned long i;
+
+  i = next++ % config.ndevices;
+  ++remote[i].rssi_step;
+
+  build_remote_properties(i, &v, prop);
+  callbacks->remote_device_properties_cb(BT_STATUS_SUCCESS, &v.addr, 1,
+                                         find_property(prop, NREMOTE_PROPERTIES,
+                                                       BT_PROPERTY_REMOTE_RSSI));
+}
+
+static void
+fire_acl(void)
+{
+  static unsigned long next;
+  bt_bdaddr_t addr;
+  unsigned long i;
+
+  i = next++ % config.ndevices;
+
+  if (remote[i].acl_state == BT_ACL_STATE_CONNECTED)
+    remote[i].acl_state = BT_ACL_STATE_DISCONNECTED;
+  else
+    remote[i].acl_state = BT_ACL_STATE_CONNECTED;
+
+  get_remote_addr(i, &addr);
+  callbacks->acl_state_changed_cb(BT_STATUS_SUCCESS, &addr,
+                                  remote[i].acl_state);
+}
+
+static void
+fire_bond(void)
+{
+  static unsigned long next;
+  bt_bdaddr_t addr;
+  unsigned long i;
+
+  i = next++ % config.ndevices;
+
+  /* none -> bonding -> bonded -> none */
+  remote[i].bond_state = (remote[i].bond_state + 1) % 3;
+
+  get_remote_addr(i, &addr);
+  callbacks->bond_state_changed_cb(BT_STATUS_SUCCESS, &addr,
+                                   remote[i].bond_state);
+}
+
+enum {
+  GENERATOR_DEVICE_FOUND,
+  GENERATOR_PROPERTIES,
+  GENERATOR_ACL,
+  GENERATOR_BOND,
+  NGENERATORS
+};
+
+static struct generator generator[NGENERATORS] = {
+  [GENERATOR_DEVICE_FOUND] = { &config.device_found_hz, fire_device_found },
+  [GENERATOR_PROPERTIES] = { &config.properties_hz, fire_properties },
+  [GENERATOR_ACL] = { &config.acl_hz, fire_acl },
+  [GENERATOR_BOND] = { &config.bond_hz, fire_bond }
+};
+
+static void
+start_generator(struct generator* g, uint64_t now)
+{
+  if (!*g->hz || !config.ndevices)
+    return;
+
+  g->active = 1;
+  g->next = now + 1000000000ull / *g->hz;
+}
+
+static void
+stop_generator(struct generator* g)
+{
+  g->active = 0;
+}
+
+static void
+run_generators(uint64_t now)
+{
+  struct generator* g;
+  unsigned long n;
+
+  for (g = generator; g < generator + NGENERATORS; ++g) {
+    for (n = 0; g->active && g->next <= now && n < GENERATOR_BURST; ++n) {
+      g->fire();
+      g->next += 1000000000ull / *g->hz;
+    }
+  }
+}
+
+/* Returns the time at which the next callback is due */
+static uint64_t
+next_deadline(void)
+{
+  const struct generator* g;
+  uint64_t deadline;
+
+  deadline = UINT64_MAX;
+
+  for (g = generator; g < generator + NGENERATORS; ++g) {
+    if (g->active && g->next < deadline)
+      deadline = g->next;
+  }
+  if (adapter.discovering && adapter.discovery_end < deadline)
+    deadline = adapter.discovery_end;
+
+  return deadline;
+}
+
+static void
+start_discovery(void)
+{
+  uint64_t now;
+
+  if (!adapter.enabled || adapter.discovering)
+    return;
+
+  now = now_ns();
+
+  adapter.discovering = 1;
+  adapter.discovery_end = now + config.discovery_msec * 1000000ull;
+  callbacks->discovery_state_changed_cb(BT_DISCOVERY_STARTED);
+
+  start_generator(generator + GENERATOR_DEVICE_FOUND, now);
+}
+
+static void
+stop_discovery(void)
+{
+  if (!adapter.discovering)
+    return;
+
+  stop_generator(generator + GENERATOR_DEVICE_FOUND);
+
+  adapter.discovering = 0;
+  callbacks->discovery_state_changed_cb(BT_DISCOVERY_STOPPED);
+}
+
+/*
+ * Events
+ *
+ * HAL calls queue an event for the callback thread, which updates
+ * the simulated state and delivers the resulting callbacks.
+ */
+
+enum {
+  EVENT_ENABLE,
+  EVENT_DISABLE,
+  EVENT_GET_ADAPTER_PROPERTIES,
+  EVENT_GET_ADAPTER_PROPERTY,
+  EVENT_SET_ADAPTER_PROPERTY,
+  EVENT_GET_REMOTE_DEVICE_PROPERTIES,
+  EVENT_GET_REMOTE_DEVICE_PROPERTY,
+  EVENT_SET_REMOTE_DEVICE_PROPERTY,
+  EVENT_GET_REMOTE_SERVICE_RECORD,
+  EVENT_GET_REMOTE_SERVICES,
+  EVENT_START_DISCOVERY,
+  EVENT_CANCEL_DISCOVERY,
+  EVENT_CREATE_BOND,
+  EVENT_REMOVE_BOND,
+  EVENT_PAIRING_REPLY,
+  EVENT_DUT_MODE_SEND,
+  EVENT_LE_TEST_MODE,
+  EVENT_QUIT
+};
+
+struct event {
+  STAILQ_ENTRY(event) entry;
+  unsigned char type;
+  unsigned long remote; /* index of the remote device */
+  uint32_t arg; /* property type, opcode or accept flag */
+  unsigned long len;
+  unsigned char data[]; /* property value or DUT buffer */
+};
+
+static STAILQ_HEAD(, event) event_queue =
+  STAILQ_HEAD_INITIALIZER(event_queue);
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond;
+static pthread_t cb_thread;
+
+static int
+post_event(unsigned char type, unsigned long i, uint32_t arg,
+           const void* data, unsigned long len)
+{
+  struct event* ev;
+
+  if (!callbacks)
+    return BT_STATUS_NOT_READY;
+
+  ev = malloc(sizeof(*ev) + len);
+  if (!ev) {
+    ALOGE_ERRNO("malloc");
+    return BT_STATUS_NOMEM;
+  }
+  ev->type = type;
+  ev->remote = i;
+  ev->arg = arg;
+  ev->len = len;
+  if (len)
+    memcpy(ev->data, data, len);
+
+  pthread_mutex_lock(&event_lock);
+  STAILQ_INSERT_TAIL(&event_queue, ev, entry);
+  pthread_cond_signal(&event_cond);
+  pthread_mutex_unlock(&event_lock);
+
+  return BT_STATUS_SUCCESS;
+}
+
+static void
+enable_adapter(void)
+{
+  uint64_t now;
+
+  if (adapter.enabled)
+    return;
+
+  adapter.enabled = 1;
+  callbacks->adapter_state_changed_cb(BT_STATE_ON);
+
+  now = now_ns();
+  start_generator(generator + GENERATOR_PROPERTIES, now);
+  start_generator(generator + GENERATOR_ACL, now);
+  start_generator(generator + GENERATOR_BOND, now);
+}
+
+static void
+disable_adapter(void)
+{
+  if (!adapter.enabled)
+    return;
+
+  stop_discovery();
+  stop_generator(generator + GENERATOR_PROPERTIES);
+  stop_generator(generator + GENERATOR_ACL);
+  stop_generator(generator + GENERATOR_BOND);
+
+  adapter.enabled = 0;
+  callbacks->adapter_state_changed_cb(BT_STATE_OFF);
+}
+
+static void
+report_adapter_properties(uint32_t type)
+{
+  struct adapter_values v;
+  bt_property_t prop[NADAPTER_PROPERTIES];
+  bt_property_t* p;
+  int n;
+
+  n = build_adapter_properties(&v, prop);
+  if (!type) {
+    callbacks->adapter_properties_cb(BT_STATUS_SUCCESS, n, prop);
+    return;
+  }
+  p = find_property(prop, n, type);
+  if (!p) {
+    callbacks->adapter_properties_cb(BT_STATUS_FAIL, 0, prop);
+    return;
+  }
+  callbacks->adapter_properties_cb(BT_STATUS_SUCCESS, 1, p);
+}
+
+static void
+set_adapter_property(const struct event* ev)
+{
+  switch (ev->arg) {
+    case BT_PROPERTY_BDNAME:
+      memset(&adapter.name, 0, sizeof(adapter.name));
+      memcpy(adapter.name.name, ev->data,
+             ev->len < sizeof(adapter.name) ? ev->len
+                                            : sizeof(adapter.name) - 1);
+      break;
+    case BT_PROPERTY_ADAPTER_SCAN_MODE:
+      memcpy(&adapter.scan_mode, ev->data, sizeof(adapter.scan_mode));
+      break;
+    case BT_PROPERTY_ADAPTER_DISCOVERY_TIMEOUT:
+      memcpy(&adapter.discovery_timeout, ev->data,
+             sizeof(adapter.discovery_timeout));
+      break;
+  }
+  report_adapter_properties(ev->arg);
+}
+
+static void
+report_remote_properties(unsigned long i, uint32_t type)
+{
+  struct remote_values v;
+  bt_property_t prop[NREMOTE_PROPERTIES];
+  bt_property_t* p;
+  int n;
+
+  n = build_remote_properties(i, &v, prop);
+  if (!type) {
+    callbacks->remote_device_properties_cb(BT_STATUS_SUCCESS, &v.addr,
+                                           n, prop);
+    return;
+  }
+  p = find_property(prop, n, type);
+  if (!p) {
+    callbacks->remote_device_properties_cb(BT_STATUS_FAIL, &v.addr,
+                                           0, prop);
+    return;
+  }
+  callbacks->remote_device_properties_cb(BT_STATUS_SUCCESS, &v.addr, 1, p);
+}
+
+static void
+report_remote_property(unsigned long i, uint32_t type, void* val,
+                       unsigned long len)
+{
+  bt_bdaddr_t addr;
+  bt_property_t prop;
+
+  get_remote_addr(i, &addr);
+  init_property(&prop, type, val, len);
+
+  callbacks->remote_device_properties_cb(BT_STATUS_SUCCESS, &addr, 1, &prop);
+}
+
+static void
+report_service_record(unsigned long i, const bt_uuid_t* uuid)
+{
+  bt_service_record_t record;
+
+  memset(&record, 0, sizeof(record));
+  record.uuid = *uuid;
+  record.channel = 1 + i % 30;
+  snprintf(record.name, sizeof(record.name), "sim-service");
+
+  report_remote_property(i, BT_PROPERTY_SERVICE_RECORD, &record,
+                         sizeof(record));
+}
+
+static void
+report_services(unsigned long i)
+{
+  /* Serial Port Profile */
+  static const uint8_t uuid[16] = {
+    0x00, 0x00, 0x11, 0x01, 0x00, 0x00, 0x10, 0x00,
+    0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb
+  };
+
+  report_remote_property(i, BT_PROPERTY_UUIDS, (void*)uuid, sizeof(uuid));
+}
+
+static void
+set_bond_state(unsigned long i, bt_status_t status, bt_bond_state_t state)
+{
+  bt_bdaddr_t addr;
+
+  remote[i].bond_state = state;
+
+  get_remote_addr(i, &addr);
+  callbacks->bond_state_changed_cb(status, &addr, state);
+}
+
+static void
+create_bond(unsigned long i)
+{
+  struct remote_values v;
+  bt_property_t prop[NREMOTE_PROPERTIES];
+
+  if (remote[i].bond_state != BT_BOND_STATE_NONE)
+    return;
+
+  set_bond_state(i, BT_STATUS_SUCCESS, BT_BOND_STATE_BONDING);
+
+  build_remote_properties(i, &v, prop);
+  callbacks->ssp_request_cb(&v.addr, &v.name, v.cod,
+                            BT_SSP_VARIANT_PASSKEY_CONFIRMATION,
+                            SIM_PASSKEY);
+}
+
+static void
+reply_to_pairing(unsigned long i, uint32_t accept)
+{
+  if (remote[i].bond_state != BT_BOND_STATE_BONDING)
+    return;
+
+  if (accept)
+    set_bond_state(i, BT_STATUS_SUCCESS, BT_BOND_STATE_BONDED);
+  else
+    set_bond_state(i, BT_STATUS_AUTH_FAILURE, BT_BOND_STATE_NONE);
+}
+
+/* Returns 1 if the callback thread should quit */
+static int
+handle_event(struct event* ev)
+{
+  bt_uuid_t uuid;
+
+  switch (ev->type) {
+    case EVENT_ENABLE:
+      enable_adapter();
+      break;
+    case EVENT_DISABLE:
+      disable_adapter();
+      break;
+    case EVENT_GET_ADAPTER_PROPERTIES:
+      report_adapter_properties(0);
+      break;
+    case EVENT_GET_ADAPTER_PROPERTY:
+      report_adapter_properties(ev->arg);
+      break;
+    case EVENT_SET_ADAPTER_PROPERTY:
+      set_adapter_property(ev);
+      break;
+    case EVENT_GET_REMOTE_DEVICE_PROPERTIES:
+      report_remote_properties(ev->remote, 0);
+      break;
+    case EVENT_GET_REMOTE_DEVICE_PROPERTY:
+      report_remote_properties(ev->remote, ev->arg);
+      break;
+    case EVENT_SET_REMOTE_DEVICE_PROPERTY:
+      report_remote_property(ev->remote, ev->arg, ev->data, ev->len);
+      break;
+    case EVENT_GET_REMOTE_SERVICE_RECORD:
+      memcpy(&uuid, ev->data, sizeof(uuid));
+      report_service_record(ev->remote, &uuid);
+      break;
+    case EVENT_GET_REMOTE_SERVICES:
+      report_services(ev->remote);
+      break;
+    case EVENT_START_DISCOVERY:
+      start_discovery();
+      break;
+    case EVENT_CANCEL_DISCOVERY:
+      stop_discovery();
+      break;
+    case EVENT_CREATE_BOND:
+      create_bond(ev->remote);
+      break;
+    case EVENT_REMOVE_BOND:
+      set_bond_state(ev->remote, BT_STATUS_SUCCESS, BT_BOND_STATE_NONE);
+      break;
+    case EVENT_PAIRING_REPLY:
+      reply_to_pairing(ev->remote, ev->arg);
+      break;
+    case EVENT_DUT_MODE_SEND:
+      callbacks->dut_mode_recv_cb(ev->arg, ev->data, ev->len);
+      break;
+    case EVENT_LE_TEST_MODE:
+      callbacks->le_test_mode_cb(BT_STATUS_SUCCESS, 0);
+      break;
+    case EVENT_QUIT:
+      return 1;
+  }
+  return 0;
+}
+
+static void
+wait_for_event(uint64_t deadline)
+{
+  struct timespec ts;
+
+  if (deadline == UINT64_MAX) {
+    pthread_cond_wait(&event_cond, &event_lock);
+    return;
+  }
+  ts.tv_sec = deadline / 1000000000ull;
+  ts.tv_nsec = deadline % 1000000000ull;
+
+  pthread_cond_timedwait(&event_cond, &event_lock, &ts);
+}
+
+static void*
+run_cb_thread(void* arg)
+{
+  struct event* ev;
+  uint64_t deadline;
+  int quit;
+
+  callbacks->thread_evt_cb(ASSOCIATE_JVM);
+
+  for (quit = 0; !quit;) {
+    pthread_mutex_lock(&event_lock);
+    while (STAILQ_EMPTY(&event_queue)) {
+      deadline = next_deadline();
+      if (deadline <= now_ns())
+        break;
+      wait_for_event(deadline);
+    }
+    ev = STAILQ_FIRST(&event_queue);
+    if (ev)
+      STAILQ_REMOVE_HEAD(&event_queue, entry);
+    pthread_mutex_unlock(&event_lock);
+
+    if (ev) {
+      quit = handle_event(ev);
+      free(ev);
+    }
+
+    if (adapter.discovering && adapter.discovery_end <= now_ns())
+      stop_discovery();
+
+    run_generators(now_ns());
+  }
+
+  callbacks->thread_evt_cb(DISASSOCIATE_JVM);
+
+  return NULL;
+}
+
+/*
+ * bt_interface_t
+ */
+
+static int
+sim_init(bt_callbacks_t* cb)
+{
+  pthread_condattr_t attr;
+  unsigned long i;
+  int err;
+
+  assert(cb);
+
+  if (callbacks)
+    return BT_STATUS_DONE;
+
+  read_config();
+
+  remote = calloc(config.ndevices ? config.ndevices : 1, sizeof(*remote));
+  if (!remote) {
+    ALOGE_ERRNO("calloc");
+    goto err_calloc;
+  }
+  for (i = 0; i < config.ndevices; ++i)
+    remote[i].acl_state = BT_ACL_STATE_DISCONNECTED;
+
+  memset(&adapter, 0, sizeof(adapter));
+  snprintf((char*)adapter.name.name, sizeof(adapter.name.name),
+           "bluetoothd-sim");
+  adapter.scan_mode = BT_SCAN_MODE_CONNECTABLE;
+  adapter.discovery_timeout = 120;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  err = pthread_cond_init(&event_cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (err) {
+    ALOGE_ERRNO_NO("pthread_cond_init", err);
+    goto err_pthread_cond_init;
+  }
+
+  callbacks = cb;
+
+  err = pthread_create(&cb_thread, NULL, run_cb_thread, NULL);
+  if (err) {
+    ALOGE_ERRNO_NO("pthread_create", err);
+    goto err_pthread_create;
+  }
+
+  return BT_STATUS_SUCCESS;
+err_pthread_create:
+  callbacks = NULL;
+  pthread_cond_destroy(&event_cond);
+err_pthread_cond_init:
+  free(remote);
+  remote = NULL;
+err_calloc:
+  return BT_STATUS_FAIL;
+}
+
+static void
+sim_cleanup(void)
+{
+  struct event* ev;
+  int err;
+
+  if (!callbacks)
+    return;
+
+  if (post_event(EVENT_QUIT, 0, 0, NULL, 0) == BT_STATUS_SUCCESS) {
+    err = pthread_join(cb_thread, NULL);
+    if (err)
+      ALOGW_ERRNO_NO("pthread_join", err);
+  }
+
+  while ((ev = STAILQ_FIRST(&event_queue))) {
+    STAILQ_REMOVE_HEAD(&event_queue, entry);
+    free(ev);
+  }
+  callbacks = NULL;
+
+  pthread_cond_destroy(&event_cond);
+
+  free(remote);
+  remote = NULL;
+}
+
+static int
+sim_enable(void)
+{
+  simulate_latency();
+
+  return post_event(EVENT_ENABLE, 0, 0, NULL, 0);
+}
+
+static int
+sim_disable(void)
+{
+  simulate_latency();
+
+  return post_event(EVENT_DISABLE, 0, 0, NULL, 0);
+}
+
+static int
+sim_get_adapter_properties(void)
+{
+  simulate_latency();
+
+  return post_event(EVENT_GET_ADAPTER_PROPERTIES, 0, 0, NULL, 0);
+}
+
+static int
+sim_get_adapter_property(bt_property_type_t type)
+{
+  simulate_latency();
+
+  return post_event(EVENT_GET_ADAPTER_PROPERTY, 0, type, NULL, 0);
+}
+
+static int
+sim_set_adapter_property(const bt_property_t* property)
+{
+  simulate_latency();
+
+  switch (property->type) {
+    case BT_PROPERTY_BDNAME:
+      break;
+    case BT_PROPERTY_ADAPTER_SCAN_MODE:
+    case BT_PROPERTY_ADAPTER_DISCOVERY_TIMEOUT:
+      if (property->len != sizeof(uint32_t))
+        return BT_STATUS_PARM_INVALID;
+      /* Bluedroid dereferences these as typed pointers */
+      if ((uintptr_t)property->val % __alignof__(uint32_t)) {
+        ALOGE("misaligned value for property %d", property->type);
+        return BT_STATUS_PARM_INVALID;
+      }
+      break;
+    default:
+      return BT_STATUS_PARM_INVALID;
+  }
+  return post_event(EVENT_SET_ADAPTER_PROPERTY, 0, property->type,
+                    property->val, property->len);
+}
+
+static int
+sim_get_remote_device_properties(bt_bdaddr_t* remote_addr)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(remote_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_GET_REMOTE_DEVICE_PROPERTIES, i, 0, NULL, 0);
+}
+
+static int
+sim_get_remote_device_property(bt_bdaddr_t* remote_addr,
+                               bt_property_type_t type)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(remote_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_GET_REMOTE_DEVICE_PROPERTY, i, type, NULL, 0);
+}
+
+static int
+sim_set_remote_device_property(bt_bdaddr_t* remote_addr,
+                               const bt_property_t* property)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(remote_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  if (property->type != BT_PROPERTY_REMOTE_FRIENDLY_NAME)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_SET_REMOTE_DEVICE_PROPERTY, i, property->type,
+                    property->val, property->len);
+}
+
+static int
+sim_get_remote_service_record(bt_bdaddr_t* remote_addr, bt_uuid_t* uuid)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(remote_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_GET_REMOTE_SERVICE_RECORD, i, 0, uuid,
+                    sizeof(*uuid));
+}
+
+static int
+sim_get_remote_services(bt_bdaddr_t* remote_addr)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(remote_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_GET_REMOTE_SERVICES, i, 0, NULL, 0);
+}
+
+static int
+sim_start_discovery(void)
+{
+  simulate_latency();
+
+  return post_event(EVENT_START_DISCOVERY, 0, 0, NULL, 0);
+}
+
+static int
+sim_cancel_discovery(void)
+{
+  simulate_latency();
+
+  return post_event(EVENT_CANCEL_DISCOVERY, 0, 0, NULL, 0);
+}
+
+static int
+sim_create_bond(const bt_bdaddr_t* bd_addr)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(bd_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_CREATE_BOND, i, 0, NULL, 0);
+}
+
+static int
+sim_remove_bond(const bt_bdaddr_t* bd_addr)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(bd_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_REMOVE_BOND, i, 0, NULL, 0);
+}
+
+static int
+sim_cancel_bond(const bt_bdaddr_t* bd_addr)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(bd_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  /* same as rejecting the pairing request */
+  return post_event(EVENT_PAIRING_REPLY, i, 0, NULL, 0);
+}
+
+static int
+sim_pin_reply(const bt_bdaddr_t* bd_addr, uint8_t accept, uint8_t pin_len,
+              bt_pin_code_t* pin_code)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(bd_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_PAIRING_REPLY, i, accept, NULL, 0);
+}
+
+static int
+sim_ssp_reply(const bt_bdaddr_t* bd_addr, bt_ssp_variant_t variant,
+              uint8_t accept, uint32_t passkey)
+{
+  long i;
+
+  simulate_latency();
+
+  i = find_remote(bd_addr);
+  if (i < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return post_event(EVENT_PAIRING_REPLY, i,
+                    accept && passkey == SIM_PASSKEY, NULL, 0);
+}
+
+static const void*
+sim_get_profile_interface(const char* profile_id);
+
+static int
+sim_dut_mode_configure(uint8_t enable)
+{
+  simulate_latency();
+
+  return callbacks ? BT_STATUS_SUCCESS : BT_STATUS_NOT_READY;
+}
+
+static int
+sim_dut_mode_send(uint16_t opcode, uint8_t* buf, uint8_t len)
+{
+  simulate_latency();
+
+  /* the simulated controller echoes the command */
+  return post_event(EVENT_DUT_MODE_SEND, 0, opcode, buf, len);
+}
+
+static int
+sim_le_test_mode(uint16_t opcode, uint8_t* buf, uint8_t len)
+{
+  simulate_latency();
+
+  return post_event(EVENT_LE_TEST_MODE, 0, opcode, NULL, 0);
+}
+
+static int
+sim_config_hci_snoop_log(uint8_t enable)
+{
+  simulate_latency();
+
+  return callbacks ? BT_STATUS_SUCCESS : BT_STATUS_NOT_READY;
+}
+
+static const bt_interface_t sim_bt_interface = {
+  .size = sizeof(sim_bt_interface),
+  .init = sim_init,
+  .enable = sim_enable,
+  .disable = sim_disable,
+  .cleanup = sim_cleanup,
+  .get_adapter_properties = sim_get_adapter_properties,
+  .get_adapter_property = sim_get_adapter_property,
+  .set_adapter_property = sim_set_adapter_property,
+  .get_remote_device_properties = sim_get_remote_device_properties,
+  .get_remote_device_property = sim_get_remote_device_property,
+  .set_remote_device_property = sim_set_remote_device_property,
+  .get_remote_service_record = sim_get_remote_service_record,
+  .get_remote_services = sim_get_remote_services,
+  .start_discovery = sim_start_discovery,
+  .cancel_discovery = sim_cancel_discovery,
+  .create_bond = sim_create_bond,
+  .remove_bond = sim_remove_bond,
+  .cancel_bond = sim_cancel_bond,
+  .pin_reply = sim_pin_reply,
+  .ssp_reply = sim_ssp_reply,
+  .get_profile_interface = sim_get_profile_interface,
+  .dut_mode_configure = sim_dut_mode_configure,
+  .dut_mode_send = sim_dut_mode_send,
+  .le_test_mode = sim_le_test_mode,
+  .config_hci_snoop_log = sim_config_hci_snoop_log
+};
+
+/*
+ * btsock_interface_t
+ *
+ * The simulator only models the command path. Each socket is one end
+ * of a socket pair whose other end hangs up at once.
+ */
+
+static bt_status_t
+open_sim_socket(int* sock_fd)
+{
+  int fd[2];
+
+  if (!callbacks)
+    return BT_STATUS_NOT_READY;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+    ALOGE_ERRNO("socketpair");
+    return BT_STATUS_FAIL;
+  }
+  if (TEMP_FAILURE_RETRY(close(fd[1])) < 0)
+    ALOGW_ERRNO("close");
+
+  *sock_fd = fd[0];
+
+  return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+sim_sock_listen(btsock_type_t type, const char* service_name,
+                const uint8_t* service_uuid, int channel, int* sock_fd,
+                int flags)
+{
+  simulate_latency();
+
+  return open_sim_socket(sock_fd);
+}
+
+static bt_status_t
+sim_sock_connect(const bt_bdaddr_t* bd_addr, btsock_type_t type,
+                 const uint8_t* uuid, int channel, int* sock_fd, int flags)
+{
+  simulate_latency();
+
+  if (find_remote(bd_addr) < 0)
+    return BT_STATUS_PARM_INVALID;
+
+  return open_sim_socket(sock_fd);
+}
+
+static const btsock_interface_t sim_sock_interface = {
+  .size = sizeof(sim_sock_interface),
+  .listen = sim_sock_listen,
+  .connect = sim_sock_connect
+};
+
+static const void*
+sim_get_profile_interface(const char* profile_id)
+{
+  if (!strcmp(profile_id, BT_PROFILE_SOCKETS_ID))
+    return &sim_sock_interface;
+
+  ALOGW("profile %s not simulated", profile_id);
+
+  return NULL;
+}
+
+/*
+ * Hardware module
+ */
+
+static const bt_interface_t*
+get_sim_bt_interface(void)
+{
+  return &sim_bt_interface;
+}
+
+static int
+close_sim_device(struct hw_device_t* device)
+{
+  return 0;
+}
+
+static int
+open_sim_device(const struct hw_module_t* module, const char* id,
+                struct hw_device_t** device);
+
+static hw_module_methods_t sim_module_methods = {
+  .open = open_sim_device
+};
+
+static hw_module_t sim_module = {
+  .tag = HARDWARE_MODULE_TAG,
+  .module_api_version = 1,
+  .hal_api_version = 0,
+  .id = BT_HARDWARE_MODULE_ID,
+  .name = "Simulated Bluetooth HAL",
+  .author = "bluetoothd",
+  .methods = &sim_module_methods
+};
+
+static bluetooth_device_t sim_device = {
+  .common = {
+    .tag = HARDWARE_DEVICE_TAG,
+    .version = 0,
+    .module = &sim_module,
+    .close = close_sim_device
+  },
+  .get_bluetooth_interface = get_sim_bt_interface
+};
+
+static int
+open_sim_device(const struct hw_module_t* module, const char* id,
+                struct hw_device_t** device)
+{
+  if (strcmp(id, BT_HARDWARE_MODULE_ID))
+    return -EINVAL;
+
+  *device = &sim_device.common;
+
+  return 0;
+}
+
+int
+hw_get_module(const char* id, const struct hw_module_t** module)
+{
+  if (strcmp(id, BT_HARDWARE_MODULE_ID))
+    return -ENOENT;
+
+  *module = &sim_module;
+
+  return 0;
+}
@@ -0,0 +1,17 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+/*
+ * Host stand-in for libcutils' <cutils/sockets.h>; see sockets.c.
+ */
+
+#define ANDROID_SOCKET_ENV_PREFIX "ANDROID_SOCKET_"
+#define ANDROID_SOCKET_DIR "/dev/socket"
+
+/* Returns the control socket |name| that init created for the
+ * daemon, or -1 on errors. */
+int
+android_get_control_socket(const char* name);
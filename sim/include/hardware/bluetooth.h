@@ -0,0 +1,230 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+/*
+ * Host stand-in for libhardware's <hardware/bluetooth.h>
+ *
+ * Follows the interface of Android 4.4 (API level 19). Builds for
+ * earlier versions ignore the fields they don't know.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <hardware/hardware.h>
+
+#define BLUETOOTH_HARDWARE_MODULE_ID "bluetooth"
+#define BT_HARDWARE_MODULE_ID "bluetooth"
+#define BT_STACK_MODULE_ID "bluetooth"
+
+#define BT_PROFILE_HANDSFREE_ID "handsfree"
+#define BT_PROFILE_ADVANCED_AUDIO_ID "a2dp"
+#define BT_PROFILE_HEALTH_ID "health"
+#define BT_PROFILE_SOCKETS_ID "socket"
+#define BT_PROFILE_HIDHOST_ID "hidhost"
+#define BT_PROFILE_PAN_ID "pan"
+#define BT_PROFILE_GATT_ID "gatt"
+#define BT_PROFILE_AV_RC_ID "avrcp"
+
+typedef struct {
+  uint8_t address[6];
+} __attribute__((packed)) bt_bdaddr_t;
+
+typedef struct {
+  uint8_t name[249];
+} __attribute__((packed)) bt_bdname_t;
+
+typedef struct {
+  uint8_t uu[16];
+} bt_uuid_t;
+
+typedef struct {
+  uint8_t pin[16];
+} __attribute__((packed)) bt_pin_code_t;
+
+typedef enum {
+  BT_STATE_OFF,
+  BT_STATE_ON
+} bt_state_t;
+
+typedef enum {
+  BT_STATUS_SUCCESS,
+  BT_STATUS_FAIL,
+  BT_STATUS_NOT_READY,
+  BT_STATUS_NOMEM,
+  BT_STATUS_BUSY,
+  BT_STATUS_DONE,
+  BT_STATUS_UNSUPPORTED,
+  BT_STATUS_PARM_INVALID,
+  BT_STATUS_UNHANDLED,
+  BT_STATUS_AUTH_FAILURE,
+  BT_STATUS_RMT_DEV_DOWN
+} bt_status_t;
+
+typedef enum {
+  BT_DISCOVERY_STOPPED,
+  BT_DISCOVERY_STARTED
+} bt_discovery_state_t;
+
+typedef enum {
+  BT_ACL_STATE_CONNECTED,
+  BT_ACL_STATE_DISCONNECTED
+} bt_acl_state_t;
+
+typedef enum {
+  BT_BOND_STATE_NONE,
+  BT_BOND_STATE_BONDING,
+  BT_BOND_STATE_BONDED
+} bt_bond_state_t;
+
+typedef enum {
+  BT_SSP_VARIANT_PASSKEY_CONFIRMATION,
+  BT_SSP_VARIANT_PASSKEY_ENTRY,
+  BT_SSP_VARIANT_CONSENT,
+  BT_SSP_VARIANT_PASSKEY_NOTIFICATION
+} bt_ssp_variant_t;
+
+typedef enum {
+  BT_SCAN_MODE_NONE,
+  BT_SCAN_MODE_CONNECTABLE,
+  BT_SCAN_MODE_CONNECTABLE_DISCOVERABLE
+} bt_scan_mode_t;
+
+typedef enum {
+  BT_DEVICE_DEVTYPE_BREDR = 0x1,
+  BT_DEVICE_DEVTYPE_BLE,
+  BT_DEVICE_DEVTYPE_DUAL
+} bt_device_type_t;
+
+typedef enum {
+  ASSOCIATE_JVM,
+  DISASSOCIATE_JVM
+} bt_cb_thread_evt;
+
+typedef struct {
+  bt_uuid_t uuid;
+  uint16_t channel;
+  char name[256];
+} bt_service_record_t;
+
+typedef enum {
+  BT_PROPERTY_BDNAME = 0x1,
+  BT_PROPERTY_BDADDR,
+  BT_PROPERTY_UUIDS,
+  BT_PROPERTY_CLASS_OF_DEVICE,
+  BT_PROPERTY_TYPE_OF_DEVICE,
+  BT_PROPERTY_SERVICE_RECORD,
+  BT_PROPERTY_ADAPTER_SCAN_MODE,
+  BT_PROPERTY_ADAPTER_BONDED_DEVICES,
+  BT_PROPERTY_ADAPTER_DISCOVERY_TIMEOUT,
+  BT_PROPERTY_REMOTE_FRIENDLY_NAME,
+  BT_PROPERTY_REMOTE_RSSI,
+  BT_PROPERTY_REMOTE_VERSION_INFO,
+  BT_PROPERTY_REMOTE_DEVICE_TIMESTAMP = 0xff
+} bt_property_type_t;
+
+typedef struct {
+  bt_property_type_t type;
+  int len;
+  void* val;
+} bt_property_t;
+
+typedef void (*adapter_state_changed_callback)(bt_state_t state);
+
+typedef void (*adapter_properties_callback)(bt_status_t status,
+                                            int num_properties,
+                                            bt_property_t* properties);
+
+typedef void (*remote_device_properties_callback)(bt_status_t status,
+                                                  bt_bdaddr_t* bd_addr,
+                                                  int num_properties,
+                                                  bt_property_t* properties);
+
+typedef void (*device_found_callback)(int num_properties,
+                                      bt_property_t* properties);
+
+typedef void (*discovery_state_changed_callback)(bt_discovery_state_t state);
+
+typedef void (*pin_request_callback)(bt_bdaddr_t* remote_bd_addr,
+                                     bt_bdname_t* bd_name, uint32_t cod);
+
+typedef void (*ssp_request_callback)(bt_bdaddr_t* remote_bd_addr,
+                                     bt_bdname_t* bd_name, uint32_t cod,
+                                     bt_ssp_variant_t pairing_variant,
+                                     uint32_t pass_key);
+
+typedef void (*bond_state_changed_callback)(bt_status_t status,
+                                            bt_bdaddr_t* remote_bd_addr,
+                                            bt_bond_state_t state);
+
+typedef void (*acl_state_changed_callback)(bt_status_t status,
+                                           bt_bdaddr_t* remote_bd_addr,
+                                           bt_acl_state_t state);
+
+typedef void (*callback_thread_event)(bt_cb_thread_evt evt);
+
+typedef void (*dut_mode_recv_callback)(uint16_t opcode, uint8_t* buf,
+                                       uint8_t len);
+
+typedef void (*le_test_mode_callback)(bt_status_t status,
+                                      uint16_t num_packets);
+
+typedef struct {
+  size_t size;
+  adapter_state_changed_callback adapter_state_changed_cb;
+  adapter_properties_callback adapter_properties_cb;
+  remote_device_properties_callback remote_device_properties_cb;
+  device_found_callback device_found_cb;
+  discovery_state_changed_callback discovery_state_changed_cb;
+  pin_request_callback pin_request_cb;
+  ssp_request_callback ssp_request_cb;
+  bond_state_changed_callback bond_state_changed_cb;
+  acl_state_changed_callback acl_state_changed_cb;
+  callback_thread_event thread_evt_cb;
+  dut_mode_recv_callback dut_mode_recv_cb;
+  le_test_mode_callback le_test_mode_cb;
+} bt_callbacks_t;
+
+typedef struct {
+  size_t size;
+  int (*init)(bt_callbacks_t* callbacks);
+  int (*enable)(void);
+  int (*disable)(void);
+  void (*cleanup)(void);
+  int (*get_adapter_properties)(void);
+  int (*get_adapter_property)(bt_property_type_t type);
+  int (*set_adapter_property)(const bt_property_t* property);
+  int (*get_remote_device_properties)(bt_bdaddr_t* remote_addr);
+  int (*get_remote_device_property)(bt_bdaddr_t* remote_addr,
+                                    bt_property_type_t type);
+  int (*set_remote_device_property)(bt_bdaddr_t* remote_addr,
+                                    const bt_property_t* property);
+  int (*get_remote_service_record)(bt_bdaddr_t* remote_addr,
+                                   bt_uuid_t* uuid);
+  int (*get_remote_services)(bt_bdaddr_t* remote_addr);
+  int (*start_discovery)(void);
+  int (*cancel_discovery)(void);
+  int (*create_bond)(const bt_bdaddr_t* bd_addr);
+  int (*remove_bond)(const bt_bdaddr_t* bd_addr);
+  int (*cancel_bond)(const bt_bdaddr_t* bd_addr);
+  int (*pin_reply)(const bt_bdaddr_t* bd_addr, uint8_t accept,
+                   uint8_t pin_len, bt_pin_code_t* pin_code);
+  int (*ssp_reply)(const bt_bdaddr_t* bd_addr, bt_ssp_variant_t variant,
+                   uint8_t accept, uint32_t passkey);
+  const void* (*get_profile_interface)(const char* profile_id);
+  int (*dut_mode_configure)(uint8_t enable);
+  int (*dut_mode_send)(uint16_t opcode, uint8_t* buf, uint8_t len);
+  int (*le_test_mode)(uint16_t opcode, uint8_t* buf, uint8_t len);
+  int (*config_hci_snoop_log)(uint8_t enable);
+} bt_interface_t;
+
+typedef struct {
+  struct hw_device_t common;
+  const bt_interface_t* (*get_bluetooth_interface)(void);
+} bluetooth_device_t;
+
+typedef bluetooth_device_t bluetooth_module_t;
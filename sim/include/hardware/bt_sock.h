@@ -0,0 +1,30 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+/*
+ * Host stand-in for libhardware's <hardware/bt_sock.h>
+ */
+
+#include <hardware/bluetooth.h>
+
+#define BTSOCK_FLAG_ENCRYPT 1
+#define BTSOCK_FLAG_AUTH (1 << 1)
+
+typedef enum {
+  BTSOCK_RFCOMM = 1,
+  BTSOCK_SCO = 2,
+  BTSOCK_L2CAP = 3
+} btsock_type_t;
+
+typedef struct {
+  size_t size;
+  bt_status_t (*listen)(btsock_type_t type, const char* service_name,
+                        const uint8_t* service_uuid, int channel,
+                        int* sock_fd, int flags);
+  bt_status_t (*connect)(const bt_bdaddr_t* bd_addr, btsock_type_t type,
+                         const uint8_t* uuid, int channel, int* sock_fd,
+                         int flags);
+} btsock_interface_t;
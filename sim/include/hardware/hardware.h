@@ -0,0 +1,49 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+/*
+ * Host stand-in for libhardware's <hardware/hardware.h>
+ *
+ * Only the parts that bluetoothd uses. The module is provided by the
+ * simulated Bluetooth HAL in bt-sim.c.
+ */
+
+#include <stdint.h>
+
+#define MAKE_TAG_CONSTANT(A,B,C,D) \
+  (((A) << 24) | ((B) << 16) | ((C) << 8) | (D))
+
+#define HARDWARE_MODULE_TAG MAKE_TAG_CONSTANT('H', 'W', 'M', 'T')
+#define HARDWARE_DEVICE_TAG MAKE_TAG_CONSTANT('H', 'W', 'D', 'T')
+
+struct hw_module_t;
+struct hw_device_t;
+
+typedef struct hw_module_methods_t {
+  int (*open)(const struct hw_module_t* module, const char* id,
+              struct hw_device_t** device);
+} hw_module_methods_t;
+
+typedef struct hw_module_t {
+  uint32_t tag;
+  uint16_t module_api_version;
+  uint16_t hal_api_version;
+  const char* id;
+  const char* name;
+  const char* author;
+  struct hw_module_methods_t* methods;
+  void* dso;
+} hw_module_t;
+
+typedef struct hw_device_t {
+  uint32_t tag;
+  uint32_t version;
+  struct hw_module_t* module;
+  int (*close)(struct hw_device_t* device);
+} hw_device_t;
+
+int
+hw_get_module(const char* id, const struct hw_module_t** module);
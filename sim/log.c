@@ -0,0 +1,61 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Host stand-in for liblog
+ *
+ * Writes messages to stderr. BTSIM_LOG_LEVEL sets the lowest priority
+ * that gets logged; one of v, d, i, w, e or s (silent). Load tests
+ * usually want w or higher.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <android/log.h>
+
+static int
+min_prio(void)
+{
+  static const char letter[] = "??vdiwefs";
+  static int prio;
+  const char* level;
+  const char* pos;
+
+  if (prio)
+    return prio;
+
+  level = getenv("BTSIM_LOG_LEVEL");
+  pos = (level && *level) ? strchr(letter + 2, level[0]) : NULL;
+  prio = pos ? (pos - letter) : ANDROID_LOG_INFO;
+
+  return prio;
+}
+
+int
+__android_log_print(int prio, const char* tag, const char* fmt, ...)
+{
+  static const char letter[] = "??VDIWEFS";
+  char msg[1024];
+  char c;
+  struct timespec ts;
+  va_list ap;
+
+  if (prio < min_prio())
+    return 0;
+
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  c = (prio >= 0 && prio < (int)sizeof(letter) - 1) ? letter[prio] : '?';
+
+  /* one call per line keeps lines from different threads apart */
+  return fprintf(stderr, "%ld.%06ld %c %s: %s\n", (long)ts.tv_sec,
+                 ts.tv_nsec / 1000, c, tag ? tag : "", msg);
+}
@@ -0,0 +1,127 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Host stand-in for libcutils' control sockets
+ *
+ * On Android, init creates the daemon's listening sockets as declared
+ * in init.rc and passes them in ANDROID_SOCKET_<name>. On the host,
+ * a launcher can do the same. Otherwise the sockets are created here,
+ * in the directory given by BTSIM_SOCKET_DIR (/tmp by default).
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cutils/sockets.h>
+#include "log.h"
+
+#define DEFAULT_SOCKET_DIR "/tmp"
+
+/* The sockets that init.rc declares for bluetoothd */
+static const struct {
+  const char* name;
+  int type;
+} control_socket[] = {
+  { "bluetoothd", SOCK_STREAM },
+  { "bluetoothd_seqpacket", SOCK_SEQPACKET }
+};
+
+#define NCONTROL_SOCKETS (sizeof(control_socket) / sizeof(control_socket[0]))
+
+static int
+get_socket_from_env(const char* name)
+{
+  char key[64];
+  const char* value;
+  char* end;
+  long fd;
+
+  snprintf(key, sizeof(key), ANDROID_SOCKET_ENV_PREFIX "%s", name);
+
+  value = getenv(key);
+  if (!value)
+    return -1;
+
+  errno = 0;
+  fd = strtol(value, &end, 10);
+  if (errno || *end || fd < 0 || fd > INT_MAX) {
+    ALOGE("invalid value for %s: %s", key, value);
+    return -1;
+  }
+  return fd;
+}
+
+static int
+create_socket(const char* name, int type)
+{
+  struct sockaddr_un addr;
+  const char* dir;
+  int fd, len;
+
+  dir = getenv("BTSIM_SOCKET_DIR");
+  if (!dir)
+    dir = DEFAULT_SOCKET_DIR;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", dir, name);
+  if (len < 0 || (size_t)len >= sizeof(addr.sun_path)) {
+    ALOGE("socket path for %s too long", name);
+    errno = ENAMETOOLONG;
+    goto err_snprintf;
+  }
+
+  fd = socket(AF_UNIX, type, 0);
+  if (fd < 0) {
+    ALOGE_ERRNO("socket");
+    goto err_socket;
+  }
+
+  if (unlink(addr.sun_path) < 0 && errno != ENOENT) {
+    ALOGE_ERRNO("unlink");
+    goto err_unlink;
+  }
+
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    ALOGE_ERRNO("bind");
+    goto err_bind;
+  }
+
+  ALOGI("listening on %s", addr.sun_path);
+
+  return fd;
+err_bind:
+err_unlink:
+  if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+    ALOGW_ERRNO("close");
+err_socket:
+err_snprintf:
+  return -1;
+}
+
+int
+android_get_control_socket(const char* name)
+{
+  size_t i;
+  int fd;
+
+  fd = get_socket_from_env(name);
+  if (fd >= 0)
+    return fd;
+
+  for (i = 0; i < NCONTROL_SOCKETS; ++i) {
+    if (!strcmp(control_socket[i].name, name))
+      return create_socket(name, control_socket[i].type);
+  }
+
+  errno = ENOENT;
+  return -1;
+}
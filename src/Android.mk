@@ -11,13 +11,125 @@ LOCAL_SRC_FILES:= bt-core.c \
                   core.c \
                   core-io.c \
                   loop.c \
+                  loop-epoll.c \
                   main.c \
+                  ntf-queue.c \
+                  ntf-ring.c \
                   service.c \
-                  task.c
+                  task.c \
+                  timer.c
 LOCAL_CFLAGS := -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+# Set BLUETOOTHD_LOOP_BACKEND := io_uring to build the io_uring backend;
+# the daemon falls back to epoll if the kernel doesn't support io_uring.
+# The backend needs kernel headers of Linux 5.19 or later.
+ifeq ($(BLUETOOTHD_LOOP_BACKEND),io_uring)
+LOCAL_SRC_FILES += loop-uring.c
+LOCAL_CFLAGS += -DLOOP_IO_URING
+endif
 LOCAL_SHARED_LIBRARIES := libcutils libhardware liblog
 LOCAL_MODULE:= bluetoothd
 LOCAL_MODULE_PATH := $(TARGET_OUT_EXECUTABLES)
 LOCAL_MODULE_TAGS := eng
 include $(BUILD_EXECUTABLE)
 
+
+# Microbenchmark for the PDU codecs
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= bt-proto.c \
+                  pdu-codec-bench.c
+LOCAL_CFLAGS := -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE:= pdu-codec-bench
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+
+# Benchmark for the epoll loop's fd registry
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= loop.c \
+                  loop-bench.c \
+                  loop-epoll.c
+LOCAL_CFLAGS := -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+ifeq ($(BLUETOOTHD_LOOP_BACKEND),io_uring)
+LOCAL_SRC_FILES += loop-uring.c
+LOCAL_CFLAGS += -DLOOP_IO_URING
+endif
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE:= loop-bench
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+
+# Benchmark for the timer wheel
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= loop.c \
+                  loop-epoll.c \
+                  timer.c \
+                  timer-bench.c
+LOCAL_CFLAGS := -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+ifeq ($(BLUETOOTHD_LOOP_BACKEND),io_uring)
+LOCAL_SRC_FILES += loop-uring.c
+LOCAL_CFLAGS += -DLOOP_IO_URING
+endif
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE:= timer-bench
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+
+# Benchmark for the task queue against a pipe-based queue
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= loop.c \
+                  loop-epoll.c \
+                  task.c \
+                  task-bench.c
+LOCAL_CFLAGS := -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+ifeq ($(BLUETOOTHD_LOOP_BACKEND),io_uring)
+LOCAL_SRC_FILES += loop-uring.c
+LOCAL_CFLAGS += -DLOOP_IO_URING
+endif
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE:= task-bench
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+
+# Benchmark for the PDU buffer pool against malloc()
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= bt-pdubuf.c \
+                  bt-proto.c \
+                  pdubuf-bench.c
+LOCAL_CFLAGS := -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE:= pdubuf-bench
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+
+# Load generator for the daemon
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= bt-loadgen.c \
+                  bt-proto.c
+LOCAL_CFLAGS := -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE:= bt-loadgen
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
+
+# Protocol checks against a running daemon
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= bt-check.c \
+                  bt-proto.c
+LOCAL_CFLAGS := -DANDROID_VERSION=$(PLATFORM_SDK_VERSION)
+LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_MODULE:= bt-check
+LOCAL_MODULE_PATH := $(TARGET_OUT_OPTIONAL_EXECUTABLES)
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,588 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Protocol checks for bluetoothd
+ *
+ * Connects to a running daemon like a client and checks how it
+ * answers invalid commands. A failed command has to get an error
+ * response, and the client's session has to stay open. Each check
+ * prints its result, and the exit status is non-zero if any of them
+ * failed. Run as
+ *
+ *   bt-check [-P] [-s <path>]
+ *
+ *  -s <path>  daemon socket (/dev/socket/bluetoothd)
+ *  -P         the socket is of type SOCK_SEQPACKET
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cutils/sockets.h>
+#include "log.h"
+#include "bt-proto.h"
+#include "pdu-codec.h"
+#include "ntf-ring.h"
+
+enum {
+  /* SERVICE_CORE */
+  OPCODE_CORE_ERROR = 0x00,
+  OPCODE_CORE_REGISTER_MODULE = 0x01,
+  OPCODE_CORE_OPEN_NTF_RING = 0x03,
+  OPCODE_CORE_BATCH = 0x05,
+  OPCODE_CORE_UNKNOWN = 0x7f,
+  /* SERVICE_BT_CORE */
+  OPCODE_BT_CORE_SET_ADAPTER_PROPERTY = 0x05
+};
+
+#define DEFAULT_SOCKET ANDROID_SOCKET_DIR "/bluetoothd"
+
+/* Time to wait for a response */
+#define RSP_MSEC 5000
+
+/* File descriptors per response, such as OPEN_NTF_RING's */
+#define MAX_FDS 16
+
+static struct {
+  const char* path;
+  int seqpacket;
+} opt = {
+  .path = DEFAULT_SOCKET
+};
+
+union pdu_buf {
+  struct pdu pdu;
+  unsigned char raw[sizeof(struct pdu) + UINT16_MAX];
+};
+
+struct client {
+  int cmd_fd;
+  int ntf_fd;
+};
+
+static int
+connect_socket(void)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(opt.path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", opt.path);
+    return -1;
+  }
+  strcpy(addr.sun_path, opt.path);
+
+  fd = socket(AF_UNIX, opt.seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+  if (fd < 0) {
+    ALOGE_ERRNO("socket");
+    return -1;
+  }
+  if (TEMP_FAILURE_RETRY(connect(fd, (struct sockaddr*)&addr,
+                                 sizeof(addr))) < 0) {
+    ALOGE_ERRNO("connect");
+    goto err_connect;
+  }
+  return fd;
+err_connect:
+  if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+    ALOGW_ERRNO("close");
+  return -1;
+}
+
+/* The daemon takes a client's first connection for commands and
+ * the second for notifications. */
+static int
+open_client(struct client* client)
+{
+  client->cmd_fd = connect_socket();
+  if (client->cmd_fd < 0)
+    goto err_cmd_fd;
+
+  client->ntf_fd = connect_socket();
+  if (client->ntf_fd < 0)
+    goto err_ntf_fd;
+
+  return 0;
+err_ntf_fd:
+  if (TEMP_FAILURE_RETRY(close(client->cmd_fd)) < 0)
+    ALOGW_ERRNO("close");
+err_cmd_fd:
+  return -1;
+}
+
+static void
+close_client(struct client* client)
+{
+  if (TEMP_FAILURE_RETRY(close(client->ntf_fd)) < 0)
+    ALOGW_ERRNO("close");
+  if (TEMP_FAILURE_RETRY(close(client->cmd_fd)) < 0)
+    ALOGW_ERRNO("close");
+}
+
+static int
+send_cmd(struct client* client, uint8_t service, uint8_t opcode,
+         const void* data, size_t len)
+{
+  union pdu_buf buf;
+  ssize_t res;
+
+  init_pdu(&buf.pdu, service, opcode);
+  if (append_mem_to_pdu(&buf.pdu, data, len) < 0)
+    return -1;
+
+  res = TEMP_FAILURE_RETRY(send(client->cmd_fd, buf.raw, pdu_size(&buf.pdu),
+                                MSG_NOSIGNAL));
+  if (res < 0) {
+    ALOGE_ERRNO("send");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+wait_for_rsp(int fd)
+{
+  struct pollfd pfd;
+  int res;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  res = TEMP_FAILURE_RETRY(poll(&pfd, 1, RSP_MSEC));
+  if (res < 0) {
+    ALOGE_ERRNO("poll");
+    return -1;
+  } else if (!res) {
+    fprintf(stderr, "no response from daemon\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* Receives up to |len| bytes. On stream sockets, receives exactly
+ * |len| bytes. Received file descriptors are stored in |fd|, which
+ * has room for MAX_FDS, and counted in |nfds|. Returns the number of
+ * bytes, or -1 on errors. */
+static ssize_t
+recv_bytes(int sock, void* buf, size_t len, int* fd, unsigned long* nfds)
+{
+  union {
+    struct cmsghdr hdr;
+    unsigned char raw[CMSG_SPACE(MAX_FDS * sizeof(int))];
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* chdr;
+  const int* cfd;
+  const int* end;
+  ssize_t res;
+  size_t off;
+
+  off = 0;
+
+  do {
+    if (wait_for_rsp(sock) < 0)
+      return -1;
+
+    iov.iov_base = (unsigned char*)buf + off;
+    iov.iov_len = len - off;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.raw;
+    msg.msg_controllen = sizeof(control.raw);
+
+    res = TEMP_FAILURE_RETRY(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC));
+    if (res < 0) {
+      ALOGE_ERRNO("recvmsg");
+      return -1;
+    } else if (!res) {
+      fprintf(stderr, "daemon closed the connection\n");
+      return -1;
+    }
+    off += res;
+
+    for (chdr = CMSG_FIRSTHDR(&msg); chdr; chdr = CMSG_NXTHDR(&msg, chdr)) {
+      if (chdr->cmsg_level != SOL_SOCKET || chdr->cmsg_type != SCM_RIGHTS)
+        continue;
+      end = (const int*)((unsigned char*)chdr + chdr->cmsg_len);
+      for (cfd = (const int*)CMSG_DATA(chdr); cfd < end; ++cfd)
+        fd[(*nfds)++] = *cfd;
+    }
+  } while (!opt.seqpacket && off < len);
+
+  return off;
+}
+
+static void
+close_fds(const int* fd, unsigned long nfds)
+{
+  unsigned long i;
+
+  for (i = 0; i < nfds; ++i) {
+    if (TEMP_FAILURE_RETRY(close(fd[i])) < 0)
+      ALOGW_ERRNO("close");
+  }
+}
+
+/* Receives a response PDU and the file descriptors that came with
+ * it. |fd| has room for MAX_FDS. */
+static int
+recv_rsp_with_fds(struct client* client, union pdu_buf* buf, int* fd,
+                  unsigned long* nfds)
+{
+  ssize_t res;
+
+  *nfds = 0;
+
+  if (opt.seqpacket) {
+    res = recv_bytes(client->cmd_fd, buf->raw, sizeof(buf->raw), fd, nfds);
+    if (res < 0)
+      goto err_recv_bytes;
+    if (((size_t)res < sizeof(buf->pdu)) ||
+        ((size_t)res != pdu_size(&buf->pdu))) {
+      fprintf(stderr, "invalid PDU message of %zd bytes\n", res);
+      goto err_res;
+    }
+    return 0;
+  }
+
+  if (recv_bytes(client->cmd_fd, &buf->pdu, sizeof(buf->pdu), fd, nfds) < 0)
+    goto err_recv_bytes;
+  if (buf->pdu.len &&
+      recv_bytes(client->cmd_fd, buf->pdu.data, buf->pdu.len, fd, nfds) < 0)
+    goto err_recv_bytes;
+
+  return 0;
+err_res:
+err_recv_bytes:
+  close_fds(fd, *nfds);
+  *nfds = 0;
+  return -1;
+}
+
+/* Receives a response PDU; file descriptors are closed. */
+static int
+recv_rsp(struct client* client, union pdu_buf* buf)
+{
+  int fd[MAX_FDS];
+  unsigned long nfds;
+
+  if (recv_rsp_with_fds(client, buf, fd, &nfds) < 0)
+    return -1;
+  close_fds(fd, nfds);
+
+  return 0;
+}
+
+/* Receives a response and compares it to an error response with
+ * |status|. */
+static int
+expect_error(struct client* client, uint8_t service, uint8_t status)
+{
+  union pdu_buf buf;
+  struct core_status_rsp rsp;
+
+  if (recv_rsp(client, &buf) < 0)
+    return -1;
+
+  if (buf.pdu.service != service || buf.pdu.opcode != OPCODE_CORE_ERROR) {
+    fprintf(stderr, "expected error response, got PDU(0x%x:0x%x)\n",
+            buf.pdu.service, buf.pdu.opcode);
+    return -1;
+  }
+  if (read_core_status_rsp(&buf.pdu, 0, &rsp) < 0)
+    return -1;
+  if (rsp.status != status) {
+    fprintf(stderr, "expected status %u, got %u\n", status, rsp.status);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Checks
+ */
+
+static int
+check_unknown_opcode(struct client* client)
+{
+  if (send_cmd(client, SERVICE_CORE, OPCODE_CORE_UNKNOWN, NULL, 0) < 0)
+    return -1;
+
+  return expect_error(client, SERVICE_CORE, BT_STATUS_UNSUPPORTED);
+}
+
+static int
+check_invalid_length(struct client* client)
+{
+  static const uint8_t data[1] = { SERVICE_BT_CORE };
+
+  /* misses the mode */
+  if (send_cmd(client, SERVICE_CORE, OPCODE_CORE_REGISTER_MODULE,
+               data, sizeof(data)) < 0)
+    return -1;
+
+  return expect_error(client, SERVICE_CORE, BT_STATUS_PARM_INVALID);
+}
+
+/* Runs after the invalid commands on the same session. The service
+ * might have been registered before, so any response will do. */
+static int
+check_session_open(struct client* client)
+{
+  const struct core_register_module_cmd msg = {
+    .service = SERVICE_BT_CORE,
+    .mode = 0
+  };
+  uint8_t data[core_register_module_cmd_len];
+  union pdu_buf buf;
+
+  encode_core_register_module_cmd(data, &msg);
+
+  if (send_cmd(client, SERVICE_CORE, OPCODE_CORE_REGISTER_MODULE,
+               data, sizeof(data)) < 0)
+    return -1;
+
+  if (recv_rsp(client, &buf) < 0)
+    return -1;
+
+  if (buf.pdu.service != SERVICE_CORE ||
+      (buf.pdu.opcode != OPCODE_CORE_REGISTER_MODULE &&
+       buf.pdu.opcode != OPCODE_CORE_ERROR)) {
+    fprintf(stderr, "unexpected response PDU(0x%x:0x%x)\n",
+            buf.pdu.service, buf.pdu.opcode);
+    return -1;
+  }
+  return 0;
+}
+
+/* A batched command that returns file descriptors has to be rejected
+ * before it runs. Otherwise it would open a ring that the client
+ * never gets, and check_ntf_ring() would fail. */
+static int
+check_batched_ntf_ring(struct client* client)
+{
+  const struct core_batch_cmd batch = {
+    .count = 1
+  };
+  const struct core_open_ntf_ring_cmd msg = {
+    .size = 0
+  };
+  union pdu_buf cmd, buf;
+  struct core_batch_rsp batch_rsp;
+  struct core_batch_entry_rsp entry_rsp;
+  union {
+    struct pdu pdu;
+    unsigned char raw[sizeof(struct pdu) + core_open_ntf_ring_cmd_len];
+  } entry;
+
+  init_pdu(&entry.pdu, SERVICE_CORE, OPCODE_CORE_OPEN_NTF_RING);
+  append_core_open_ntf_ring_cmd(&entry.pdu, &msg);
+
+  init_pdu(&cmd.pdu, SERVICE_CORE, OPCODE_CORE_BATCH);
+  append_core_batch_cmd(&cmd.pdu, &batch);
+  append_mem_to_pdu(&cmd.pdu, entry.raw, pdu_size(&entry.pdu));
+
+  if (send_cmd(client, SERVICE_CORE, OPCODE_CORE_BATCH,
+               cmd.pdu.data, cmd.pdu.len) < 0)
+    return -1;
+
+  if (recv_rsp(client, &buf) < 0)
+    return -1;
+
+  if (buf.pdu.opcode != OPCODE_CORE_BATCH ||
+      read_core_batch_rsp(&buf.pdu, 0, &batch_rsp) < 0 ||
+      batch_rsp.count != 1 ||
+      read_core_batch_entry_rsp(&buf.pdu, core_batch_rsp_len,
+                                &entry_rsp) < 0) {
+    fprintf(stderr, "invalid batch response PDU(0x%x:0x%x)\n",
+            buf.pdu.service, buf.pdu.opcode);
+    return -1;
+  }
+  if (entry_rsp.status != BT_STATUS_UNSUPPORTED) {
+    fprintf(stderr, "expected status %u, got %u\n",
+            BT_STATUS_UNSUPPORTED, entry_rsp.status);
+    return -1;
+  }
+  return 0;
+}
+
+/* The client mustn't be able to resize the ring's memfd under the
+ * daemon's mapping, and even the smallest ring has to hold a PDU of
+ * maximum size. This opens the session's only ring. */
+static int
+check_ntf_ring(struct client* client)
+{
+  const struct core_open_ntf_ring_cmd msg = {
+    .size = 1
+  };
+  uint8_t data[core_open_ntf_ring_cmd_len];
+  union pdu_buf buf;
+  int fd[MAX_FDS];
+  unsigned long nfds;
+  struct stat st;
+  struct ntf_ring_shared* shared;
+  uint32_t size;
+
+  encode_core_open_ntf_ring_cmd(data, &msg);
+
+  if (send_cmd(client, SERVICE_CORE, OPCODE_CORE_OPEN_NTF_RING,
+               data, sizeof(data)) < 0)
+    return -1;
+
+  if (recv_rsp_with_fds(client, &buf, fd, &nfds) < 0)
+    return -1;
+
+  if (buf.pdu.opcode != OPCODE_CORE_OPEN_NTF_RING || nfds != 2) {
+    fprintf(stderr, "expected ring fds, got PDU(0x%x:0x%x) with %lu fds\n",
+            buf.pdu.service, buf.pdu.opcode, nfds);
+    goto err_opcode;
+  }
+  if (fstat(fd[0], &st) < 0) {
+    ALOGE_ERRNO("fstat");
+    goto err_fstat;
+  }
+  if (!ftruncate(fd[0], 0) || !ftruncate(fd[0], st.st_size + 4096)) {
+    fprintf(stderr, "client can resize the ring's memfd\n");
+    goto err_ftruncate;
+  }
+
+  shared = mmap(NULL, sizeof(*shared), PROT_READ, MAP_SHARED, fd[0], 0);
+  if (shared == MAP_FAILED) {
+    ALOGE_ERRNO("mmap");
+    goto err_mmap;
+  }
+  size = shared->size;
+  if (munmap(shared, sizeof(*shared)) < 0)
+    ALOGW_ERRNO("munmap");
+
+  if (size < sizeof(buf.raw)) {
+    fprintf(stderr, "ring of %u bytes can't hold a maximum-size PDU\n",
+            size);
+    goto err_size;
+  }
+  close_fds(fd, nfds);
+
+  return 0;
+err_size:
+err_mmap:
+err_ftruncate:
+err_fstat:
+err_opcode:
+  close_fds(fd, nfds);
+  return -1;
+}
+
+/* Property values are packed into the PDU at odd offsets. The HAL
+ * dereferences scalar values as typed pointers, so the daemon has to
+ * pass an aligned copy; the simulated HAL rejects misaligned ones.
+ * Needs SERVICE_BT_CORE, which check_session_open() registers. */
+static int
+check_scalar_property(struct client* client)
+{
+  uint32_t scan_mode;
+  bt_property_t property;
+  union pdu_buf cmd, buf;
+
+  scan_mode = BT_SCAN_MODE_CONNECTABLE;
+  property.type = BT_PROPERTY_ADAPTER_SCAN_MODE;
+  property.len = sizeof(scan_mode);
+  property.val = &scan_mode;
+
+  init_pdu(&cmd.pdu, SERVICE_BT_CORE, OPCODE_BT_CORE_SET_ADAPTER_PROPERTY);
+  append_bt_property_t(&cmd.pdu, &property);
+
+  if (send_cmd(client, SERVICE_BT_CORE, OPCODE_BT_CORE_SET_ADAPTER_PROPERTY,
+               cmd.pdu.data, cmd.pdu.len) < 0)
+    return -1;
+
+  if (recv_rsp(client, &buf) < 0)
+    return -1;
+
+  if (buf.pdu.service != SERVICE_BT_CORE ||
+      buf.pdu.opcode != OPCODE_BT_CORE_SET_ADAPTER_PROPERTY) {
+    fprintf(stderr, "expected success, got PDU(0x%x:0x%x)\n",
+            buf.pdu.service, buf.pdu.opcode);
+    return -1;
+  }
+  return 0;
+}
+
+static const struct {
+  const char* name;
+  int (*run)(struct client*);
+} check[] = {
+  { "unknown opcode", check_unknown_opcode },
+  { "invalid length", check_invalid_length },
+  { "session stays open", check_session_open },
+  { "scalar property value", check_scalar_property },
+  { "batched ring rejected", check_batched_ntf_ring },
+  { "notification ring", check_ntf_ring }
+};
+
+#define NCHECKS (sizeof(check) / sizeof(check[0]))
+
+static int
+parse_options(int argc, char* argv[])
+{
+  int c;
+
+  while ((c = getopt(argc, argv, "Ps:")) != -1) {
+    switch (c) {
+      case 'P':
+        opt.seqpacket = 1;
+        break;
+      case 's':
+        opt.path = optarg;
+        break;
+      default:
+        return -1;
+    }
+  }
+  return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+  struct client client;
+  unsigned long i, nfailed;
+
+  if (parse_options(argc, argv) < 0)
+    goto err_parse_options;
+
+  if (open_client(&client) < 0)
+    goto err_open_client;
+
+  for (i = 0, nfailed = 0; i < NCHECKS; ++i) {
+    if (check[i].run(&client) < 0) {
+      printf("%-24s FAIL\n", check[i].name);
+      ++nfailed;
+    } else {
+      printf("%-24s ok\n", check[i].name);
+    }
+  }
+
+  close_client(&client);
+
+  if (nfailed)
+    exit(EXIT_FAILURE);
+
+  exit(EXIT_SUCCESS);
+err_open_client:
+err_parse_options:
+  exit(EXIT_FAILURE);
+}
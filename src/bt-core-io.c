@@ -4,11 +4,16 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "log.h"
 #include "task.h"
 #include "bt-proto.h"
 #include "bt-pdubuf.h"
+#include "pdu-codec.h"
+#include "ntf-queue.h"
+#include "service.h"
 #include "bt-core.h"
 #include "bt-core-io.h"
 
@@ -50,15 +55,38 @@ enum {
 
 static void (*send_pdu)(struct pdu_wbuf* wbuf);
 
+/* How the notification backlog treats each notification under
+ * overload. Discovery can report hundreds of devices per second, so
+ * device-found notifications go first. Superseded state updates are
+ * coalesced. Pairing requests and everything else are never dropped.
+ */
+static const unsigned char ntf_policy[256] = {
+  [OPCODE_ADAPTER_STATE_CHANGED_NTF] = NTF_POLICY_COALESCE_LATEST,
+  [OPCODE_DEVICE_FOUND_NTF] = NTF_POLICY_DROP_OLDEST,
+  [OPCODE_DISCOVERY_STATE_CHANGED_NTF] = NTF_POLICY_COALESCE_LATEST
+};
+
+/* Notifications that a user or the remote device waits for. They
+ * bypass notification coalescing. */
+static const unsigned char ntf_urgent[256] = {
+  [OPCODE_PIN_REQUEST_NTF] = 1,
+  [OPCODE_SSP_REQUEST_NTF] = 1,
+  [OPCODE_BOND_STATE_CHANGED_NTF] = 1
+};
+
 static int
 send_ntf_pdu(void* data)
 {
+  struct pdu_wbuf* wbuf = data;
+
   /* send notification on I/O thread */
   if (!send_pdu) {
     ALOGE("send_pdu is NULL");
     return 0;
   }
-  send_pdu(data);
+  wbuf->policy = ntf_policy[wbuf->buf.pdu.opcode];
+  wbuf->urgent = ntf_urgent[wbuf->buf.pdu.opcode];
+  send_pdu(wbuf);
   return 0;
 }
 
@@ -83,7 +111,7 @@ build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
 
   iov = pdu_wbuf_tail(wbuf);
   iov->iov_base = wbuf->buf.raw;
-  iov->iov_len = wbuf->off;
+  iov->iov_len = pdu_size(&wbuf->buf.pdu);
 
   memset(&wbuf->msg, 0, sizeof(wbuf->msg));
   wbuf->msg.msg_iov = iov;
@@ -99,17 +127,22 @@ build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
 static void
 adapter_state_changed_cb(bt_state_t state)
 {
+  const struct bt_core_adapter_state_changed_ntf ntf = {
+    .state = state
+  };
   struct pdu_wbuf* wbuf;
 
-  wbuf = create_pdu_wbuf(1, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_pdu_wbuf(bt_core_adapter_state_changed_ntf_len,
+                         sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE, OPCODE_ADAPTER_STATE_CHANGED_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)state) < 0)
+  if (append_bt_core_adapter_state_changed_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_STATE, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -121,18 +154,22 @@ static void
 adapter_properties_cb(bt_status_t status, int num_properties,
                       bt_property_t* properties)
 {
+  const struct bt_core_adapter_properties_changed_ntf ntf = {
+    .status = status,
+    .num_properties = num_properties
+  };
   struct pdu_wbuf* wbuf;
   int i;
 
-  wbuf = create_pdu_wbuf(2 + properties_length(num_properties, properties),
+  wbuf = create_pdu_wbuf(bt_core_adapter_properties_changed_ntf_len +
+                         properties_length(num_properties, properties),
                          sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE,
            OPCODE_ADAPTER_PROPERTIES_CHANGED_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "CC",
-                    (uint8_t)status, (uint8_t)num_properties) < 0)
+  if (append_bt_core_adapter_properties_changed_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
   for (i = 0; i < num_properties; ++i) {
@@ -140,7 +177,8 @@ adapter_properties_cb(bt_status_t status, int num_properties,
       goto cleanup;
   }
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_BULK, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -154,22 +192,23 @@ remote_device_properties_cb(bt_status_t status,
                             int num_properties,
                             bt_property_t* properties)
 {
+  const struct bt_core_remote_device_properties_ntf ntf = {
+    .status = status,
+    .bd_addr = *bd_addr,
+    .num_properties = num_properties
+  };
   struct pdu_wbuf* wbuf;
-  long off;
   int i;
 
-  wbuf = create_pdu_wbuf(8 + properties_length(num_properties, properties),
+  wbuf = create_pdu_wbuf(bt_core_remote_device_properties_ntf_len +
+                         properties_length(num_properties, properties),
                          sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE,
            OPCODE_REMOTE_DEVICE_PROPERTIES_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)status) < 0)
-    goto cleanup;
-  if (append_bt_bdaddr_t(&wbuf->buf.pdu, bd_addr) < 0)
-    goto cleanup;
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)num_properties) < 0)
+  if (append_bt_core_remote_device_properties_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
   for (i = 0; i < num_properties; ++i) {
@@ -177,7 +216,8 @@ remote_device_properties_cb(bt_status_t status,
       goto cleanup;
   }
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_BULK, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -188,18 +228,20 @@ cleanup:
 static void
 device_found_cb(int num_properties, bt_property_t* properties)
 {
+  const struct bt_core_device_found_ntf ntf = {
+    .num_properties = num_properties
+  };
   struct pdu_wbuf* wbuf;
-  long off;
   int i;
 
-  wbuf = create_pdu_wbuf(1 + properties_length(num_properties, properties),
+  wbuf = create_pdu_wbuf(bt_core_device_found_ntf_len +
+                         properties_length(num_properties, properties),
                          sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
-  init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE,
-           OPCODE_REMOTE_DEVICE_PROPERTIES_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)num_properties) < 0)
+  init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE, OPCODE_DEVICE_FOUND_NTF);
+  if (append_bt_core_device_found_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
   for (i = 0; i < num_properties; ++i) {
@@ -207,7 +249,8 @@ device_found_cb(int num_properties, bt_property_t* properties)
       goto cleanup;
   }
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_BULK, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -218,18 +261,23 @@ cleanup:
 static void
 discovery_state_changed_cb(bt_discovery_state_t state)
 {
+  const struct bt_core_discovery_state_changed_ntf ntf = {
+    .state = state
+  };
   struct pdu_wbuf* wbuf;
 
-  wbuf = create_pdu_wbuf(1, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_pdu_wbuf(bt_core_discovery_state_changed_ntf_len,
+                         sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE,
            OPCODE_DISCOVERY_STATE_CHANGED_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)state) < 0)
+  if (append_bt_core_discovery_state_changed_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_STATE, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -241,22 +289,24 @@ static void
 pin_request_cb(bt_bdaddr_t* remote_bd_addr, bt_bdname_t* bd_name,
                uint32_t cod)
 {
+  const struct bt_core_pin_request_ntf ntf = {
+    .remote_bd_addr = *remote_bd_addr,
+    .bd_name = *bd_name,
+    .cod = cod
+  };
   struct pdu_wbuf* wbuf;
-  long off;
 
-  wbuf = create_pdu_wbuf(259, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_pdu_wbuf(bt_core_pin_request_ntf_len,
+                         sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE, OPCODE_PIN_REQUEST_NTF);
-  if (append_bt_bdaddr_t(&wbuf->buf.pdu, remote_bd_addr) < 0)
-    goto cleanup;
-  if (append_bt_bdname_t(&wbuf->buf.pdu, bd_name) < 0)
-    goto cleanup;
-  if (append_to_pdu(&wbuf->buf.pdu, "I", cod) < 0)
+  if (append_bt_core_pin_request_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_INTERACTIVE, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -269,23 +319,26 @@ ssp_request_cb(bt_bdaddr_t* remote_bd_addr, bt_bdname_t* bd_name,
                uint32_t cod, bt_ssp_variant_t pairing_variant,
                uint32_t pass_key)
 {
+  const struct bt_core_ssp_request_ntf ntf = {
+    .remote_bd_addr = *remote_bd_addr,
+    .bd_name = *bd_name,
+    .cod = cod,
+    .pairing_variant = pairing_variant,
+    .pass_key = pass_key
+  };
   struct pdu_wbuf* wbuf;
-  long off;
 
-  wbuf = create_pdu_wbuf(264, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_pdu_wbuf(bt_core_ssp_request_ntf_len,
+                         sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE, OPCODE_SSP_REQUEST_NTF);
-  if (append_bt_bdaddr_t(&wbuf->buf.pdu, remote_bd_addr) < 0)
-    goto cleanup;
-  if (append_bt_bdname_t(&wbuf->buf.pdu, bd_name) < 0)
-    goto cleanup;
-  if (append_to_pdu(&wbuf->buf.pdu, "ICI", cod,
-                    (uint8_t)pairing_variant, pass_key) < 0)
+  if (append_bt_core_ssp_request_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_INTERACTIVE, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -297,49 +350,53 @@ static void
 bond_state_changed_cb(bt_status_t status, bt_bdaddr_t* remote_bd_addr,
                       bt_bond_state_t state)
 {
+  const struct bt_core_bond_state_changed_ntf ntf = {
+    .status = status,
+    .remote_bd_addr = *remote_bd_addr,
+    .state = state
+  };
   struct pdu_wbuf* wbuf;
-  long off;
 
-  wbuf = create_pdu_wbuf(8, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_pdu_wbuf(bt_core_bond_state_changed_ntf_len,
+                         sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE, OPCODE_BOND_STATE_CHANGED_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)status) < 0)
-    goto cleanup;
-  if (append_bt_bdaddr_t(&wbuf->buf.pdu, remote_bd_addr) < 0)
-    goto cleanup;
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)state) < 0)
+  if (append_bt_core_bond_state_changed_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_INTERACTIVE, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
 cleanup:
-  cleanup_pdu_wbuf(build_pdu_wbuf_msg(wbuf));
+  cleanup_pdu_wbuf(wbuf);
 }
 
 static void
 acl_state_changed_cb(bt_status_t status, bt_bdaddr_t* remote_bd_addr,
                      bt_acl_state_t state)
 {
+  const struct bt_core_acl_state_changed_ntf ntf = {
+    .status = status,
+    .remote_bd_addr = *remote_bd_addr,
+    .state = state
+  };
   struct pdu_wbuf* wbuf;
-  long off;
 
-  wbuf = create_pdu_wbuf(8, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_pdu_wbuf(bt_core_acl_state_changed_ntf_len,
+                         sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE, OPCODE_ACL_STATE_CHANGED_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)status) < 0)
-    goto cleanup;
-  if (append_bt_bdaddr_t(&wbuf->buf.pdu, remote_bd_addr) < 0)
-    goto cleanup;
-  if (append_to_pdu(&wbuf->buf.pdu, "C", (uint8_t)state) < 0)
+  if (append_bt_core_acl_state_changed_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_STATE, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -356,18 +413,25 @@ thread_evt_cb(bt_cb_thread_evt evt)
 static void
 dut_mode_recv_cb(uint16_t opcode, uint8_t* buf, uint8_t len)
 {
+  const struct bt_core_dut_mode_receive_ntf ntf = {
+    .opcode = opcode,
+    .len = len
+  };
   struct pdu_wbuf* wbuf;
-  long off;
 
-  wbuf = create_pdu_wbuf(3 + len, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_pdu_wbuf(bt_core_dut_mode_receive_ntf_len + len,
+                         sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE, OPCODE_DUT_MODE_RECEIVE_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "SCm", opcode, len, buf, (size_t)len) < 0)
+  if (append_bt_core_dut_mode_receive_ntf(&wbuf->buf.pdu, &ntf) < 0)
+    goto cleanup;
+  if (append_mem_to_pdu(&wbuf->buf.pdu, buf, len) < 0)
     goto cleanup;
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_STATE, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -379,19 +443,23 @@ cleanup:
 static void
 le_test_mode_cb(bt_status_t status, uint16_t num_packets)
 {
+  const struct bt_core_le_test_mode_ntf ntf = {
+    .status = status,
+    .num_packets = num_packets
+  };
   struct pdu_wbuf* wbuf;
-  long off;
 
-  wbuf = create_pdu_wbuf(3, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_pdu_wbuf(bt_core_le_test_mode_ntf_len,
+                         sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return;
 
   init_pdu(&wbuf->buf.pdu, SERVICE_BT_CORE, OPCODE_LE_TEST_MODE_NTF);
-  if (append_to_pdu(&wbuf->buf.pdu, "CS",
-                    (uint8_t)status, (uint16_t)num_packets) < 0)
+  if (append_bt_core_le_test_mode_ntf(&wbuf->buf.pdu, &ntf) < 0)
     goto cleanup;
 
-  if (run_task(send_ntf_pdu, build_pdu_wbuf_msg(wbuf)) < 0)
+  if (run_task(TASK_CLASS_STATE, send_ntf_pdu,
+               build_pdu_wbuf_msg(wbuf)) < 0)
     goto cleanup;
 
   return;
@@ -400,7 +468,7 @@ cleanup:
 }
 #endif
 
-static const bt_callbacks_t bt_callbacks = {
+static bt_callbacks_t bt_callbacks = {
   .size = sizeof(bt_callbacks),
   .adapter_state_changed_cb = adapter_state_changed_cb,
   .adapter_properties_cb = adapter_properties_cb,
@@ -422,13 +490,35 @@ static const bt_callbacks_t bt_callbacks = {
  * Commands/Responses
  */
 
+/* The HAL casts property values to their types, such as uint32_t*
+ * or bt_scan_mode_t*. Values in a PDU are packed at any offset, so a
+ * misaligned value is copied to the command arena, which aligns for
+ * all property types. The copy is valid until the command has been
+ * handled. Returns 0 on success, or -1 if the arena is exhausted. */
+static int
+align_bt_property_t(bt_property_t* property)
+{
+  void* val;
+
+  if (!((uintptr_t)property->val & (sizeof(void*) - 1)))
+    return 0;
+
+  val = alloc_cmd_arena(property->len);
+  if (!val)
+    return -1;
+  memcpy(val, property->val, property->len);
+  property->val = val;
+
+  return 0;
+}
+
 static bt_status_t
 enable(const struct pdu* cmd)
 {
   struct pdu_wbuf* wbuf;
   int status;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
@@ -451,7 +541,7 @@ disable(const struct pdu* cmd)
   struct pdu_wbuf* wbuf;
   int status;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
@@ -474,7 +564,7 @@ get_adapter_properties(const struct pdu* cmd)
   struct pdu_wbuf* wbuf;
   int status;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
@@ -494,18 +584,18 @@ err_bt_core_get_adapter_properties:
 static bt_status_t
 get_adapter_property(const struct pdu* cmd)
 {
-  uint8_t type;
+  struct bt_core_get_adapter_property_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  if (read_pdu_at(cmd, 0, "C", &type) < 0)
+  if (read_bt_core_get_adapter_property_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_get_adapter_property(type);
+  status = bt_core_get_adapter_property(msg.type);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_get_adapter_property;
 
@@ -527,45 +617,41 @@ set_adapter_property(const struct pdu* cmd)
 
   if (read_bt_property_t(cmd, 0, &property) < 0)
     return BT_STATUS_PARM_INVALID;
+  if (align_bt_property_t(&property) < 0)
+    return BT_STATUS_NOMEM;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
-  if (!wbuf) {
-    status = BT_STATUS_NOMEM;
-    goto err_create_pdu_wbuf;
-  }
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  if (!wbuf)
+    return BT_STATUS_NOMEM;
 
   status = bt_core_set_adapter_property(&property);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_get_adapter_properties;
 
-  free(property.val);
-
   init_pdu(&wbuf->buf.pdu, cmd->service, cmd->opcode);
   send_pdu(build_pdu_wbuf_msg(wbuf));
 
   return BT_STATUS_SUCCESS;
 err_bt_core_get_adapter_properties:
   cleanup_pdu_wbuf(wbuf);
-err_create_pdu_wbuf:
-  free(property.val);
   return status;
 }
 
 static bt_status_t
 get_remote_device_properties(const struct pdu* cmd)
 {
-  bt_bdaddr_t remote_addr;
+  struct bt_core_get_remote_device_properties_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  if (read_bt_bdaddr_t(cmd, 0, &remote_addr) < 0)
+  if (read_bt_core_get_remote_device_properties_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_get_remote_device_properties(&remote_addr);
+  status = bt_core_get_remote_device_properties(&msg.remote_addr);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_get_remote_device_properties;
 
@@ -581,23 +667,18 @@ err_bt_core_get_remote_device_properties:
 static bt_status_t
 get_remote_device_property(const struct pdu* cmd)
 {
-  long off;
-  bt_bdaddr_t remote_addr;
-  uint8_t type;
+  struct bt_core_get_remote_device_property_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  off = read_bt_bdaddr_t(cmd, 0, &remote_addr);
-  if (off < 0)
-    return BT_STATUS_PARM_INVALID;
-  if (read_pdu_at(cmd, off, "C", &type) < 0)
+  if (read_bt_core_get_remote_device_property_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_get_remote_device_property(&remote_addr, type);
+  status = bt_core_get_remote_device_property(&msg.remote_addr, msg.type);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_get_remote_device_property;
 
@@ -614,60 +695,51 @@ static bt_status_t
 set_remote_device_property(const struct pdu* cmd)
 {
   long off;
-  bt_bdaddr_t remote_addr;
+  struct bt_core_set_remote_device_property_cmd msg;
   bt_property_t property;
   struct pdu_wbuf* wbuf;
   int status;
 
-  off = read_bt_bdaddr_t(cmd, 0, &remote_addr);
+  off = read_bt_core_set_remote_device_property_cmd(cmd, 0, &msg);
   if (off < 0)
     return BT_STATUS_PARM_INVALID;
   if (read_bt_property_t(cmd, off, &property) < 0)
     return BT_STATUS_PARM_INVALID;
+  if (align_bt_property_t(&property) < 0)
+    return BT_STATUS_NOMEM;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
-  if (!wbuf) {
-    status = BT_STATUS_NOMEM;
-    goto err_create_pdu_wbuf;
-  }
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  if (!wbuf)
+    return BT_STATUS_NOMEM;
 
-  status = bt_core_set_remote_device_property(&remote_addr, &property);
+  status = bt_core_set_remote_device_property(&msg.remote_addr, &property);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_set_remote_device_property;
 
-  free(property.val);
-
   init_pdu(&wbuf->buf.pdu, cmd->service, cmd->opcode);
   send_pdu(build_pdu_wbuf_msg(wbuf));
 
   return BT_STATUS_SUCCESS;
 err_bt_core_set_remote_device_property:
   cleanup_pdu_wbuf(wbuf);
-err_create_pdu_wbuf:
-  free(property.val);
   return status;
 }
 
 static bt_status_t
 get_remote_service_record(const struct pdu* cmd)
 {
-  long off;
-  bt_bdaddr_t remote_addr;
-  bt_uuid_t uuid;
+  struct bt_core_get_remote_service_record_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  off = read_bt_bdaddr_t(cmd, 0, &remote_addr);
-  if (off < 0)
-    return BT_STATUS_PARM_INVALID;
-  if (read_bt_uuid_t(cmd, off, &uuid) < 0)
+  if (read_bt_core_get_remote_service_record_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_get_remote_service_record(&remote_addr, &uuid);
+  status = bt_core_get_remote_service_record(&msg.remote_addr, &msg.uuid);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_get_remote_service_record;
 
@@ -683,18 +755,18 @@ err_bt_core_get_remote_service_record:
 static bt_status_t
 get_remote_services(const struct pdu* cmd)
 {
-  bt_bdaddr_t remote_addr;
+  struct bt_core_get_remote_services_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  if (read_bt_bdaddr_t(cmd, 0, &remote_addr) < 0)
+  if (read_bt_core_get_remote_services_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_get_remote_services(&remote_addr);
+  status = bt_core_get_remote_services(&msg.remote_addr);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_get_remote_services;
 
@@ -713,7 +785,7 @@ start_discovery(const struct pdu* cmd)
   struct pdu_wbuf* wbuf;
   int status;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
@@ -736,7 +808,7 @@ cancel_discovery(const struct pdu* cmd)
   struct pdu_wbuf* wbuf;
   int status;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
@@ -756,18 +828,18 @@ err_bt_core_cancel_discovery:
 static bt_status_t
 create_bond(const struct pdu* cmd)
 {
-  bt_bdaddr_t bd_addr;
+  struct bt_core_create_bond_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  if (read_bt_bdaddr_t(cmd, 0, &bd_addr) < 0)
+  if (read_bt_core_create_bond_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_create_bond(&bd_addr);
+  status = bt_core_create_bond(&msg.bd_addr);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_create_bond;
 
@@ -783,18 +855,18 @@ err_bt_core_create_bond:
 static bt_status_t
 remove_bond(const struct pdu* cmd)
 {
-  bt_bdaddr_t bd_addr;
+  struct bt_core_remove_bond_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  if (read_bt_bdaddr_t(cmd, 0, &bd_addr) < 0)
+  if (read_bt_core_remove_bond_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_remove_bond(&bd_addr);
+  status = bt_core_remove_bond(&msg.bd_addr);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_remove_bond;
 
@@ -810,18 +882,18 @@ err_bt_core_remove_bond:
 static bt_status_t
 cancel_bond(const struct pdu* cmd)
 {
-  bt_bdaddr_t bd_addr;
+  struct bt_core_cancel_bond_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  if (read_bt_bdaddr_t(cmd, 0, &bd_addr) < 0)
+  if (read_bt_core_cancel_bond_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_cancel_bond(&bd_addr);
+  status = bt_core_cancel_bond(&msg.bd_addr);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_remove_bond;
 
@@ -837,28 +909,19 @@ err_bt_core_remove_bond:
 static bt_status_t
 pin_reply(const struct pdu* cmd)
 {
-  long off;
-  bt_bdaddr_t bd_addr;
-  uint8_t accept;
-  uint8_t pin_len;
-  bt_pin_code_t pin_code;
+  struct bt_core_pin_reply_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  off = read_bt_bdaddr_t(cmd, 0, &bd_addr);
-  if (off < 0)
-    return BT_STATUS_PARM_INVALID;
-  off = read_pdu_at(cmd, off, "CC", &accept, &pin_len);
-  if (off < 0)
-    return BT_STATUS_PARM_INVALID;
-  if (read_bt_pin_code_t(cmd, off, &pin_code) < 0)
+  if (read_bt_core_pin_reply_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_pin_reply(&bd_addr, accept, pin_len, &pin_code);
+  status = bt_core_pin_reply(&msg.bd_addr, msg.accept, msg.pin_len,
+                             &msg.pin_code);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_pin_reply;
 
@@ -874,25 +937,19 @@ err_bt_core_pin_reply:
 static bt_status_t
 ssp_reply(const struct pdu* cmd)
 {
-  long off;
-  bt_bdaddr_t bd_addr;
-  uint8_t variant;
-  uint8_t accept;
-  uint32_t passkey;
+  struct bt_core_ssp_reply_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  off = read_bt_bdaddr_t(cmd, 0, &bd_addr);
-  if (off < 0)
-    return BT_STATUS_PARM_INVALID;
-  if (read_pdu_at(cmd, off, "CCI", &variant, &accept, &passkey) < 0)
+  if (read_bt_core_ssp_reply_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_ssp_reply(&bd_addr, variant, accept, passkey);
+  status = bt_core_ssp_reply(&msg.bd_addr, msg.variant, msg.accept,
+                             msg.passkey);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_ssp_reply;
 
@@ -908,18 +965,18 @@ err_bt_core_ssp_reply:
 static bt_status_t
 dut_mode_configure(const struct pdu* cmd)
 {
-  uint8_t enable;
+  struct bt_core_dut_mode_configure_cmd msg;
   struct pdu_wbuf* wbuf;
   int status;
 
-  if (read_pdu_at(cmd, 0, "C", &enable) < 0)
+  if (read_bt_core_dut_mode_configure_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_dut_mode_configure(enable);
+  status = bt_core_dut_mode_configure(msg.enable);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_dut_mode_configure;
 
@@ -936,23 +993,25 @@ static bt_status_t
 dut_mode_send(const struct pdu* cmd)
 {
   long off;
-  uint16_t opcode;
-  uint8_t len;
-  uint8_t buf[256];
+  struct bt_core_dut_mode_send_cmd msg;
+  uint8_t* buf;
   struct pdu_wbuf* wbuf;
   int status;
 
-  off = read_pdu_at(cmd, 0, "SC", &opcode, &len);
+  off = read_bt_core_dut_mode_send_cmd(cmd, 0, &msg);
   if (off < 0)
     return BT_STATUS_PARM_INVALID;
-  if (read_pdu_at(cmd, off, "m", buf, len) < 0)
+  buf = alloc_cmd_arena(msg.len);
+  if (!buf)
+    return BT_STATUS_NOMEM;
+  if (read_pdu_mem_at(cmd, off, buf, msg.len) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_dut_mode_send(opcode, buf, len);
+  status = bt_core_dut_mode_send(msg.opcode, buf, msg.len);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_dut_mode_send;
 
@@ -969,23 +1028,25 @@ static bt_status_t
 le_test_mode(const struct pdu* cmd)
 {
   long off;
-  uint16_t opcode;
-  uint8_t len;
-  uint8_t buf[256];
+  struct bt_core_le_test_mode_cmd msg;
+  uint8_t* buf;
   struct pdu_wbuf* wbuf;
   int status;
 
-  off = read_pdu_at(cmd, 0, "SC", &opcode, &len);
+  off = read_bt_core_le_test_mode_cmd(cmd, 0, &msg);
   if (off < 0)
     return BT_STATUS_PARM_INVALID;
-  if (read_pdu_at(cmd, off, "m", buf, len) < 0)
+  buf = alloc_cmd_arena(msg.len);
+  if (!buf)
+    return BT_STATUS_NOMEM;
+  if (read_pdu_mem_at(cmd, off, buf, msg.len) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_core_le_test_mode(opcode, buf, len);
+  status = bt_core_le_test_mode(msg.opcode, buf, msg.len);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_core_le_test_mode;
 
@@ -998,51 +1059,105 @@ err_bt_core_le_test_mode:
   return status;
 }
 
-static bt_status_t
-bt_core_handler(const struct pdu* cmd)
-{
-  static bt_status_t (* const handler[256])(const struct pdu*) = {
-    [OPCODE_ENABLE] = enable,
-    [OPCODE_DISABLE] = disable,
-    [OPCODE_GET_ADAPTER_PROPERTIES] = get_adapter_properties,
-    [OPCODE_GET_ADAPTER_PROPERTY] = get_adapter_property,
-    [OPCODE_SET_ADAPTER_PROPERTY] = set_adapter_property,
-    [OPCODE_GET_REMOTE_DEVICE_PROPERTIES] = get_remote_device_properties,
-    [OPCODE_GET_REMOTE_DEVICE_PROPERTY] = get_remote_device_property,
-    [OPCODE_SET_REMOTE_DEVICE_PROPERTY] = set_remote_device_property,
-    [OPCODE_GET_REMOTE_SERVICE_RECORD] = get_remote_service_record,
-    [OPCODE_GET_REMOTE_SERVICES] = get_remote_services,
-    [OPCODE_START_DISCOVERY] = start_discovery,
-    [OPCODE_CANCEL_DISCOVERY] = cancel_discovery,
-    [OPCODE_CREATE_BOND] = create_bond,
-    [OPCODE_REMOVE_BOND] = remove_bond,
-    [OPCODE_CANCEL_BOND] = cancel_bond,
-    [OPCODE_PIN_REPLY] = pin_reply,
-    [OPCODE_SSP_REPLY] = ssp_reply,
-    [OPCODE_DUT_MODE_CONFIGURE] = dut_mode_configure,
-    [OPCODE_DUT_MODE_SEND] = dut_mode_send,
-    [OPCODE_LE_TEST_MODE] = le_test_mode
-  };
-
-  return handle_pdu_by_opcode(cmd, handler);
-}
+/* Fixed-size commands carry exactly their fields; properties and
+ * DUT buffers follow a fixed-size part. */
+static const struct service_op bt_core_op[] = {
+  { OPCODE_ENABLE, TASK_CLASS_STATE,
+    0, 0,
+    enable },
+  { OPCODE_DISABLE, TASK_CLASS_STATE,
+    0, 0,
+    disable },
+  { OPCODE_GET_ADAPTER_PROPERTIES, TASK_CLASS_BULK,
+    0, 0,
+    get_adapter_properties },
+  { OPCODE_GET_ADAPTER_PROPERTY, TASK_CLASS_BULK,
+    bt_core_get_adapter_property_cmd_len, bt_core_get_adapter_property_cmd_len,
+    get_adapter_property },
+  { OPCODE_SET_ADAPTER_PROPERTY, TASK_CLASS_BULK,
+    bt_property_hdr_len, UINT16_MAX,
+    set_adapter_property },
+  { OPCODE_GET_REMOTE_DEVICE_PROPERTIES, TASK_CLASS_BULK,
+    bt_core_get_remote_device_properties_cmd_len,
+    bt_core_get_remote_device_properties_cmd_len,
+    get_remote_device_properties },
+  { OPCODE_GET_REMOTE_DEVICE_PROPERTY, TASK_CLASS_BULK,
+    bt_core_get_remote_device_property_cmd_len,
+    bt_core_get_remote_device_property_cmd_len,
+    get_remote_device_property },
+  { OPCODE_SET_REMOTE_DEVICE_PROPERTY, TASK_CLASS_BULK,
+    bt_core_set_remote_device_property_cmd_len + bt_property_hdr_len,
+    UINT16_MAX,
+    set_remote_device_property },
+  { OPCODE_GET_REMOTE_SERVICE_RECORD, TASK_CLASS_BULK,
+    bt_core_get_remote_service_record_cmd_len,
+    bt_core_get_remote_service_record_cmd_len,
+    get_remote_service_record },
+  { OPCODE_GET_REMOTE_SERVICES, TASK_CLASS_BULK,
+    bt_core_get_remote_services_cmd_len, bt_core_get_remote_services_cmd_len,
+    get_remote_services },
+  { OPCODE_START_DISCOVERY, TASK_CLASS_STATE,
+    0, 0,
+    start_discovery },
+  { OPCODE_CANCEL_DISCOVERY, TASK_CLASS_STATE,
+    0, 0,
+    cancel_discovery },
+  { OPCODE_CREATE_BOND, TASK_CLASS_INTERACTIVE,
+    bt_core_create_bond_cmd_len, bt_core_create_bond_cmd_len,
+    create_bond },
+  { OPCODE_REMOVE_BOND, TASK_CLASS_INTERACTIVE,
+    bt_core_remove_bond_cmd_len, bt_core_remove_bond_cmd_len,
+    remove_bond },
+  { OPCODE_CANCEL_BOND, TASK_CLASS_INTERACTIVE,
+    bt_core_cancel_bond_cmd_len, bt_core_cancel_bond_cmd_len,
+    cancel_bond },
+  { OPCODE_PIN_REPLY, TASK_CLASS_INTERACTIVE,
+    bt_core_pin_reply_cmd_len, bt_core_pin_reply_cmd_len,
+    pin_reply },
+  { OPCODE_SSP_REPLY, TASK_CLASS_INTERACTIVE,
+    bt_core_ssp_reply_cmd_len, bt_core_ssp_reply_cmd_len,
+    ssp_reply },
+  { OPCODE_DUT_MODE_CONFIGURE, TASK_CLASS_STATE,
+    bt_core_dut_mode_configure_cmd_len, bt_core_dut_mode_configure_cmd_len,
+    dut_mode_configure },
+  { OPCODE_DUT_MODE_SEND, TASK_CLASS_STATE,
+    bt_core_dut_mode_send_cmd_len, bt_core_dut_mode_send_cmd_len + UINT8_MAX,
+    dut_mode_send },
+  { OPCODE_LE_TEST_MODE, TASK_CLASS_STATE,
+    bt_core_le_test_mode_cmd_len, bt_core_le_test_mode_cmd_len + UINT8_MAX,
+    le_test_mode },
+  { 0, 0, 0, 0, NULL }
+};
 
-bt_status_t
-(*register_bt_core(unsigned char mode,
-                   void (*send_pdu_cb)(struct pdu_wbuf*)))(const struct pdu*)
+const struct service_op*
+register_bt_core(unsigned char mode, void (*send_pdu_cb)(struct pdu_wbuf*))
 {
-  assert(send_buf);
+  assert(send_pdu_cb);
 
   if (init_bt_core() < 0)
-    return NULL;
+    goto err_init_bt_core;
 
+  /* callbacks can arrive as soon as the HAL has been initialized */
   send_pdu = send_pdu_cb;
 
-  return bt_core_handler;
+  if (bt_core_init(&bt_callbacks) != BT_STATUS_SUCCESS) {
+    ALOGE("bt_core_init failed");
+    goto err_bt_core_init;
+  }
+
+  return bt_core_op;
+err_bt_core_init:
+  send_pdu = NULL;
+  uninit_bt_core();
+err_init_bt_core:
+  return NULL;
 }
 
 int
 unregister_bt_core()
 {
+  bt_core_cleanup();
+  uninit_bt_core();
+
   return 0;
 }
@@ -95,7 +95,7 @@ int
 bt_core_enable()
 {
   assert(bt_interface);
-  assert(bt_interface->enabled);
+  assert(bt_interface->enable);
 
   return bt_interface->enable();
 }
@@ -3,15 +3,24 @@
  * You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/queue.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <cutils/sockets.h>
 #include "log.h"
 #include "loop.h"
+#include "timer.h"
 #include "bt-proto.h"
 #include "bt-pdubuf.h"
+#include "pdu-codec.h"
+#include "ntf-queue.h"
+#include "ntf-ring.h"
 #include "service.h"
 #include "core.h"
 #include "core-io.h"
@@ -19,88 +28,602 @@
 
 #define BLUETOOTHD_SOCKET "bluetoothd"
 
+/* Optional listening socket of type SOCK_SEQPACKET. Its clients
+ * send and receive exactly one PDU per message. */
+#define BLUETOOTHD_SEQPACKET_SOCKET "bluetoothd_seqpacket"
+
+/* Size of the command socket's receive buffer. It holds multiple
+ * PDUs, which are all read with a single read(). */
+#define CMD_RBUF_SIZE 4096
+
+/* Limits of the notification backlog. Beyond these, notifications
+ * are dropped or coalesced according to their policy. */
+#define NTF_QUEUE_LIMIT_COUNT 256
+#define NTF_QUEUE_LIMIT_BYTES (64 * 1024)
+
+/* maximum number of connected clients */
+#define MAX_SESSIONS 128
+
+/* Delay before writing to a full notification ring again. The
+ * client doesn't signal free space. */
+#define NTF_RING_RETRY_MSEC 1
+
+/* messages per recvmmsg() and sendmmsg() on SOCK_SEQPACKET sockets */
+#define RECVMMSG_BATCH 16
+#define SENDMMSG_BATCH 64
+
+static struct bt_io_stats stats;
+
+static unsigned long ntf_coalesce_bytes = BT_IO_NTF_COALESCE_BYTES;
+static unsigned long ntf_coalesce_msec = BT_IO_NTF_COALESCE_MSEC;
+
+static int
+set_nonblock(int fd)
+{
+  int flags;
+
+  flags = TEMP_FAILURE_RETRY(fcntl(fd, F_GETFL));
+  if (flags < 0) {
+    ALOGE_ERRNO("fcntl");
+    return -1;
+  }
+  if (TEMP_FAILURE_RETRY(fcntl(fd, F_SETFL, flags | O_NONBLOCK)) < 0) {
+    ALOGE_ERRNO("fcntl");
+    return -1;
+  }
+  return 0;
+}
+
+/* Bionic's older releases lack the multi-message calls. */
+
+static int
+sys_recvmmsg(int fd, struct mmsghdr* msgvec, unsigned int vlen,
+             unsigned int flags)
+{
+  return syscall(__NR_recvmmsg, fd, msgvec, vlen, flags, NULL);
+}
+
+static int
+sys_sendmmsg(int fd, struct mmsghdr* msgvec, unsigned int vlen,
+             unsigned int flags)
+{
+  return syscall(__NR_sendmmsg, fd, msgvec, vlen, flags);
+}
+
 /*
- * Socket I/O
+ * Send queues
+ *
+ * Each socket has a queue of PDUs that the kernel hasn't taken yet;
+ * the first one might have been sent partially. send_pdu() appends
+ * to the queue and schedules a flush after the loop has served the
+ * currently ready fds, so PDUs that have been produced together get
+ * written by a single sendmsg(). EPOLLOUT is only polled for while
+ * the socket's buffer is full.
+ *
+ * Stream sockets send through the loop, which might send
+ * asynchronously. While a send is in progress, the queue waits for
+ * its completion and the PDUs stay queued, even if the socket gets
+ * closed meanwhile.
+ *
+ * The notification socket's queue is refilled from the notification
+ * backlog, which applies the overload policies while PDUs wait.
+ *
+ * The response and notification queues drain their own sockets and
+ * take turns in the loop's ready list. Per turn, a queue makes at
+ * most as many sendmsg() calls as its weight and then requeues
+ * itself behind the other ready fds. A notification storm thus
+ * delays a response by at most one notification turn.
+ *
+ * On SOCK_SEQPACKET sockets, each PDU is a message of its own and
+ * a batch of messages goes out with a single sendmmsg().
+ *
+ * A client can limit its notifications with credits. Each PDU that
+ * leaves the backlog costs a credit. Without credits, PDUs wait in
+ * the backlog, where the overload policies bound their memory.
+ *
+ * A client can have its notifications written into a shared-memory
+ * ring instead of its socket. PDUs that have been queued for the
+ * socket go out there first. While the ring is full, PDUs wait in
+ * the backlog and the queue retries after a short delay.
  */
 
-static int io_fd[2];
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define RSP_SEND_WEIGHT 4
+#define NTF_SEND_WEIGHT 1
+
+struct send_queue {
+  int fd;
+  uint32_t events; /* polled events, without EPOLLOUT */
+  void (*func)(int, uint32_t, void*);
+  void (*sent)(ssize_t, void*); /* completes asynchronous sends */
+  void* data;
+  int flush_scheduled;
+  int pollout;
+  int sending; /* asynchronous send in progress */
+  int seqpacket;
+  unsigned long weight; /* sendmsg() calls per turn */
+  STAILQ_HEAD(, pdu_wbuf_ref) refs;
+  unsigned long nrefs;
+  struct ntf_queue* backlog;
+  int credited; /* flow control by credits */
+  unsigned long credits;
+  struct ntf_ring* ring;
+  struct timer ring_timer;
+};
 
+/* A PDU's file descriptors go to the client with the PDU's first
+ * byte. The daemon closes its copies afterwards. */
 static void
-io_fd0_event_err(int fd, void* data)
+close_pdu_wbuf_fds(struct pdu_wbuf* wbuf)
 {
-  cleanup_pdu_rbuf(data);
-  remove_fd_from_epoll_loop(fd);
-  io_fd[0] = 0;
-  uninit_core_io();
+  struct cmsghdr* chdr;
+  int* fd;
+  int* end;
+
+  for (chdr = CMSG_FIRSTHDR(&wbuf->msg); chdr;
+       chdr = CMSG_NXTHDR(&wbuf->msg, chdr)) {
+    if (chdr->cmsg_level != SOL_SOCKET || chdr->cmsg_type != SCM_RIGHTS)
+      continue;
+    fd = (int*)CMSG_DATA(chdr);
+    end = (int*)((unsigned char*)chdr + chdr->cmsg_len);
+    for (; fd < end; ++fd) {
+      if (TEMP_FAILURE_RETRY(close(*fd)) < 0)
+        ALOGW_ERRNO("close");
+    }
+  }
+  wbuf->msg.msg_control = NULL;
+  wbuf->msg.msg_controllen = 0;
+}
+
+static void
+init_send_queue(struct send_queue* sq, unsigned long weight,
+                struct ntf_queue* backlog)
+{
+  sq->fd = -1;
+  sq->seqpacket = 0;
+  sq->flush_scheduled = 0;
+  sq->pollout = 0;
+  sq->sending = 0;
+  sq->weight = weight;
+  STAILQ_INIT(&sq->refs);
+  sq->nrefs = 0;
+  sq->backlog = backlog;
+  sq->credited = 0;
+  sq->credits = 0;
+  sq->ring = NULL;
+}
+
+static void
+clear_send_queue(struct send_queue* sq)
+{
+  struct pdu_wbuf_ref* ref;
+
+  while ((ref = STAILQ_FIRST(&sq->refs))) {
+    STAILQ_REMOVE_HEAD(&sq->refs, stailq);
+    if (ref->wbuf->msg.msg_controllen)
+      close_pdu_wbuf_fds(ref->wbuf);
+    unref_pdu_wbuf(ref);
+  }
+  sq->nrefs = 0;
+}
+
+static void
+refill_send_queue(struct send_queue* sq)
+{
+  struct pdu_wbuf_ref* ref;
+
+  if (!sq->backlog)
+    return;
+
+  for (; sq->nrefs < IOV_MAX; ++sq->nrefs) {
+    if (sq->credited && !sq->credits)
+      break;
+    ref = ntf_queue_pop(sq->backlog);
+    if (!ref)
+      break;
+    if (sq->credited)
+      --sq->credits;
+    STAILQ_INSERT_TAIL(&sq->refs, ref, stailq);
+  }
+}
+
+/* Fills |msg| with the queued PDUs for one sendmsg(). Returns the
+ * number of bytes to send. */
+static size_t
+build_send_msg(struct send_queue* sq, struct msghdr* msg, struct iovec* iov)
+{
+  struct pdu_wbuf_ref* ref;
+  struct pdu_wbuf* wbuf;
+  size_t len;
+
+  memset(msg, 0, sizeof(*msg));
+  msg->msg_iov = iov;
+
+  len = 0;
+
+  STAILQ_FOREACH(ref, &sq->refs, stailq) {
+    if (msg->msg_iovlen == IOV_MAX)
+      break;
+    wbuf = ref->wbuf;
+    if (wbuf->msg.msg_controllen) {
+      /* file descriptors are sent alone with their PDU */
+      if (msg->msg_iovlen)
+        break;
+      msg->msg_control = wbuf->msg.msg_control;
+      msg->msg_controllen = wbuf->msg.msg_controllen;
+    }
+    iov[msg->msg_iovlen++] = ref->iov;
+    len += ref->iov.iov_len;
+    if (msg->msg_controllen)
+      break;
+  }
+
+  return len;
 }
 
-#if 0
+static void
+consume_send_queue(struct send_queue* sq, size_t len)
+{
+  struct pdu_wbuf_ref* ref;
+
+  while (len && (ref = STAILQ_FIRST(&sq->refs))) {
+    if (ref->wbuf->msg.msg_controllen)
+      close_pdu_wbuf_fds(ref->wbuf);
+    if (len < ref->iov.iov_len) {
+      ref->iov.iov_base = (unsigned char*)ref->iov.iov_base + len;
+      ref->iov.iov_len -= len;
+      break;
+    }
+    len -= ref->iov.iov_len;
+    STAILQ_REMOVE_HEAD(&sq->refs, stailq);
+    --sq->nrefs;
+    unref_pdu_wbuf(ref);
+    ++stats.pdus;
+  }
+}
+
+/* Writes queued PDUs with a single sendmsg(). Returns 1 if the
+ * socket's buffer is full, 3 if the send is in progress, 0 otherwise,
+ * or -1 on errors. */
 static int
-send_pdu(int fd, struct pdu_wbuf* wbuf, int* sock_fd)
+send_stream_msg(struct send_queue* sq)
 {
-  struct iovec iov;
+  static struct iovec iov[IOV_MAX];
   struct msghdr msg;
-  union {
-    struct cmsghdr cmsghdr;
-    unsigned char data[CMSG_DATA(sizeof(sockfd))];
-  } cmsg;
-  struct cmsghdr* cmsghdr;
+  size_t len;
+  ssize_t res;
 
-  assert(wbuf);
+  len = build_send_msg(sq, &msg, iov);
+
+  res = send_to_epoll_loop(sq->fd, &msg, MSG_NOSIGNAL, sq->sent, sq);
+  ++stats.sendmsgs;
+  if (res < 0) {
+    if (errno == EINPROGRESS) {
+      sq->sending = 1;
+      return 3;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 1;
+    ALOGE_ERRNO("sendmsg");
+    return -1;
+  }
+  stats.bytes += res;
+
+  consume_send_queue(sq, res);
+
+  return (size_t)res < len;
+}
+
+/* Writes queued PDUs with a single sendmmsg(), one message per
+ * PDU. Messages are sent completely or not at all. Returns 1 if
+ * the socket's buffer is full, 0 otherwise, or -1 on errors. */
+static int
+send_seqpacket_msgs(struct send_queue* sq)
+{
+  static struct mmsghdr mmsg[SENDMMSG_BATCH];
+  struct pdu_wbuf_ref* ref;
+  struct msghdr* msg;
+  unsigned int n;
+  size_t len;
+  int res, i;
+
+  n = 0;
+  STAILQ_FOREACH(ref, &sq->refs, stailq) {
+    if (n == SENDMMSG_BATCH)
+      break;
+    msg = &mmsg[n].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = &ref->iov;
+    msg->msg_iovlen = 1;
+    msg->msg_control = ref->wbuf->msg.msg_control;
+    msg->msg_controllen = ref->wbuf->msg.msg_controllen;
+    ++n;
+  }
+
+  res = TEMP_FAILURE_RETRY(sys_sendmmsg(sq->fd, mmsg, n, MSG_NOSIGNAL));
+  ++stats.sendmsgs;
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 1;
+    ALOGE_ERRNO("sendmmsg");
+    return -1;
+  }
+
+  for (len = 0, i = 0; i < res; ++i)
+    len += mmsg[i].msg_len;
+  stats.bytes += len;
 
-  iov.iov_base = wbuf->buf.raw;
-  iov.iov_len = wbuf->off;
+  consume_send_queue(sq, len);
 
-  memset(&msg, 0, sizeof(msg));
-  msg.msg_iov = iov;
-  msg.msg_iovlen = 1;
+  return (unsigned int)res < n;
+}
 
-  if (sock_fd) {
-    msg.control = cmsg.data;
-    msg.controllen = sizeof(cmsg.data);
-    cmsghdr = CMSG_FIRSTHDR(&msg);
-    cmsghdr->cmsg_len = CMSG_LEN(sizeof(fd));
-    cmsghdr->cmsg_level = SOL_SOCKET;
-    cmsghdr->cmsg_type = SCM_RIGHTS;
-    *((int*)CMSG_DATA(cmsghdr)) = *sock_fd;
+static int
+ref_is_partially_sent(const struct pdu_wbuf_ref* ref)
+{
+  return ref->iov.iov_len != pdu_size(&ref->wbuf->buf.pdu);
+}
+
+/* A PDU that has been partially sent through the socket has to be
+ * completed there. */
+static int
+writes_to_ntf_ring(const struct send_queue* sq)
+{
+  const struct pdu_wbuf_ref* ref;
+
+  if (!sq->ring)
+    return 0;
+  ref = STAILQ_FIRST(&sq->refs);
+  return !ref || !ref_is_partially_sent(ref);
+}
+
+/* Copies queued PDUs into the notification ring. Returns 1 if the
+ * ring is full, 0 otherwise, or -1 on errors. */
+static int
+write_ntf_ring(struct send_queue* sq)
+{
+  struct pdu_wbuf_ref* ref;
+  int res;
+
+  res = 0;
+
+  while ((ref = STAILQ_FIRST(&sq->refs))) {
+    if (ntf_ring_write(sq->ring, ref->iov.iov_base, ref->iov.iov_len) < 0) {
+      res = 1;
+      break;
+    }
+    stats.bytes += ref->iov.iov_len;
+    STAILQ_REMOVE_HEAD(&sq->refs, stailq);
+    --sq->nrefs;
+    unref_pdu_wbuf(ref);
+    ++stats.pdus;
   }
 
-  if (TEMP_FAILURE_RETRY(sendmsg(fd, &msg, 0)) < 0) {
+  /* one wakeup for all PDUs */
+  if (ntf_ring_publish(sq->ring) < 0)
+    return -1;
+
+  return res;
+}
+
+/* Writes queued PDUs until the queue is empty, the socket's buffer
+ * is full, or the queue's turn is over. Returns 0 if all PDUs have
+ * been sent, 1 if the socket's buffer is full, 2 if the turn is
+ * over, 3 if a send is in progress, or -1 on errors.
+ */
+static int
+flush_send_queue(struct send_queue* sq)
+{
+  unsigned long i;
+  int res;
+
+  if (sq->sending)
+    return 3;
+
+  for (i = 0;; ++i) {
+    refill_send_queue(sq);
+    if (STAILQ_EMPTY(&sq->refs))
+      return 0;
+    if (i == sq->weight)
+      return 2;
+
+    if (writes_to_ntf_ring(sq))
+      res = write_ntf_ring(sq);
+    else if (sq->seqpacket)
+      res = send_seqpacket_msgs(sq);
+    else
+      res = send_stream_msg(sq);
+    if (res)
+      return res; /* socket buffer or ring is full, send in progress,
+                   * or error */
+  }
+}
+
+static int
+poll_send_queue(struct send_queue* sq, int pollout)
+{
+  uint32_t events;
+
+  if (sq->pollout == pollout)
+    return 0;
+
+  events = sq->events;
+  if (pollout)
+    events |= EPOLLOUT;
+
+  if (add_fd_to_epoll_loop(sq->fd, events, sq->func, sq->data) < 0)
+    return -1;
+
+  sq->pollout = pollout;
+
+  return 0;
+}
+
+static void
+schedule_flush(struct send_queue* sq)
+{
+  if (sq->fd < 0 || sq->flush_scheduled || sq->pollout || sq->sending)
+    return;
+
+  requeue_fd_in_epoll_loop(sq->fd, EPOLLOUT);
+  sq->flush_scheduled = 1;
+}
+
+/* Called for EPOLLOUT, which is either polled for or has been
+ * requeued by send_pdu(). */
+static int
+send_queue_event_out(struct send_queue* sq)
+{
+  int res;
+
+  sq->flush_scheduled = 0;
+
+  res = flush_send_queue(sq);
+  if (res < 0)
+    return -1;
+
+  if (res == 1 && writes_to_ntf_ring(sq)) {
+    /* the socket is writable; only the ring is full */
+    if (rearm_timer(&sq->ring_timer, NTF_RING_RETRY_MSEC) < 0)
+      return -1;
+    res = 0;
+  }
+
+  if (poll_send_queue(sq, res == 1) < 0)
+    return -1;
+
+  if (res == 2)
+    schedule_flush(sq); /* continue after the other ready fds */
+
+  return 0;
+}
+
+/* Completes an asynchronous send. Returns 1 if the queue has been
+ * closed during the send, 0 on success, or -1 on errors. */
+static int
+complete_stream_msg(struct send_queue* sq, ssize_t res)
+{
+  sq->sending = 0;
+
+  if (sq->fd < 0) {
+    clear_send_queue(sq);
+    return 1;
+  }
+
+  if (res < 0) {
+    if (res == -EAGAIN || res == -EWOULDBLOCK)
+      return poll_send_queue(sq, 1);
+    errno = -res;
     ALOGE_ERRNO("sendmsg");
     return -1;
   }
+  stats.bytes += res;
 
-  /* TODO: append to send queue 1 */
-  /* TODO: epoll fd for writing */
+  consume_send_queue(sq, res);
+  schedule_flush(sq);
 
   return 0;
 }
 
+/* Stream command sockets are read by the loop; SOCK_SEQPACKET
+ * sockets receive their messages with recvmmsg(). */
 static int
-send_rsp_pdu(struct pdu_wbuf* wbuf, int* sock_fd)
+open_send_queue(struct send_queue* sq, int fd, int seqpacket,
+                uint32_t events, void (*func)(int, uint32_t, void*),
+                void (*sent)(ssize_t, void*), void* data)
 {
-  /* TODO: append to send queue 0 */
-  /* TODO: epoll fd for writing */
+  int res;
+
+  if ((events & EPOLLIN) && !seqpacket)
+    res = add_read_fd_to_epoll_loop(fd, events, func, data);
+  else
+    res = add_fd_to_epoll_loop(fd, events, func, data);
+  if (res < 0)
+    return -1;
+
+  sq->fd = fd;
+  sq->seqpacket = seqpacket;
+  sq->events = events;
+  sq->func = func;
+  sq->sent = sent;
+  sq->data = data;
+
+  schedule_flush(sq);
 
   return 0;
 }
 
+static void
+ring_timer_expired(struct timer* timer, void* data)
+{
+  schedule_flush(data);
+}
+
+/* Sends all further notifications through a new shared-memory
+ * ring. Returns 0 on success, or -1 on errors. */
 static int
-send_ntf_pdu(struct pdu_wbuf* wbuf)
+open_ntf_ring(struct send_queue* sq, unsigned long size)
 {
-  /* TODO: append to send queue 1 */
-  /* TODO: epoll fd for writing */
+  struct ntf_ring* ring;
+
+  if (sq->ring)
+    return -1; /* only one ring per client */
+
+  errno = 0;
+  ring = malloc(sizeof(*ring));
+  if (errno) {
+    ALOGE_ERRNO("malloc");
+    goto err_malloc;
+  }
+
+  if (init_ntf_ring(ring, size) < 0)
+    goto err_init_ntf_ring;
+
+  init_timer(&sq->ring_timer, ring_timer_expired, sq);
+  sq->ring = ring;
+
+  schedule_flush(sq);
 
   return 0;
+err_init_ntf_ring:
+  free(ring);
+err_malloc:
+  return -1;
 }
-#else
+
 static void
-send_pdu(struct pdu_wbuf* wbuf)
+close_ntf_ring(struct send_queue* sq)
 {
-  /* TODO: append to send queue 1 */
-  /* TODO: epoll fd for writing */
+  if (!sq->ring)
+    return;
+
+  cancel_timer(&sq->ring_timer);
+  uninit_ntf_ring(sq->ring);
+  free(sq->ring);
+  sq->ring = NULL;
+}
+
+static void
+close_send_queue(struct send_queue* sq)
+{
+  close_ntf_ring(sq);
+
+  if (sq->fd < 0)
+    return;
+
+  remove_fd_from_epoll_loop(sq->fd);
+  if (TEMP_FAILURE_RETRY(close(sq->fd)) < 0)
+    ALOGW_ERRNO("close");
+  /* a send in progress still refers to the queued PDUs */
+  if (!sq->sending)
+    clear_send_queue(sq);
+  sq->fd = -1;
+  sq->flush_scheduled = 0;
+  sq->pollout = 0;
 }
-#endif
 
 static struct pdu_wbuf*
 build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
@@ -111,7 +634,7 @@ build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
 
   iov = pdu_wbuf_tail(wbuf);
   iov->iov_base = wbuf->buf.raw;
-  iov->iov_len = wbuf->off;
+  iov->iov_len = pdu_size(&wbuf->buf.pdu);
 
   memset(&wbuf->msg, 0, sizeof(wbuf->msg));
   wbuf->msg.msg_iov = iov;
@@ -120,89 +643,690 @@ build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
   return wbuf;
 }
 
+/*
+ * Sessions
+ *
+ * Each client connects two sockets: the first is for transmitting
+ * pairs of command/response PDUs, the second is for notifications.
+ * Both sockets of a client come from the same process, so the
+ * daemon pairs them by the peer's pid. A process that runs multiple
+ * clients connects each client's notification socket before it
+ * connects the next client.
+ *
+ * Clients pick the framing by the listening socket they connect to.
+ * On SOCK_SEQPACKET sockets, each message is exactly one PDU, so
+ * commands need no reassembly and a batch of them is received with
+ * a single recvmmsg().
+ *
+ * Responses go to the session whose command is being handled.
+ * Notifications are serialized once and every subscribed session
+ * queues a reference to the same wbuf.
+ *
+ * Discovery produces streams of tiny notifications. Instead of
+ * sending each of them right away, a session holds notifications
+ * until its backlog reaches a size threshold or a short deadline
+ * expires, and then writes them all at once. Urgent notifications,
+ * such as pairing requests, flush the backlog immediately.
+ */
+
+struct session {
+  TAILQ_ENTRY(session) entry;
+  pid_t pid;
+  int subscribed;
+  int destroyed; /* waits for sends in progress */
+  struct pdu_rbuf* rbuf; /* stream sockets only */
+  struct send_queue rsp;
+  struct send_queue ntf;
+  struct ntf_queue backlog;
+  struct timer coalesce_timer;
+};
+
+static TAILQ_HEAD(, session) sessions = TAILQ_HEAD_INITIALIZER(sessions);
+static unsigned long nsessions;
+
+/* the session whose commands are being handled */
+static struct session* current_session;
+
+/* sequence ID of the command being handled, if it has one */
+static int current_cmd_is_sequenced;
+static uint32_t current_cmd_seq;
+
+/* response of a batched command, which goes back to the batch */
+static int capturing_rsp;
+static struct pdu_wbuf* captured_rsp;
+
+static void
+discard_pdu_wbuf(struct pdu_wbuf* wbuf)
+{
+  if (wbuf->msg.msg_controllen)
+    close_pdu_wbuf_fds(wbuf);
+  cleanup_pdu_wbuf(wbuf);
+}
+
+/* Prepends a sequence ID to a response. The new header goes into
+ * the wbuf's headroom and the sequence ID overwrites the old header,
+ * so only |ref| describes the PDU afterwards. */
 static int
-handle_pdu(const struct pdu* cmd)
+tag_rsp_pdu(struct pdu_wbuf_ref* ref, uint32_t seq)
+{
+  struct pdu_wbuf* wbuf;
+  struct pdu* hdr;
+
+  wbuf = ref->wbuf;
+
+  assert(wbuf->buf.raw == wbuf->head + sizeof(wbuf->head));
+
+  if (wbuf->buf.pdu.len > UINT16_MAX - sizeof(seq)) {
+    ALOGE("response PDU(0x%x:0x%x) too large for sequence ID",
+          wbuf->buf.pdu.service, wbuf->buf.pdu.opcode);
+    return -1;
+  }
+
+  hdr = (struct pdu*)wbuf->head;
+  hdr->service = wbuf->buf.pdu.service | PDU_SERVICE_SEQUENCED;
+  hdr->opcode = wbuf->buf.pdu.opcode;
+  hdr->len = wbuf->buf.pdu.len + sizeof(seq);
+  memcpy(wbuf->buf.raw, &seq, sizeof(seq));
+
+  ref->iov.iov_base = hdr;
+  ref->iov.iov_len += sizeof(seq);
+
+  return 0;
+}
+
+static void
+send_rsp_pdu(struct pdu_wbuf* wbuf)
+{
+  struct session* session;
+  struct pdu_wbuf_ref* ref;
+
+  if (capturing_rsp) {
+    if (captured_rsp || wbuf->msg.msg_controllen) {
+      ALOGE("can't batch response PDU(0x%x:0x%x)",
+            wbuf->buf.pdu.service, wbuf->buf.pdu.opcode);
+      goto err_capturing_rsp;
+    }
+    captured_rsp = wbuf;
+    return;
+  }
+
+  session = current_session;
+  if (!session) {
+    ALOGW("no client for response PDU(0x%x:0x%x)",
+          wbuf->buf.pdu.service, wbuf->buf.pdu.opcode);
+    goto err_current_session;
+  }
+
+  ref = ref_pdu_wbuf(wbuf);
+  if (!ref)
+    goto err_ref_pdu_wbuf;
+
+  if (current_cmd_is_sequenced && (tag_rsp_pdu(ref, current_cmd_seq) < 0))
+    goto err_tag_rsp_pdu;
+
+  STAILQ_INSERT_TAIL(&session->rsp.refs, ref, stailq);
+  ++session->rsp.nrefs;
+  schedule_flush(&session->rsp);
+
+  return;
+err_tag_rsp_pdu:
+  unref_pdu_wbuf(ref);
+  return;
+err_ref_pdu_wbuf:
+err_current_session:
+err_capturing_rsp:
+  discard_pdu_wbuf(wbuf);
+}
+
+static void
+coalesce_timer_expired(struct timer* timer, void* data)
+{
+  struct session* session = data;
+
+  ++stats.ntf_flushes;
+  schedule_flush(&session->ntf);
+}
+
+/* Schedules a flush of the notification backlog after a new
+ * notification, or holds the backlog back for a while. */
+static void
+coalesce_ntf(struct session* session, const struct pdu_wbuf* wbuf)
+{
+  struct timer* timer;
+
+  timer = &session->coalesce_timer;
+
+  if (!ntf_coalesce_msec || wbuf->urgent)
+    goto flush;
+  if (session->backlog.stats.bytes >= ntf_coalesce_bytes)
+    goto flush;
+
+  if (!timer_is_armed(timer) && (add_timer(timer, ntf_coalesce_msec) < 0))
+    goto flush;
+  ++stats.ntf_held;
+
+  return;
+flush:
+  if (timer_is_armed(timer)) {
+    /* held notifications go out with this one */
+    cancel_timer(timer);
+    ++stats.ntf_flushes;
+  }
+  schedule_flush(&session->ntf);
+}
+
+/* A client without credits only gets a count of the bulk
+ * notifications it misses. */
+static int
+session_is_starved(const struct session* session,
+                   const struct pdu_wbuf* wbuf)
+{
+  return session->ntf.credited && !session->ntf.credits &&
+         (wbuf->policy == NTF_POLICY_DROP_OLDEST);
+}
+
+static void
+send_ntf_pdu(struct pdu_wbuf* wbuf)
+{
+  struct pdu_wbuf_ref* guard;
+  struct pdu_wbuf_ref* ref;
+  struct session* session;
+
+  /* The backlogs might drop their references immediately; keep
+   * the wbuf alive until all sessions have seen it. */
+  guard = ref_pdu_wbuf(wbuf);
+  if (!guard) {
+    cleanup_pdu_wbuf(wbuf);
+    return;
+  }
+
+  TAILQ_FOREACH(session, &sessions, entry) {
+    if (!session->subscribed)
+      continue;
+    if (session_is_starved(session, wbuf)) {
+      ntf_queue_discard(&session->backlog);
+      continue;
+    }
+    ref = ref_pdu_wbuf(wbuf);
+    if (!ref)
+      continue;
+    ntf_queue_push(&session->backlog, ref);
+    coalesce_ntf(session, wbuf);
+  }
+
+  unref_pdu_wbuf(guard);
+}
+
+static void
+send_pdu(struct pdu_wbuf* wbuf)
+{
+  if (wbuf->buf.pdu.opcode & 0x80)
+    send_ntf_pdu(wbuf);
+  else
+    send_rsp_pdu(wbuf);
+}
+
+static struct session*
+create_session(pid_t pid, int seqpacket)
+{
+  struct session* session;
+
+  errno = 0;
+  session = malloc(sizeof(*session));
+  if (errno) {
+    ALOGE_ERRNO("malloc");
+    goto err_malloc;
+  }
+
+  if (seqpacket) {
+    session->rbuf = NULL;
+  } else {
+    session->rbuf = create_pdu_rbuf(CMD_RBUF_SIZE);
+    if (!session->rbuf)
+      goto err_create_pdu_rbuf;
+  }
+
+  session->pid = pid;
+  session->subscribed = 1;
+  session->destroyed = 0;
+  init_ntf_queue(&session->backlog, NTF_QUEUE_LIMIT_COUNT,
+                 NTF_QUEUE_LIMIT_BYTES);
+  init_send_queue(&session->rsp, RSP_SEND_WEIGHT, NULL);
+  init_send_queue(&session->ntf, NTF_SEND_WEIGHT, &session->backlog);
+  init_timer(&session->coalesce_timer, coalesce_timer_expired, session);
+
+  TAILQ_INSERT_TAIL(&sessions, session, entry);
+  ++nsessions;
+
+  return session;
+err_create_pdu_rbuf:
+  free(session);
+err_malloc:
+  return NULL;
+}
+
+static void
+close_session_ntf(struct session* session)
+{
+  cancel_timer(&session->coalesce_timer);
+  close_send_queue(&session->ntf);
+  uninit_ntf_queue(&session->backlog);
+  session->subscribed = 0;
+}
+
+static void
+destroy_session(struct session* session)
+{
+  if (current_session == session)
+    current_session = NULL;
+
+  close_session_ntf(session);
+  close_send_queue(&session->rsp);
+  if (session->rbuf)
+    cleanup_pdu_rbuf(session->rbuf);
+
+  TAILQ_REMOVE(&sessions, session, entry);
+  --nsessions;
+
+  /* the last completed send frees the session */
+  if (session->rsp.sending || session->ntf.sending) {
+    session->destroyed = 1;
+    return;
+  }
+
+  free(session);
+}
+
+/* Opens a notification ring for the client whose command is being
+ * handled, and returns duplicates of the ring's fds. */
+static int
+open_current_ntf_ring(unsigned long size, int fd[2])
+{
+  struct session* session;
+
+  session = current_session;
+  if (!session || session->ntf.fd < 0) {
+    ALOGE("client has no notification socket");
+    goto err_current_session;
+  }
+
+  if (open_ntf_ring(&session->ntf, size) < 0)
+    goto err_open_ntf_ring;
+
+  if (dup_ntf_ring_fds(session->ntf.ring, fd) < 0)
+    goto err_dup_ntf_ring_fds;
+
+  return 0;
+err_dup_ntf_ring_fds:
+  close_ntf_ring(&session->ntf);
+err_open_ntf_ring:
+err_current_session:
+  return -1;
+}
+
+/* Grants notification credits to the client whose command is being
+ * handled. The first grant enables flow control by credits. */
+static int
+grant_current_ntf_credits(unsigned long credits)
+{
+  struct send_queue* sq;
+
+  if (!current_session)
+    return -1;
+
+  sq = &current_session->ntf;
+  sq->credited = 1;
+  if (credits > ULONG_MAX - sq->credits)
+    sq->credits = ULONG_MAX;
+  else
+    sq->credits += credits;
+
+  schedule_flush(sq);
+
+  return 0;
+}
+
+static bt_status_t
+handle_batched_pdu(const struct pdu* cmd, struct pdu_wbuf** rsp)
 {
   bt_status_t status;
+
+  assert(!capturing_rsp);
+
+  capturing_rsp = 1;
+  set_cmd_arena_holds_rsp(1);
+  status = dispatch_batched_pdu(cmd);
+  set_cmd_arena_holds_rsp(0);
+  capturing_rsp = 0;
+
+  *rsp = captured_rsp;
+  captured_rsp = NULL;
+
+  return status;
+}
+
+static struct session*
+find_session_without_ntf(pid_t pid)
+{
+  struct session* session;
+
+  TAILQ_FOREACH(session, &sessions, entry) {
+    if (session->pid == pid && session->subscribed && session->ntf.fd < 0)
+      return session;
+  }
+  return NULL;
+}
+
+/*
+ * Socket I/O
+ */
+
+static void
+io_fd1_event(int fd, uint32_t events, void* data)
+{
+  struct session* session = data;
+
+  if (events & (EPOLLERR|EPOLLHUP)) {
+    close_session_ntf(session);
+  } else if (events & EPOLLOUT) {
+    if (send_queue_event_out(&session->ntf) < 0)
+      close_session_ntf(session);
+  } else {
+    ALOGW("unsupported event mask: %u", events);
+  }
+}
+
+static void
+io_msg_sent(ssize_t res, void* data)
+{
+  struct send_queue* sq = data;
+  struct session* session = sq->data;
+  int closed;
+
+  closed = complete_stream_msg(sq, res);
+  if (closed < 0) {
+    if (sq == &session->rsp)
+      destroy_session(session);
+    else
+      close_session_ntf(session);
+  } else if (closed && session->destroyed &&
+             !session->rsp.sending && !session->ntf.sending) {
+    free(session);
+  }
+}
+
+/* Removes the sequence ID from a sequenced command. The command's
+ * header moves over the ID, so handlers see a plain PDU. Returns the
+ * plain PDU, or NULL on errors.
+ */
+static struct pdu*
+untag_cmd_pdu(struct pdu* cmd, uint32_t* seq)
+{
+  struct pdu hdr;
+
+  if (cmd->len < sizeof(*seq)) {
+    ALOGE("sequenced PDU(0x%x:0x%x) without sequence ID",
+          cmd->service, cmd->opcode);
+    return NULL;
+  }
+
+  memcpy(seq, cmd->data, sizeof(*seq));
+
+  hdr.service = cmd->service & ~PDU_SERVICE_SEQUENCED;
+  hdr.opcode = cmd->opcode;
+  hdr.len = cmd->len - sizeof(*seq);
+
+  cmd = (struct pdu*)(cmd->data + sizeof(*seq) - sizeof(hdr));
+  memcpy(cmd, &hdr, sizeof(hdr));
+
+  return cmd;
+}
+
+/* Dispatches a command without waiting for the responses to earlier
+ * commands. The command's buffer is modified. The command arena is
+ * reset afterwards. A failed command gets an error response and the
+ * session stays open. Returns -1 only if the client can't be answered.
+ */
+static int
+handle_pdu(struct pdu* cmd)
+{
+  bt_status_t status;
+  struct core_status_rsp rsp;
   struct pdu_wbuf* wbuf;
 
-  status = handle_pdu_by_service(cmd, service_handler);
+  if (cmd->service & PDU_SERVICE_SEQUENCED) {
+    cmd = untag_cmd_pdu(cmd, &current_cmd_seq);
+    if (!cmd)
+      return -1;
+    current_cmd_is_sequenced = 1;
+  }
+
+  status = dispatch_pdu(cmd);
   if (status != BT_STATUS_SUCCESS)
-    goto err_handle_pdu_by_service;
+    goto err_dispatch_pdu;
+
+  current_cmd_is_sequenced = 0;
+  reset_cmd_arena();
 
   return 0;
-err_handle_pdu_by_service:
+err_dispatch_pdu:
   /* reply with an error */
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(core_status_rsp_len,
+                             sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
-    return -1;
+    goto err_create_rsp_pdu_wbuf;
+  rsp.status = status;
   init_pdu(&wbuf->buf.pdu, cmd->service, 0);
-  append_to_pdu(&wbuf->buf.pdu, 0, "C", (uint8_t)status);
+  append_core_status_rsp(&wbuf->buf.pdu, &rsp);
   send_pdu(build_pdu_wbuf_msg(wbuf));
+  current_cmd_is_sequenced = 0;
+  reset_cmd_arena();
+  return 0;
+err_create_rsp_pdu_wbuf:
+  current_cmd_is_sequenced = 0;
+  reset_cmd_arena();
   return -1;
 }
 
-static void
-io_fd0_event_in(int fd, void* data)
+/* Dispatches all complete PDUs in the receive buffer and moves a
+ * trailing partial PDU to the buffer's beginning. Returns 0 on
+ * success, or -1 on errors.
+ */
+static int
+handle_pdus_in_rbuf(struct pdu_rbuf* rbuf)
+{
+  unsigned long off, size;
+  struct pdu* pdu;
+
+  for (off = 0; rbuf->len - off >= sizeof(*pdu); off += size) {
+    pdu = (struct pdu*)(rbuf->buf.raw + off);
+    size = pdu_size(pdu);
+    if (size > rbuf->maxlen) {
+      ALOGE("buffer too small for PDU(0x%x:0x%x)",
+            pdu->service, pdu->opcode);
+      return -1;
+    }
+    if (rbuf->len - off < size)
+      break; /* partial PDU */
+    if (handle_pdu(pdu) < 0)
+      return -1;
+  }
+
+  if (off) {
+    memmove(rbuf->buf.raw, rbuf->buf.raw + off, rbuf->len - off);
+    rbuf->len -= off;
+  }
+
+  return 0;
+}
+
+/* Reads from the command socket once and handles all PDUs that
+ * have been received completely. Returns 1 if the socket might
+ * have more data, 0 if it has been drained, or -1 on errors.
+ */
+static int
+read_cmd_socket(int fd, struct session* session)
 {
   struct pdu_rbuf* rbuf;
   ssize_t res;
   size_t len;
-  static const size_t pdusize = sizeof(rbuf->buf.pdu);
 
-  assert(data);
-  rbuf = data;
+  assert(session);
 
-  if (rbuf->len < pdusize) {
-    /* read PDU header */
-    len = pdusize-rbuf->len;
-  } else {
-    /* read PDU data */
-    len = rbuf->len-pdusize-rbuf->len;
-  }
+  rbuf = session->rbuf;
+  len = rbuf->maxlen - rbuf->len;
 
-  res = TEMP_FAILURE_RETRY(read(fd, rbuf->buf.raw+rbuf->len, len));
+  res = read_from_epoll_loop(fd, rbuf->buf.raw + rbuf->len, len);
   if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
     ALOGE_ERRNO("read");
-    goto err_read;
+    return -1;
+  } else if (!res) {
+    /* client closed the connection */
+    return -1;
   }
 
   rbuf->len += res;
 
-  if (pdu_rbuf_has_pdu(rbuf)) {
-    if (handle_pdu(&rbuf->buf.pdu) < 0)
-      goto err_pdu;
-    rbuf->len = 0;
-  } else if (pdu_rbuf_is_full(rbuf)) {
-    ALOGE("buffer too small for PDU(0x%x:0x%x)",
-          rbuf->buf.pdu.service, rbuf->buf.pdu.opcode);
-    goto err_pdu;
+  current_session = session;
+  if (handle_pdus_in_rbuf(rbuf) < 0)
+    goto err_handle_pdus_in_rbuf;
+  current_session = NULL;
+
+  /* A short read drained the socket. New data will trigger
+   * another edge. */
+  return (size_t)res == len;
+err_handle_pdus_in_rbuf:
+  current_session = NULL;
+  return -1;
+}
+
+/* Receives a batch of messages from a SOCK_SEQPACKET command socket
+ * and handles their PDUs. Returns 1 if the socket might have more
+ * messages, 0 if it has been drained, or -1 on errors.
+ */
+static int
+read_cmd_msgs(int fd, struct session* session)
+{
+  static unsigned char buf[RECVMMSG_BATCH][CMD_RBUF_SIZE]
+    __attribute__((aligned(sizeof(void*))));
+  static struct iovec iov[RECVMMSG_BATCH];
+  static struct mmsghdr mmsg[RECVMMSG_BATCH];
+  struct pdu* pdu;
+  int res, i;
+
+  assert(session);
+
+  for (i = 0; i < RECVMMSG_BATCH; ++i) {
+    iov[i].iov_base = buf[i];
+    iov[i].iov_len = sizeof(buf[i]);
+    memset(&mmsg[i].msg_hdr, 0, sizeof(mmsg[i].msg_hdr));
+    mmsg[i].msg_hdr.msg_iov = iov + i;
+    mmsg[i].msg_hdr.msg_iovlen = 1;
   }
 
+  res = TEMP_FAILURE_RETRY(sys_recvmmsg(fd, mmsg, RECVMMSG_BATCH,
+                                        MSG_DONTWAIT));
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    ALOGE_ERRNO("recvmmsg");
+    return -1;
+  }
+
+  current_session = session;
+
+  for (i = 0; i < res; ++i) {
+    if (!mmsg[i].msg_len)
+      goto err_msg_len; /* client closed the connection */
+    pdu = (struct pdu*)buf[i];
+    if (mmsg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      ALOGE("buffer too small for PDU(0x%x:0x%x)",
+            pdu->service, pdu->opcode);
+      goto err_msg_len;
+    }
+    if ((mmsg[i].msg_len < sizeof(*pdu)) ||
+        (mmsg[i].msg_len != pdu_size(pdu))) {
+      ALOGE("invalid PDU message of %u bytes", mmsg[i].msg_len);
+      goto err_msg_len;
+    }
+    if (handle_pdu(pdu) < 0)
+      goto err_handle_pdu;
+  }
+
+  current_session = NULL;
+
+  return res == RECVMMSG_BATCH;
+err_handle_pdu:
+err_msg_len:
+  current_session = NULL;
+  return -1;
+}
+
+static void
+io_fd0_event_in(int fd, uint32_t events, void* data)
+{
+  struct session* session = data;
+  unsigned long i;
+  int res;
+
+  for (i = 0; i < EPOLL_LOOP_BUDGET; ++i) {
+    if (session->rbuf)
+      res = read_cmd_socket(fd, session);
+    else
+      res = read_cmd_msgs(fd, session);
+    if (res < 0)
+      goto err_read_cmd_socket;
+    else if (!res)
+      return; /* drained */
+  }
+
+  /* budget exhausted; continue after serving other fds */
+  requeue_fd_in_epoll_loop(fd, events);
+
   return;
-err_pdu:
-err_read:
-  if (TEMP_FAILURE_RETRY(close(fd)) < 0)
-    ALOGW_ERRNO("close");
-  return;
+err_read_cmd_socket:
+  destroy_session(session);
 }
 
 static void
 io_fd0_event(int fd, uint32_t events, void* data)
 {
+  struct session* session = data;
+
   if (events & EPOLLERR) {
-    io_fd0_event_err(fd, data);
-  } else if (events & EPOLLIN) {
-    io_fd0_event_in(fd, data);
-  } else {
+    destroy_session(session);
+    return;
+  }
+  if (!(events & (EPOLLIN|EPOLLOUT))) {
     ALOGW("unsupported event mask: %u", events);
+    return;
   }
+  if (events & EPOLLOUT) {
+    if (send_queue_event_out(&session->rsp) < 0) {
+      destroy_session(session);
+      return;
+    }
+  }
+  if (events & EPOLLIN)
+    io_fd0_event_in(fd, events, data);
 }
 
 /*
  * Listening socket I/O
  */
 
+struct listener {
+  const char* name;
+  int seqpacket;
+};
+
+static const struct listener listener[] = {
+  { BLUETOOTHD_SOCKET, 0 },
+  { BLUETOOTHD_SEQPACKET_SOCKET, 1 }
+};
+
 static void
 fd_event_err(int fd, void* data)
 {
@@ -210,69 +1334,109 @@ fd_event_err(int fd, void* data)
 }
 
 static int
-setup_cmd_socket(int fd)
+get_peer_pid(int fd, pid_t* pid)
 {
-  struct pdu_rbuf* rbuf;
+  struct ucred cred;
+  socklen_t len;
 
-  rbuf = create_pdu_rbuf(1024);
-  if (!rbuf)
-    goto err_create_pdu_rbuf;
+  len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+    ALOGE_ERRNO("getsockopt");
+    return -1;
+  }
+  *pid = cred.pid;
 
-  if (add_fd_to_epoll_loop(fd, EPOLLERR|EPOLLIN, io_fd0_event, rbuf) < 0)
-    goto err_add_fd_to_epoll_loop;
+  return 0;
+}
 
-  if (init_core_io(send_pdu) < 0)
-    goto err_init_core_io;
+static int
+setup_cmd_socket(int fd, int seqpacket, pid_t pid)
+{
+  struct session* session;
+
+  if (nsessions >= MAX_SESSIONS) {
+    ALOGE("too many connected clients");
+    goto err_nsessions;
+  }
+
+  session = create_session(pid, seqpacket);
+  if (!session)
+    goto err_create_session;
 
-  io_fd[0] = fd;
+  if (open_send_queue(&session->rsp, fd, seqpacket,
+                      EPOLLERR|EPOLLIN|EPOLLET, io_fd0_event, io_msg_sent,
+                      session) < 0)
+    goto err_open_send_queue;
 
   return 0;
-err_init_core_io:
-err_add_fd_to_epoll_loop:
-  cleanup_pdu_rbuf(rbuf);
-err_create_pdu_rbuf:
+err_open_send_queue:
+  destroy_session(session);
+err_create_session:
+err_nsessions:
   return -1;
 }
 
 static int
-setup_ntf_socket(int fd)
+setup_ntf_socket(int fd, int seqpacket, struct session* session)
 {
-  io_fd[1] = fd;
-  return 0;
+  return open_send_queue(&session->ntf, fd, seqpacket, EPOLLERR|EPOLLET,
+                         io_fd1_event, io_msg_sent, session);
 }
 
-static void
-fd_event_in(int fd, void* data)
+/* Accepts one connection. Returns 1 if a connection has been
+ * accepted, 0 if no connection is pending, or -1 on errors. */
+static int
+accept_socket(int fd, const struct listener* l)
 {
   int socket_fd, res;
+  pid_t pid;
+  struct session* session;
 
   socket_fd = TEMP_FAILURE_RETRY(accept(fd, NULL, 0));
   if (socket_fd < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
     ALOGE_ERRNO("accept");
     goto err_accept;
   }
 
-  /* The client shall connect two sockets: the first is for
-   * transmitting pairs of command/response PDUs, the second
-   * is for notifications.
-   */
-  if (!io_fd[0]) {
-    res = setup_cmd_socket(socket_fd);
-  } else if (!io_fd[1]) {
-    res = setup_ntf_socket(socket_fd);
-  } else {
-    ALOGE("too many connected sockets");
-    goto err_io_fd;
-  }
+  if (set_nonblock(socket_fd) < 0)
+    goto err_socket_fd;
+
+  if (get_peer_pid(socket_fd, &pid) < 0)
+    goto err_socket_fd;
+
+  /* The client's second socket is for notifications. */
+  session = find_session_without_ntf(pid);
+  if (session)
+    res = setup_ntf_socket(socket_fd, l->seqpacket, session);
+  else
+    res = setup_cmd_socket(socket_fd, l->seqpacket, pid);
   if (res < 0)
-    goto err_io_fd;
+    goto err_socket_fd;
 
-  return;
-err_io_fd:
+  return 1;
+err_socket_fd:
   if (TEMP_FAILURE_RETRY(close(socket_fd)) < 0)
     ALOGW_ERRNO("close");
+  return 1; /* the listening socket is still fine */
 err_accept:
-  return;
+  return -1;
+}
+
+static void
+fd_event_in(int fd, uint32_t events, void* data)
+{
+  unsigned long i;
+  int res;
+
+  for (i = 0; i < EPOLL_LOOP_BUDGET; ++i) {
+    res = accept_socket(fd, data);
+    if (res <= 0)
+      return;
+  }
+
+  requeue_fd_in_epoll_loop(fd, events);
 }
 
 static void
@@ -281,36 +1445,79 @@ fd_event(int fd, uint32_t events, void* data)
   if (events & EPOLLERR) {
     fd_event_err(fd, data);
   } else if (events & EPOLLIN) {
-    fd_event_in(fd, data);
+    fd_event_in(fd, events, data);
   } else {
     ALOGW("unsupported event mask: %u", events);
   }
 }
 
-int
-init_bt_io()
+void
+get_bt_io_stats(struct bt_io_stats* out)
+{
+  assert(out);
+
+  *out = stats;
+  out->sessions = nsessions;
+}
+
+static int
+setup_listener(const struct listener* l)
 {
   int fd;
 
-  fd = android_get_control_socket(BLUETOOTHD_SOCKET);
+  fd = android_get_control_socket(l->name);
   if (fd < 0) {
     ALOGE_ERRNO("android_get_control_socket");
     goto err_android_get_control_socket;
   }
 
+  if (set_nonblock(fd) < 0)
+    goto err_set_nonblock;
+
   if (listen(fd, 16) < 0) {
     ALOGE_ERRNO("listen");
     goto err_listen;
   }
 
-  if (add_fd_to_epoll_loop(fd, EPOLLIN|EPOLLERR, fd_event, NULL) < 0)
+  if (add_fd_to_epoll_loop(fd, EPOLLIN|EPOLLERR|EPOLLET, fd_event,
+                           (void*)l) < 0)
     goto err_add_fd_to_epoll_loop;
 
   return 0;
 err_add_fd_to_epoll_loop:
 err_listen:
+err_set_nonblock:
   if (TEMP_FAILURE_RETRY(close(fd)) < 0)
     ALOGW_ERRNO("close");
 err_android_get_control_socket:
   return -1;
 }
+
+void
+set_bt_io_ntf_coalescing(unsigned long bytes, unsigned long msec)
+{
+  ntf_coalesce_bytes = bytes;
+  ntf_coalesce_msec = msec;
+}
+
+int
+init_bt_io()
+{
+
+  if (init_core_io(send_pdu, open_current_ntf_ring,
+                   grant_current_ntf_credits, handle_batched_pdu) < 0)
+    goto err_init_core_io;
+
+  if (setup_listener(listener) < 0)
+    goto err_setup_listener;
+
+  /* SOCK_SEQPACKET framing is optional */
+  if (setup_listener(listener + 1) < 0)
+    ALOGW("no %s socket; stream framing only", listener[1].name);
+
+  return 0;
+err_setup_listener:
+  uninit_core_io();
+err_init_core_io:
+  return -1;
+}
@@ -4,5 +4,29 @@
 
 #pragma once
 
+/* Defaults of the notification coalescer */
+#define BT_IO_NTF_COALESCE_BYTES 4096
+#define BT_IO_NTF_COALESCE_MSEC 2
+
+struct bt_io_stats {
+  unsigned long long sendmsgs;
+  unsigned long long pdus; /* sent completely */
+  unsigned long long bytes;
+  unsigned long sessions; /* connected clients */
+  /* Notifications held by the coalescer, and the flushes that sent
+   * them. Their ratio is the number of notifications per write. */
+  unsigned long long ntf_held;
+  unsigned long long ntf_flushes;
+};
+
+void
+get_bt_io_stats(struct bt_io_stats* stats);
+
+/* Tunes the notification coalescer: notifications are held until
+ * a client's backlog has |bytes| bytes, or for at most |msec|
+ * milliseconds. A |msec| of 0 disables coalescing. */
+void
+set_bt_io_ntf_coalescing(unsigned long bytes, unsigned long msec);
+
 int
 init_bt_io(void);
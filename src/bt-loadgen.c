@@ -0,0 +1,1439 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Load generator for bluetoothd
+ *
+ * Connects to the daemon like a client, with a command socket and a
+ * notification socket per session, and sends a mix of sequenced
+ * commands. In closed loop, each session keeps a fixed number of
+ * commands in flight. In open loop, commands are sent at a fixed rate
+ * and their round-trip times count from when they were due, so that
+ * a slow daemon can't hide its queueing delay. Run as
+ *
+ *   bt-loadgen [options]
+ *
+ *  -s <path>  daemon socket (/dev/socket/bluetoothd)
+ *  -P         the socket is of type SOCK_SEQPACKET
+ *  -m <mix>   command mix as name[:weight],...; -m help lists the
+ *             commands (get_adapter_property)
+ *  -r <rate>  commands per second; 0 runs closed loop (0)
+ *  -c <n>     commands in flight; per session in closed loop, in
+ *             total in open loop (1, or 1024 in open loop)
+ *  -C <n>     number of sessions (1)
+ *  -t <sec>   duration of the measurement (10)
+ *  -w <sec>   warm-up before the measurement (1)
+ *  -n <n>     remote devices to address, 02:00:00:00:ii:ii as in the
+ *             simulated HAL (16)
+ *  -D         start discovery before the run
+ *  -j         print the results as one line of JSON
+ *
+ * Before the run, the load generator registers the services it needs
+ * and enables the adapter. The lag of a notification is the time from
+ * sending the command that triggered it to the notification's
+ * arrival. Every session receives every notification, so notification
+ * statistics come from the first session.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <cutils/sockets.h>
+#include <hardware/bt_sock.h>
+#include "log.h"
+#include "bt-proto.h"
+#include "pdu-codec.h"
+
+enum {
+  /* SERVICE_CORE */
+  OPCODE_CORE_ERROR = 0x00,
+  OPCODE_CORE_REGISTER_MODULE = 0x01,
+  OPCODE_CORE_NTF_OVERFLOW_NTF = 0x81,
+  /* SERVICE_BT_CORE */
+  OPCODE_BT_CORE_ENABLE = 0x01,
+  OPCODE_BT_CORE_GET_ADAPTER_PROPERTIES = 0x03,
+  OPCODE_BT_CORE_GET_ADAPTER_PROPERTY = 0x04,
+  OPCODE_BT_CORE_SET_ADAPTER_PROPERTY = 0x05,
+  OPCODE_BT_CORE_GET_REMOTE_DEVICE_PROPERTIES = 0x06,
+  OPCODE_BT_CORE_GET_REMOTE_DEVICE_PROPERTY = 0x07,
+  OPCODE_BT_CORE_GET_REMOTE_SERVICES = 0x0a,
+  OPCODE_BT_CORE_START_DISCOVERY = 0x0b,
+  OPCODE_BT_CORE_ADAPTER_PROPERTIES_CHANGED_NTF = 0x82,
+  OPCODE_BT_CORE_REMOTE_DEVICE_PROPERTIES_NTF = 0x83,
+  /* SERVICE_BT_SOCK */
+  OPCODE_BT_SOCK_LISTEN = 0x01,
+  OPCODE_BT_SOCK_CONNECT = 0x02
+};
+
+#define DEFAULT_SOCKET ANDROID_SOCKET_DIR "/bluetoothd"
+
+/* Sequence IDs index this many slots for commands in flight */
+#define NSLOTS 65536
+#define MAX_INFLIGHT (NSLOTS / 2)
+
+#define MAX_SESSIONS 128
+
+/* Large enough for two maximum-size PDUs */
+#define RBUF_SIZE (2 * (sizeof(struct pdu) + UINT16_MAX))
+
+/* File descriptors per received message, such as LISTEN's socket */
+#define MAX_FDS 16
+
+/* Time to wait for outstanding responses after the run */
+#define DRAIN_MSEC 1000
+
+/* Time to wait for a response during setup */
+#define SETUP_MSEC 5000
+
+#define LAG_FIFO_SIZE 65536
+
+static struct {
+  const char* path;
+  int seqpacket;
+  unsigned long rate;
+  unsigned long depth;
+  unsigned long nsessions;
+  unsigned long duration_sec;
+  unsigned long warmup_sec;
+  unsigned long ndevices;
+  int discovery;
+  int json;
+} opt = {
+  .path = DEFAULT_SOCKET,
+  .nsessions = 1,
+  .duration_sec = 10,
+  .warmup_sec = 1,
+  .ndevices = 16
+};
+
+static uint64_t
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Samples
+ */
+
+struct samples {
+  uint64_t* v;
+  unsigned long n;
+  unsigned long cap;
+};
+
+static void
+add_sample(struct samples* s, uint64_t v)
+{
+  uint64_t* p;
+  unsigned long cap;
+
+  if (s->n == s->cap) {
+    cap = s->cap ? 2 * s->cap : 4096;
+    p = realloc(s->v, cap * sizeof(*p));
+    if (!p)
+      return; /* drop the sample */
+    s->v = p;
+    s->cap = cap;
+  }
+  s->v[s->n++] = v;
+}
+
+static int
+compare_u64(const void* lhs, const void* rhs)
+{
+  uint64_t l = *(const uint64_t*)lhs;
+  uint64_t r = *(const uint64_t*)rhs;
+
+  return (l > r) - (l < r);
+}
+
+/* Returns the |ppm|-th per million of the sorted samples, in usec */
+static double
+percentile(const struct samples* s, unsigned long ppm)
+{
+  unsigned long i;
+
+  if (!s->n)
+    return 0;
+
+  i = (s->n * (unsigned long long)ppm + 999999) / 1000000;
+  if (i)
+    --i;
+
+  return s->v[i] / 1000.0;
+}
+
+struct distribution {
+  double p50, p99, p999, max;
+};
+
+static void
+get_distribution(struct samples* s, struct distribution* d)
+{
+  qsort(s->v, s->n, sizeof(*s->v), compare_u64);
+
+  d->p50 = percentile(s, 500000);
+  d->p99 = percentile(s, 990000);
+  d->p999 = percentile(s, 999000);
+  d->max = percentile(s, 1000000);
+}
+
+/*
+ * Commands
+ */
+
+struct command {
+  const char* name;
+  uint8_t service;
+  uint8_t opcode;
+  uint8_t ntf_opcode; /* notification that the command triggers, or 0 */
+  long (*build)(struct pdu* pdu, unsigned long i);
+};
+
+static void
+get_remote_addr(unsigned long i, bt_bdaddr_t* addr)
+{
+  addr->address[0] = 0x02;
+  addr->address[1] = 0x00;
+  addr->address[2] = 0x00;
+  addr->address[3] = 0x00;
+  addr->address[4] = (i % opt.ndevices) >> 8;
+  addr->address[5] = (i % opt.ndevices);
+}
+
+static long
+build_get_adapter_property(struct pdu* pdu, unsigned long i)
+{
+  static const uint8_t type[] = {
+    BT_PROPERTY_BDNAME,
+    BT_PROPERTY_BDADDR,
+    BT_PROPERTY_CLASS_OF_DEVICE,
+    BT_PROPERTY_ADAPTER_SCAN_MODE
+  };
+  const struct bt_core_get_adapter_property_cmd msg = {
+    .type = type[i % (sizeof(type) / sizeof(type[0]))]
+  };
+
+  return append_bt_core_get_adapter_property_cmd(pdu, &msg);
+}
+
+static long
+build_set_adapter_property(struct pdu* pdu, unsigned long i)
+{
+  char name[32];
+  bt_property_t property;
+
+  property.type = BT_PROPERTY_BDNAME;
+  property.len = snprintf(name, sizeof(name), "loadgen-%lu", i % 1000);
+  property.val = name;
+
+  return append_bt_property_t(pdu, &property);
+}
+
+static long
+build_get_remote_device_properties(struct pdu* pdu, unsigned long i)
+{
+  struct bt_core_get_remote_device_properties_cmd msg;
+
+  get_remote_addr(i, &msg.remote_addr);
+
+  return append_bt_core_get_remote_device_properties_cmd(pdu, &msg);
+}
+
+static long
+build_get_remote_device_property(struct pdu* pdu, unsigned long i)
+{
+  struct bt_core_get_remote_device_property_cmd msg;
+
+  get_remote_addr(i, &msg.remote_addr);
+  msg.type = BT_PROPERTY_BDNAME;
+
+  return append_bt_core_get_remote_device_property_cmd(pdu, &msg);
+}
+
+static long
+build_get_remote_services(struct pdu* pdu, unsigned long i)
+{
+  struct bt_core_get_remote_services_cmd msg;
+
+  get_remote_addr(i, &msg.remote_addr);
+
+  return append_bt_core_get_remote_services_cmd(pdu, &msg);
+}
+
+static long
+build_listen(struct pdu* pdu, unsigned long i)
+{
+  struct bt_sock_listen_cmd msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = BTSOCK_RFCOMM;
+  snprintf((char*)msg.service_name, sizeof(msg.service_name), "loadgen");
+  msg.channel = 1 + i % 30;
+
+  return append_bt_sock_listen_cmd(pdu, &msg);
+}
+
+static long
+build_connect(struct pdu* pdu, unsigned long i)
+{
+  struct bt_sock_connect_cmd msg;
+
+  memset(&msg, 0, sizeof(msg));
+  get_remote_addr(i, &msg.bd_addr);
+  msg.type = BTSOCK_RFCOMM;
+  msg.channel = 1 + i % 30;
+
+  return append_bt_sock_connect_cmd(pdu, &msg);
+}
+
+static const struct command command[] = {
+  { "get_adapter_properties", SERVICE_BT_CORE,
+    OPCODE_BT_CORE_GET_ADAPTER_PROPERTIES,
+    OPCODE_BT_CORE_ADAPTER_PROPERTIES_CHANGED_NTF, NULL },
+  { "get_adapter_property", SERVICE_BT_CORE,
+    OPCODE_BT_CORE_GET_ADAPTER_PROPERTY,
+    OPCODE_BT_CORE_ADAPTER_PROPERTIES_CHANGED_NTF,
+    build_get_adapter_property },
+  { "set_adapter_property", SERVICE_BT_CORE,
+    OPCODE_BT_CORE_SET_ADAPTER_PROPERTY,
+    OPCODE_BT_CORE_ADAPTER_PROPERTIES_CHANGED_NTF,
+    build_set_adapter_property },
+  { "get_remote_device_properties", SERVICE_BT_CORE,
+    OPCODE_BT_CORE_GET_REMOTE_DEVICE_PROPERTIES,
+    OPCODE_BT_CORE_REMOTE_DEVICE_PROPERTIES_NTF,
+    build_get_remote_device_properties },
+  { "get_remote_device_property", SERVICE_BT_CORE,
+    OPCODE_BT_CORE_GET_REMOTE_DEVICE_PROPERTY,
+    OPCODE_BT_CORE_REMOTE_DEVICE_PROPERTIES_NTF,
+    build_get_remote_device_property },
+  { "get_remote_services", SERVICE_BT_CORE,
+    OPCODE_BT_CORE_GET_REMOTE_SERVICES,
+    OPCODE_BT_CORE_REMOTE_DEVICE_PROPERTIES_NTF,
+    build_get_remote_services },
+  { "listen", SERVICE_BT_SOCK, OPCODE_BT_SOCK_LISTEN, 0, build_listen },
+  { "connect", SERVICE_BT_SOCK, OPCODE_BT_SOCK_CONNECT, 0, build_connect }
+};
+
+#define NCOMMANDS (sizeof(command) / sizeof(command[0]))
+
+static struct {
+  unsigned long weight[NCOMMANDS];
+  unsigned long total_weight;
+  unsigned long next;
+} mix;
+
+static int
+parse_ulong(const char* str, unsigned long* value)
+{
+  char* end;
+
+  errno = 0;
+  *value = strtoul(str, &end, 0);
+  if (errno || !*str || *end)
+    return -1;
+  return 0;
+}
+
+static void
+print_commands(void)
+{
+  size_t i;
+
+  for (i = 0; i < NCOMMANDS; ++i)
+    fprintf(stderr, "  %s\n", command[i].name);
+}
+
+/* Parses name[:weight],... */
+static int
+parse_mix(const char* str)
+{
+  char buf[256];
+  char* entry;
+  char* save;
+  char* colon;
+  unsigned long weight;
+  size_t i;
+
+  if (strlen(str) >= sizeof(buf)) {
+    fprintf(stderr, "command mix too long\n");
+    return -1;
+  }
+  strcpy(buf, str);
+
+  memset(&mix, 0, sizeof(mix));
+
+  for (entry = strtok_r(buf, ",", &save); entry;
+       entry = strtok_r(NULL, ",", &save)) {
+    weight = 1;
+    colon = strchr(entry, ':');
+    if (colon) {
+      *colon = '\0';
+      if (parse_ulong(colon + 1, &weight) < 0 || !weight) {
+        fprintf(stderr, "invalid weight for %s\n", entry);
+        return -1;
+      }
+    }
+    for (i = 0; i < NCOMMANDS; ++i) {
+      if (!strcmp(command[i].name, entry))
+        break;
+    }
+    if (i == NCOMMANDS) {
+      fprintf(stderr, "unknown command %s; commands are\n", entry);
+      print_commands();
+      return -1;
+    }
+    mix.weight[i] += weight;
+    mix.total_weight += weight;
+  }
+
+  if (!mix.total_weight) {
+    fprintf(stderr, "empty command mix\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* Picks the next command. The sequence repeats every total_weight
+ * commands, so runs are reproducible. */
+static size_t
+pick_command(void)
+{
+  unsigned long k;
+  size_t i;
+
+  k = mix.next++ % mix.total_weight;
+
+  for (i = 0; k >= mix.weight[i]; ++i)
+    k -= mix.weight[i];
+
+  return i;
+}
+
+static int
+mix_uses_service(uint8_t service)
+{
+  size_t i;
+
+  for (i = 0; i < NCOMMANDS; ++i) {
+    if (mix.weight[i] && command[i].service == service)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Sessions
+ */
+
+struct rbuf {
+  unsigned long len;
+  unsigned char buf[RBUF_SIZE];
+};
+
+struct session {
+  int cmd_fd;
+  int ntf_fd;
+  unsigned long inflight;
+  struct rbuf rsp;
+  struct rbuf ntf;
+};
+
+static struct session* session[MAX_SESSIONS];
+
+static int
+connect_socket(void)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+
+  if (strlen(opt.path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", opt.path);
+    return -1;
+  }
+  strcpy(addr.sun_path, opt.path);
+
+  fd = socket(AF_UNIX, opt.seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+  if (fd < 0) {
+    ALOGE_ERRNO("socket");
+    return -1;
+  }
+  if (TEMP_FAILURE_RETRY(connect(fd, (struct sockaddr*)&addr,
+                                 sizeof(addr))) < 0) {
+    ALOGE_ERRNO("connect");
+    goto err_connect;
+  }
+  return fd;
+err_connect:
+  if (TEMP_FAILURE_RETRY(close(fd)) < 0)
+    ALOGW_ERRNO("close");
+  return -1;
+}
+
+static void
+close_session(struct session* s)
+{
+  if (TEMP_FAILURE_RETRY(close(s->ntf_fd)) < 0)
+    ALOGW_ERRNO("close");
+  if (TEMP_FAILURE_RETRY(close(s->cmd_fd)) < 0)
+    ALOGW_ERRNO("close");
+  free(s);
+}
+
+/* The daemon takes a client's first connection for commands and
+ * the second for notifications. */
+static struct session*
+open_session(void)
+{
+  struct session* s;
+
+  s = malloc(sizeof(*s));
+  if (!s) {
+    ALOGE_ERRNO("malloc");
+    goto err_malloc;
+  }
+  s->inflight = 0;
+  s->rsp.len = 0;
+  s->ntf.len = 0;
+
+  s->cmd_fd = connect_socket();
+  if (s->cmd_fd < 0)
+    goto err_cmd_fd;
+
+  s->ntf_fd = connect_socket();
+  if (s->ntf_fd < 0)
+    goto err_ntf_fd;
+
+  return s;
+err_ntf_fd:
+  if (TEMP_FAILURE_RETRY(close(s->cmd_fd)) < 0)
+    ALOGW_ERRNO("close");
+err_cmd_fd:
+  free(s);
+err_malloc:
+  return NULL;
+}
+
+static int
+send_pdu(struct session* s, const struct pdu* pdu)
+{
+  ssize_t res;
+
+  res = TEMP_FAILURE_RETRY(send(s->cmd_fd, pdu, pdu_size(pdu),
+                                MSG_NOSIGNAL));
+  if (res < 0) {
+    ALOGE_ERRNO("send");
+    return -1;
+  }
+  return 0;
+}
+
+/* Builds a sequenced command in |buf| */
+static struct pdu*
+build_cmd(void* buf, uint8_t service, uint8_t opcode, uint32_t seq)
+{
+  struct pdu* pdu = buf;
+
+  init_pdu(pdu, service | PDU_SERVICE_SEQUENCED, opcode);
+  append_mem_to_pdu(pdu, &seq, sizeof(seq));
+
+  return pdu;
+}
+
+static void
+close_fds(struct msghdr* msg)
+{
+  struct cmsghdr* chdr;
+  int* fd;
+  int* end;
+
+  for (chdr = CMSG_FIRSTHDR(msg); chdr; chdr = CMSG_NXTHDR(msg, chdr)) {
+    if (chdr->cmsg_level != SOL_SOCKET || chdr->cmsg_type != SCM_RIGHTS)
+      continue;
+    end = (int*)((unsigned char*)chdr + chdr->cmsg_len);
+    for (fd = (int*)CMSG_DATA(chdr); fd < end; ++fd) {
+      if (TEMP_FAILURE_RETRY(close(*fd)) < 0)
+        ALOGW_ERRNO("close");
+    }
+  }
+}
+
+/* Reads once into |rbuf|. Returns 1 on success, 0 if there was
+ * nothing to read, or -1 if the connection is gone. */
+static int
+read_socket(int fd, struct rbuf* rbuf, int flags)
+{
+  union {
+    struct cmsghdr hdr;
+    unsigned char raw[CMSG_SPACE(MAX_FDS * sizeof(int))];
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  ssize_t res;
+
+  iov.iov_base = rbuf->buf + rbuf->len;
+  iov.iov_len = sizeof(rbuf->buf) - rbuf->len;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.raw;
+  msg.msg_controllen = sizeof(control.raw);
+
+  res = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC));
+  if (res < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    ALOGE_ERRNO("recvmsg");
+    return -1;
+  } else if (!res) {
+    return -1;
+  }
+
+  /* sockets from LISTEN and CONNECT aren't used */
+  close_fds(&msg);
+
+  rbuf->len += res;
+
+  return 1;
+}
+
+/* Calls |handle| for each complete PDU in |rbuf| and keeps a
+ * trailing partial PDU. */
+static void
+handle_pdus(struct rbuf* rbuf, struct session* s, uint64_t now,
+            void (*handle)(struct session*, const struct pdu*, uint64_t))
+{
+  unsigned long off, size;
+  const struct pdu* pdu;
+
+  for (off = 0; rbuf->len - off >= sizeof(*pdu); off += size) {
+    pdu = (const struct pdu*)(rbuf->buf + off);
+    size = pdu_size(pdu);
+    if (rbuf->len - off < size)
+      break;
+    handle(s, pdu, now);
+  }
+
+  if (off) {
+    memmove(rbuf->buf, rbuf->buf + off, rbuf->len - off);
+    rbuf->len -= off;
+  }
+}
+
+/* Returns the response's status, or -1 on errors */
+static int
+parse_rsp(const struct pdu* pdu, uint32_t* seq)
+{
+  struct core_status_rsp rsp;
+
+  if (!(pdu->service & PDU_SERVICE_SEQUENCED) || pdu->len < sizeof(*seq)) {
+    ALOGE("unsequenced response PDU(0x%x:0x%x)", pdu->service, pdu->opcode);
+    return -1;
+  }
+  memcpy(seq, pdu->data, sizeof(*seq));
+
+  if (pdu->opcode != OPCODE_CORE_ERROR)
+    return BT_STATUS_SUCCESS;
+
+  if (read_core_status_rsp(pdu, sizeof(*seq), &rsp) < 0)
+    return -1;
+
+  return rsp.status ? rsp.status : BT_STATUS_FAIL;
+}
+
+/*
+ * Setup
+ */
+
+static uint32_t next_seq;
+
+static int
+wait_for_rsp(struct session* s, uint32_t seq)
+{
+  struct pollfd pfd;
+  const struct pdu* pdu;
+  uint32_t rsp_seq;
+  int status, res;
+
+  pfd.fd = s->cmd_fd;
+  pfd.events = POLLIN;
+
+  for (;;) {
+    res = TEMP_FAILURE_RETRY(poll(&pfd, 1, SETUP_MSEC));
+    if (res < 0) {
+      ALOGE_ERRNO("poll");
+      return -1;
+    } else if (!res) {
+      ALOGE("no response from daemon");
+      return -1;
+    }
+    if (read_socket(s->cmd_fd, &s->rsp, 0) < 0)
+      return -1;
+
+    pdu = (const struct pdu*)s->rsp.buf;
+    if (s->rsp.len < sizeof(*pdu) || s->rsp.len < pdu_size(pdu))
+      continue;
+
+    status = parse_rsp(pdu, &rsp_seq);
+    s->rsp.len = 0; /* setup has only one command in flight */
+    if (status < 0 || rsp_seq == seq)
+      return status;
+  }
+}
+
+/* Sends a command and waits for its response. Returns the command's
+ * status, or -1 on errors. */
+static int
+run_setup_cmd(struct session* s, uint8_t service, uint8_t opcode,
+              const void* data, size_t len)
+{
+  union {
+    struct pdu pdu;
+    unsigned char raw[sizeof(struct pdu) + 64];
+  } buf;
+  uint32_t seq;
+
+  seq = next_seq++;
+  build_cmd(&buf, service, opcode, seq);
+  append_mem_to_pdu(&buf.pdu, data, len);
+
+  if (send_pdu(s, &buf.pdu) < 0)
+    return -1;
+
+  return wait_for_rsp(s, seq);
+}
+
+static int
+register_service(struct session* s, uint8_t service)
+{
+  const struct core_register_module_cmd msg = {
+    .service = service,
+    .mode = 0
+  };
+  unsigned char data[core_register_module_cmd_len];
+
+  encode_core_register_module_cmd(data, &msg);
+
+  /* Fails if the service has already been registered, such as by an
+   * earlier run. The commands will fail too if it's missing. */
+  if (run_setup_cmd(s, SERVICE_CORE, OPCODE_CORE_REGISTER_MODULE,
+                    data, sizeof(data)) < 0)
+    return -1;
+
+  return 0;
+}
+
+static int
+set_up_daemon(void)
+{
+  struct session* s;
+  int status;
+
+  s = open_session();
+  if (!s)
+    goto err_open_session;
+
+  if (register_service(s, SERVICE_BT_CORE) < 0)
+    goto err_register_service;
+
+  if (mix_uses_service(SERVICE_BT_SOCK) &&
+      register_service(s, SERVICE_BT_SOCK) < 0)
+    goto err_register_service;
+
+  status = run_setup_cmd(s, SERVICE_BT_CORE, OPCODE_BT_CORE_ENABLE, NULL, 0);
+  if (status) {
+    ALOGE("ENABLE failed with status %d", status);
+    goto err_run_setup_cmd;
+  }
+
+  if (opt.discovery) {
+    status = run_setup_cmd(s, SERVICE_BT_CORE,
+                           OPCODE_BT_CORE_START_DISCOVERY, NULL, 0);
+    if (status) {
+      ALOGE("START_DISCOVERY failed with status %d", status);
+      goto err_run_setup_cmd;
+    }
+  }
+
+  close_session(s);
+
+  return 0;
+err_run_setup_cmd:
+err_register_service:
+  close_session(s);
+err_open_session:
+  return -1;
+}
+
+/*
+ * Run
+ */
+
+struct slot {
+  uint64_t t; /* when the command was due */
+  uint32_t seq;
+  unsigned char busy;
+  unsigned char cmd;
+  struct session* session;
+};
+
+static struct slot slot[NSLOTS];
+
+struct command_stats {
+  unsigned long long sent;
+  unsigned long long ok;
+  unsigned long long failed;
+  struct samples rtt;
+};
+
+struct lag_fifo {
+  uint64_t t[LAG_FIFO_SIZE];
+  unsigned long head;
+  unsigned long tail;
+};
+
+static struct {
+  uint64_t start; /* of the measurement */
+  uint64_t end;
+  int sending;
+  unsigned long inflight;
+  unsigned long long unexpected;
+  struct command_stats cmd[NCOMMANDS];
+  struct samples rtt;
+  unsigned long long ntf;
+  unsigned long long ntf_unmatched;
+  unsigned long long ntf_overflows;
+  unsigned long long ntf_dropped;
+  struct lag_fifo* lag_fifo[256];
+  struct samples lag;
+  unsigned long sessions_lost;
+} run;
+
+static int
+measured(uint64_t t)
+{
+  return t >= run.start && t < run.end;
+}
+
+static int
+send_cmd(struct session* s, uint64_t due)
+{
+  union {
+    struct pdu pdu;
+    unsigned char raw[sizeof(struct pdu) + 512];
+  } buf;
+  const struct command* cmd;
+  struct slot* sl;
+  uint32_t seq;
+  size_t i;
+
+  i = pick_command();
+  cmd = command + i;
+  seq = next_seq++;
+
+  sl = slot + seq % NSLOTS;
+  if (sl->busy) {
+    /* the command's response never arrived */
+    sl->busy = 0;
+    --sl->session->inflight;
+    --run.inflight;
+  }
+
+  build_cmd(&buf, cmd->service, cmd->opcode, seq);
+  if (cmd->build && cmd->build(&buf.pdu, mix.next) < 0)
+    return -1;
+
+  if (send_pdu(s, &buf.pdu) < 0)
+    return -1;
+
+  sl->t = due;
+  sl->seq = seq;
+  sl->busy = 1;
+  sl->cmd = i;
+  sl->session = s;
+
+  ++s->inflight;
+  ++run.inflight;
+
+  if (measured(due))
+    ++run.cmd[i].sent;
+
+  return 0;
+}
+
+static void
+push_lag(uint8_t opcode, uint64_t t)
+{
+  struct lag_fifo* fifo = run.lag_fifo[opcode];
+
+  if (fifo->tail - fifo->head == LAG_FIFO_SIZE)
+    ++fifo->head; /* drop the oldest */
+  fifo->t[fifo->tail++ % LAG_FIFO_SIZE] = t;
+}
+
+static void
+handle_rsp(struct session* s, const struct pdu* pdu, uint64_t now)
+{
+  struct slot* sl;
+  struct command_stats* stats;
+  uint32_t seq;
+  int status;
+
+  status = parse_rsp(pdu, &seq);
+  if (status < 0) {
+    ++run.unexpected;
+    return;
+  }
+
+  sl = slot + seq % NSLOTS;
+  if (!sl->busy || sl->seq != seq || sl->session != s) {
+    ++run.unexpected;
+    return;
+  }
+  sl->busy = 0;
+  --s->inflight;
+  --run.inflight;
+
+  /* the first session receives the notifications of all sessions */
+  if (!status && command[sl->cmd].ntf_opcode)
+    push_lag(command[sl->cmd].ntf_opcode, sl->t);
+
+  if (!measured(sl->t))
+    return;
+
+  stats = run.cmd + sl->cmd;
+  if (status) {
+    ++stats->failed;
+    return;
+  }
+  ++stats->ok;
+  add_sample(&stats->rtt, now - sl->t);
+  add_sample(&run.rtt, now - sl->t);
+}
+
+static void
+handle_ntf(struct session* s, const struct pdu* pdu, uint64_t now)
+{
+  struct core_ntf_overflow_ntf overflow;
+  struct lag_fifo* fifo;
+  uint64_t t;
+
+  if (s != session[0])
+    return;
+
+  if (pdu->service == SERVICE_CORE &&
+      pdu->opcode == OPCODE_CORE_NTF_OVERFLOW_NTF) {
+    if (!measured(now))
+      return;
+    ++run.ntf;
+    ++run.ntf_overflows;
+    if (read_core_ntf_overflow_ntf(pdu, 0, &overflow) >= 0)
+      run.ntf_dropped += overflow.ndropped;
+    return;
+  }
+
+  /* match notifications during the warm-up too, so that the
+   * measurement starts with an empty FIFO */
+  fifo = (pdu->service == SERVICE_BT_CORE) ? run.lag_fifo[pdu->opcode] : NULL;
+  if (fifo && fifo->head != fifo->tail)
+    t = fifo->t[fifo->head++ % LAG_FIFO_SIZE];
+  else
+    t = 0;
+
+  if (!measured(now))
+    return;
+
+  ++run.ntf;
+  if (!t)
+    ++run.ntf_unmatched;
+  else if (measured(t))
+    add_sample(&run.lag, now - t);
+}
+
+static int
+read_session(struct session* s, int ntf)
+{
+  struct rbuf* rbuf;
+  int fd, res;
+
+  fd = ntf ? s->ntf_fd : s->cmd_fd;
+  rbuf = ntf ? &s->ntf : &s->rsp;
+
+  do {
+    res = read_socket(fd, rbuf, MSG_DONTWAIT);
+    if (res < 0)
+      return -1;
+    handle_pdus(rbuf, s, now_ns(), ntf ? handle_ntf : handle_rsp);
+  } while (res);
+
+  return 0;
+}
+
+static void
+lose_session(int epfd, unsigned long i)
+{
+  struct session* s = session[i];
+  unsigned long j;
+
+  ALOGE("daemon closed session %lu", i);
+
+  epoll_ctl(epfd, EPOLL_CTL_DEL, s->cmd_fd, NULL);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, s->ntf_fd, NULL);
+
+  for (j = 0; j < NSLOTS; ++j) {
+    if (slot[j].busy && slot[j].session == s) {
+      slot[j].busy = 0;
+      --run.inflight;
+    }
+  }
+  ++run.sessions_lost;
+
+  close_session(s);
+  session[i] = NULL;
+}
+
+static int
+add_fd(int epfd, int fd, uint64_t data)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = data;
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    ALOGE_ERRNO("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+arm_timer(int fd, uint64_t t)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = t / 1000000000ull;
+  its.it_value.tv_nsec = t % 1000000000ull;
+
+  if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    ALOGE_ERRNO("timerfd_settime");
+    return -1;
+  }
+  return 0;
+}
+
+#define TIMER_DATA UINT64_MAX
+
+/* Sends commands in closed loop; each session keeps opt.depth
+ * commands in flight. */
+static void
+fill_sessions(uint64_t now)
+{
+  unsigned long i;
+
+  for (i = 0; i < opt.nsessions; ++i) {
+    while (session[i] && session[i]->inflight < opt.depth) {
+      if (send_cmd(session[i], now) < 0)
+        break;
+    }
+  }
+}
+
+/* Sends commands in open loop; command k is due at begin + k / rate.
+ * Commands are sent late if opt.depth commands are in flight, but
+ * their round-trip times still count from when they were due. Returns
+ * the time at which the next command is due. */
+static uint64_t
+send_due_cmds(uint64_t begin, uint64_t now)
+{
+  static unsigned long long ncmds;
+  static unsigned long rr;
+  uint64_t due;
+  unsigned long i;
+
+  for (;;) {
+    due = begin + ncmds * 1000000000ull / opt.rate;
+    if (due > now || run.inflight >= opt.depth)
+      return due;
+
+    /* round-robin over the sessions that are left */
+    for (i = 0; i < opt.nsessions && !session[rr % opt.nsessions]; ++i)
+      ++rr;
+    if (i == opt.nsessions)
+      return UINT64_MAX;
+
+    if (send_cmd(session[rr++ % opt.nsessions], due) < 0)
+      return UINT64_MAX;
+    ++ncmds;
+  }
+}
+
+static int
+alloc_lag_fifos(void)
+{
+  size_t i;
+  uint8_t opcode;
+
+  for (i = 0; i < NCOMMANDS; ++i) {
+    opcode = command[i].ntf_opcode;
+    if (!mix.weight[i] || !opcode || run.lag_fifo[opcode])
+      continue;
+    run.lag_fifo[opcode] = calloc(1, sizeof(*run.lag_fifo[opcode]));
+    if (!run.lag_fifo[opcode]) {
+      ALOGE_ERRNO("calloc");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int
+run_load(void)
+{
+  struct epoll_event ev[64];
+  uint64_t begin, now, due, wake, drain_end, expirations;
+  unsigned long i;
+  int epfd, timerfd, n, j, ntf;
+
+  if (alloc_lag_fifos() < 0)
+    goto err_alloc_lag_fifos;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    ALOGE_ERRNO("epoll_create1");
+    goto err_epoll_create1;
+  }
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (timerfd < 0) {
+    ALOGE_ERRNO("timerfd_create");
+    goto err_timerfd_create;
+  }
+  if (add_fd(epfd, timerfd, TIMER_DATA) < 0)
+    goto err_add_fd;
+
+  for (i = 0; i < opt.nsessions; ++i) {
+    session[i] = open_session();
+    if (!session[i])
+      goto err_open_session;
+    if (add_fd(epfd, session[i]->cmd_fd, 2 * i) < 0 ||
+        add_fd(epfd, session[i]->ntf_fd, 2 * i + 1) < 0)
+      goto err_open_session;
+  }
+
+  begin = now_ns();
+  run.start = begin + opt.warmup_sec * 1000000000ull;
+  run.end = run.start + opt.duration_sec * 1000000000ull;
+  run.sending = 1;
+  drain_end = run.end + DRAIN_MSEC * 1000000ull;
+
+  for (;;) {
+    now = now_ns();
+
+    if (now >= run.end) {
+      run.sending = 0;
+      if (!run.inflight || now >= drain_end)
+        break;
+    }
+
+    if (run.sending) {
+      wake = run.end;
+      if (opt.rate) {
+        due = send_due_cmds(begin, now);
+        if (due > now && due < wake)
+          wake = due;
+      } else {
+        fill_sessions(now);
+      }
+    } else {
+      wake = drain_end;
+    }
+    if (arm_timer(timerfd, wake) < 0)
+      goto err_arm_timer;
+
+    n = TEMP_FAILURE_RETRY(epoll_wait(epfd, ev, 64, -1));
+    if (n < 0) {
+      ALOGE_ERRNO("epoll_wait");
+      goto err_epoll_wait;
+    }
+
+    /* Responses first, so that notifications find the commands
+     * that triggered them. */
+    for (ntf = 0; ntf < 2; ++ntf) {
+      for (j = 0; j < n; ++j) {
+        if (ev[j].data.u64 == TIMER_DATA) {
+          if (!ntf && read(timerfd, &expirations, sizeof(expirations)) < 0 &&
+              errno != EAGAIN)
+            ALOGW_ERRNO("read");
+          continue;
+        }
+        if ((int)(ev[j].data.u64 & 1) != ntf)
+          continue;
+        i = ev[j].data.u64 / 2;
+        if (session[i] && read_session(session[i], ntf) < 0)
+          lose_session(epfd, i);
+      }
+    }
+  }
+
+  for (i = 0; i < opt.nsessions; ++i) {
+    if (session[i])
+      close_session(session[i]);
+  }
+  close(timerfd);
+  close(epfd);
+
+  return 0;
+err_epoll_wait:
+err_arm_timer:
+err_open_session:
+  for (i = 0; i < opt.nsessions; ++i) {
+    if (session[i])
+      close_session(session[i]);
+  }
+err_add_fd:
+  close(timerfd);
+err_timerfd_create:
+  close(epfd);
+err_epoll_create1:
+err_alloc_lag_fifos:
+  return -1;
+}
+
+/*
+ * Report
+ */
+
+static void
+print_text(void)
+{
+  struct distribution d;
+  unsigned long long sent, ok, failed;
+  double sec;
+  size_t i;
+
+  sec = opt.duration_sec;
+  sent = ok = failed = 0;
+
+  for (i = 0; i < NCOMMANDS; ++i) {
+    sent += run.cmd[i].sent;
+    ok += run.cmd[i].ok;
+    failed += run.cmd[i].failed;
+  }
+
+  if (opt.rate)
+    printf("mode        open loop, %lu cmd/s, %lu in flight, %lu sessions\n",
+           opt.rate, opt.depth, opt.nsessions);
+  else
+    printf("mode        closed loop, %lu in flight, %lu sessions\n",
+           opt.depth, opt.nsessions);
+
+  printf("commands    %llu sent, %llu ok, %llu failed, %llu lost\n",
+         sent, ok, failed, sent - ok - failed);
+  printf("throughput  %.1f cmd/s\n", ok / sec);
+
+  get_distribution(&run.rtt, &d);
+  printf("rtt usec    p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+         d.p50, d.p99, d.p999, d.max);
+
+  for (i = 0; i < NCOMMANDS; ++i) {
+    if (!run.cmd[i].sent)
+      continue;
+    get_distribution(&run.cmd[i].rtt, &d);
+    printf("  %-28s %9llu ok  p50 %.1f  p99 %.1f  p999 %.1f\n",
+           command[i].name, run.cmd[i].ok, d.p50, d.p99, d.p999);
+  }
+
+  printf("ntf         %llu received (%.1f/s), %llu unmatched, "
+         "%llu overflows dropping %llu\n",
+         run.ntf, run.ntf / sec, run.ntf_unmatched, run.ntf_overflows,
+         run.ntf_dropped);
+
+  get_distribution(&run.lag, &d);
+  printf("ntf lag usec p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+         d.p50, d.p99, d.p999, d.max);
+
+  if (run.unexpected || run.sessions_lost)
+    printf("errors      %llu unexpected responses, %lu sessions lost\n",
+           run.unexpected, run.sessions_lost);
+}
+
+static void
+print_json_distribution(const char* name, struct samples* s)
+{
+  struct distribution d;
+
+  get_distribution(s, &d);
+  printf("\"%s\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+         name, d.p50, d.p99, d.p999, d.max);
+}
+
+static void
+print_json(void)
+{
+  unsigned long long sent, ok, failed;
+  double sec;
+  size_t i;
+  const char* sep;
+
+  sec = opt.duration_sec;
+  sent = ok = failed = 0;
+
+  for (i = 0; i < NCOMMANDS; ++i) {
+    sent += run.cmd[i].sent;
+    ok += run.cmd[i].ok;
+    failed += run.cmd[i].failed;
+  }
+
+  printf("{\"mode\":\"%s\",\"rate\":%lu,\"depth\":%lu,\"sessions\":%lu,"
+         "\"duration_s\":%lu,\"seqpacket\":%s,",
+         opt.rate ? "open" : "closed", opt.rate, opt.depth, opt.nsessions,
+         opt.duration_sec, opt.seqpacket ? "true" : "false");
+  printf("\"sent\":%llu,\"ok\":%llu,\"failed\":%llu,\"lost\":%llu,"
+         "\"throughput\":%.1f,",
+         sent, ok, failed, sent - ok - failed, ok / sec);
+  print_json_distribution("rtt_us", &run.rtt);
+
+  printf(",\"commands\":{");
+  for (i = 0, sep = ""; i < NCOMMANDS; ++i) {
+    if (!run.cmd[i].sent)
+      continue;
+    printf("%s\"%s\":{\"sent\":%llu,\"ok\":%llu,\"failed\":%llu,",
+           sep, command[i].name, run.cmd[i].sent, run.cmd[i].ok,
+           run.cmd[i].failed);
+    print_json_distribution("rtt_us", &run.cmd[i].rtt);
+    printf("}");
+    sep = ",";
+  }
+
+  printf("},\"ntf\":{\"received\":%llu,\"rate\":%.1f,\"unmatched\":%llu,"
+         "\"overflows\":%llu,\"dropped\":%llu,",
+         run.ntf, run.ntf / sec, run.ntf_unmatched, run.ntf_overflows,
+         run.ntf_dropped);
+  print_json_distribution("lag_us", &run.lag);
+
+  printf("},\"unexpected\":%llu,\"sessions_lost\":%lu}\n",
+         run.unexpected, run.sessions_lost);
+}
+
+static int
+parse_options(int argc, char* argv[])
+{
+  unsigned long depth;
+  int opt_c, c;
+
+  opt_c = 0;
+
+  if (parse_mix("get_adapter_property") < 0)
+    return -1;
+
+  while ((c = getopt(argc, argv, "s:Pm:r:c:C:t:w:n:Dj")) != -1) {
+    switch (c) {
+      case 's':
+        opt.path = optarg;
+        break;
+      case 'P':
+        opt.seqpacket = 1;
+        break;
+      case 'm':
+        if (!strcmp(optarg, "help")) {
+          print_commands();
+          return -1;
+        }
+        if (parse_mix(optarg) < 0)
+          return -1;
+        break;
+      case 'r':
+        if (parse_ulong(optarg, &opt.rate) < 0)
+          goto err_optarg;
+        break;
+      case 'c':
+        if (parse_ulong(optarg, &depth) < 0 || !depth)
+          goto err_optarg;
+        opt.depth = depth;
+        opt_c = 1;
+        break;
+      case 'C':
+        if (parse_ulong(optarg, &opt.nsessions) < 0 || !opt.nsessions ||
+            opt.nsessions > MAX_SESSIONS)
+          goto err_optarg;
+        break;
+      case 't':
+        if (parse_ulong(optarg, &opt.duration_sec) < 0 || !opt.duration_sec)
+          goto err_optarg;
+        break;
+      case 'w':
+        if (parse_ulong(optarg, &opt.warmup_sec) < 0)
+          goto err_optarg;
+        break;
+      case 'n':
+        if (parse_ulong(optarg, &opt.ndevices) < 0 || !opt.ndevices)
+          goto err_optarg;
+        break;
+      case 'D':
+        opt.discovery = 1;
+        break;
+      case 'j':
+        opt.json = 1;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  if (!opt_c)
+    opt.depth = opt.rate ? 1024 : 1;
+
+  if ((opt.rate ? opt.depth : opt.depth * opt.nsessions) > MAX_INFLIGHT) {
+    fprintf(stderr, "at most %d commands can be in flight\n", MAX_INFLIGHT);
+    return -1;
+  }
+
+  return 0;
+err_optarg:
+  fprintf(stderr, "invalid argument for -%c: %s\n", c, optarg);
+  return -1;
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (parse_options(argc, argv) < 0)
+    goto err_parse_options;
+
+  if (set_up_daemon() < 0)
+    goto err_set_up_daemon;
+
+  if (run_load() < 0)
+    goto err_run_load;
+
+  if (opt.json)
+    print_json();
+  else
+    print_text();
+
+  exit(EXIT_SUCCESS);
+err_run_load:
+err_set_up_daemon:
+err_parse_options:
+  exit(EXIT_FAILURE);
+}
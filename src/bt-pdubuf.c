@@ -3,35 +3,290 @@
  * You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include "log.h"
 #include "bt-pdubuf.h"
 
-struct pdu_rbuf*
-create_pdu_rbuf(unsigned long maxdatalen)
+/*
+ * PDU buffer pool
+ *
+ * Almost all PDUs are acks, small state notifications, pin or SSP
+ * requests, or short property lists. Buffers for them come from
+ * preallocated blocks of a few size classes; larger buffers, and
+ * everything beyond the capacity of a class, come from malloc().
+ *
+ * Buffers are allocated on Bluedroid's threads and released on
+ * the I/O thread, so each class keeps its free blocks in a
+ * lock-free stack. The stack's head packs the index of the top
+ * block with a tag that changes on every update, which protects
+ * the CAS against ABA. A free block stores the index of the next
+ * free block in its first bytes.
+ */
+
+#define CACHE_LINE_SIZE 64
+
+#define POOL_NIL UINT32_MAX
+
+#define POOL_HEAD(_tag, _index) \
+  ((((uint64_t)(_tag)) << 32) | (_index))
+
+#define POOL_HEAD_INDEX(_head) \
+  ((uint32_t)(_head))
+
+#define POOL_HEAD_TAG(_head) \
+  ((uint32_t)((_head) >> 32))
+
+struct pdu_buf_pool {
+  unsigned long size;
+  unsigned long nblocks;
+  unsigned char* arena;
+  uint64_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+  unsigned long long hits;
+  unsigned long long misses;
+};
+
+#define POOL_ARENA(_size, _nblocks) \
+  static unsigned char arena ## _size[(_size) * (_nblocks)] \
+    __attribute__((aligned(CACHE_LINE_SIZE)))
+
+#define POOL_INIT(_size, _nblocks) \
+  { \
+    .size = (_size), \
+    .nblocks = (_nblocks), \
+    .arena = arena ## _size, \
+    .head = POOL_HEAD(0, POOL_NIL) \
+  }
+
+/* 64 bytes hold references to wbufs, 128 bytes hold acks and
+ * notifications of a few bytes, 512 bytes hold pin and SSP requests.
+ * Block sizes must be multiples of the cache-line size. */
+POOL_ARENA(64, 1024);
+POOL_ARENA(128, 256);
+POOL_ARENA(256, 64);
+POOL_ARENA(512, 64);
+POOL_ARENA(1024, 32);
+
+static struct pdu_buf_pool pool[] = {
+  POOL_INIT(64, 1024),
+  POOL_INIT(128, 256),
+  POOL_INIT(256, 64),
+  POOL_INIT(512, 64),
+  POOL_INIT(1024, 32)
+};
+
+#define NPOOLS (sizeof(pool) / sizeof(pool[0]))
+
+static uint32_t*
+block_next(const struct pdu_buf_pool* p, uint32_t index)
 {
-  struct pdu_rbuf* rbuf;
+  return (uint32_t*)(p->arena + index * p->size);
+}
+
+static void*
+pop_block(struct pdu_buf_pool* p)
+{
+  uint64_t head, next;
+  uint32_t index;
+
+  head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+  do {
+    index = POOL_HEAD_INDEX(head);
+    if (index == POOL_NIL)
+      return NULL;
+    /* The block might have been taken and reused concurrently, in
+     * which case this value is garbage; the tag then fails the CAS. */
+    next = POOL_HEAD(POOL_HEAD_TAG(head) + 1,
+                     __atomic_load_n(block_next(p, index),
+                                     __ATOMIC_RELAXED));
+  } while (!__atomic_compare_exchange_n(&p->head, &head, next, 1,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_ACQUIRE));
+
+  return p->arena + index * p->size;
+}
+
+static void
+push_block(struct pdu_buf_pool* p, void* block)
+{
+  uint64_t head, next;
+  uint32_t index;
+
+  index = ((unsigned char*)block - p->arena) / p->size;
+
+  head = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n(block_next(p, index), POOL_HEAD_INDEX(head),
+                     __ATOMIC_RELAXED);
+    next = POOL_HEAD(POOL_HEAD_TAG(head) + 1, index);
+  } while (!__atomic_compare_exchange_n(&p->head, &head, next, 1,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+/*
+ * Command arena
+ *
+ * Handlers run on the I/O thread, one command at a time. Their
+ * temporaries come from a bump allocator that is reset after each
+ * command. Responses to batched commands are consumed by the batch
+ * before the command completes, so they are built in the arena too.
+ * Releasing a buffer in the arena does nothing.
+ */
+
+#define CMD_ARENA_SIZE (32 * 1024)
+
+static unsigned char cmd_arena[CMD_ARENA_SIZE]
+  __attribute__((aligned(CACHE_LINE_SIZE)));
+static unsigned long cmd_arena_off;
+static int cmd_arena_holds_rsp;
+
+static int
+is_in_cmd_arena(const void* buf)
+{
+  const unsigned char* b = buf;
+
+  return (b >= cmd_arena) && (b < cmd_arena + sizeof(cmd_arena));
+}
+
+void*
+alloc_cmd_arena(unsigned long size)
+{
+  unsigned long off;
+
+  off = (cmd_arena_off + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if (size > sizeof(cmd_arena) - off) {
+    ALOGW("command arena exhausted");
+    return NULL;
+  }
+  cmd_arena_off = off + size;
+
+  return cmd_arena + off;
+}
+
+void
+reset_cmd_arena()
+{
+  cmd_arena_off = 0;
+}
+
+void
+set_cmd_arena_holds_rsp(int holds_rsp)
+{
+  cmd_arena_holds_rsp = holds_rsp;
+}
+
+static struct pdu_buf_pool*
+find_pool_of_block(const void* block)
+{
+  const unsigned char* b = block;
+  size_t i;
+
+  for (i = 0; i < NPOOLS; ++i) {
+    if ((b >= pool[i].arena) &&
+        (b < pool[i].arena + pool[i].size * pool[i].nblocks))
+      return pool + i;
+  }
+  return NULL;
+}
+
+static void*
+alloc_pdu_buf(size_t size)
+{
+  size_t i;
+  void* buf;
+
+  for (i = 0; i < NPOOLS; ++i) {
+    if (size > pool[i].size)
+      continue;
+    buf = pop_block(pool + i);
+    if (buf) {
+      __atomic_add_fetch(&pool[i].hits, 1, __ATOMIC_RELAXED);
+      return buf;
+    }
+    __atomic_add_fetch(&pool[i].misses, 1, __ATOMIC_RELAXED);
+    break; /* larger classes are reserved for larger PDUs */
+  }
 
   errno = 0;
-  rbuf = malloc(sizeof(*rbuf) + maxdatalen);
+  buf = malloc(size);
   if (errno) {
     ALOGE_ERRNO("malloc");
-    goto err_malloc;
+    return NULL;
   }
+  return buf;
+}
+
+static void
+free_pdu_buf(void* buf)
+{
+  struct pdu_buf_pool* p;
+
+  if (is_in_cmd_arena(buf))
+    return;
+
+  p = find_pool_of_block(buf);
+  if (p)
+    push_block(p, buf);
+  else
+    free(buf);
+}
+
+void
+init_pdu_buf_pool()
+{
+  size_t i;
+  uint32_t j;
+
+  for (i = 0; i < NPOOLS; ++i) {
+    for (j = 0; j < pool[i].nblocks; ++j)
+      *block_next(pool + i, j) = (j + 1 < pool[i].nblocks) ? j + 1 : POOL_NIL;
+    __atomic_store_n(&pool[i].head, POOL_HEAD(0, 0), __ATOMIC_RELEASE);
+  }
+}
+
+int
+get_pdu_buf_pool_stats(unsigned long cls, struct pdu_buf_pool_stats* stats)
+{
+  assert(stats);
+
+  if (cls >= NPOOLS)
+    return -1;
+
+  stats->size = pool[cls].size;
+  stats->nblocks = pool[cls].nblocks;
+  stats->hits = __atomic_load_n(&pool[cls].hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&pool[cls].misses, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+/*
+ * PDU buffers
+ */
+
+struct pdu_rbuf*
+create_pdu_rbuf(unsigned long maxdatalen)
+{
+  struct pdu_rbuf* rbuf;
+
+  rbuf = alloc_pdu_buf(sizeof(*rbuf) + maxdatalen);
+  if (!rbuf)
+    goto err_alloc_pdu_buf;
 
   rbuf->maxlen = sizeof(rbuf->buf) + maxdatalen;
   rbuf->len = 0;
 
   return rbuf;
-err_malloc:
+err_alloc_pdu_buf:
   return NULL;
 }
 
 void
 cleanup_pdu_rbuf(struct pdu_rbuf* rbuf)
 {
-  assert(buf);
-  free(rbuf);
+  assert(rbuf);
+  free_pdu_buf(rbuf);
 }
 
 int
@@ -45,7 +300,7 @@ int
 pdu_rbuf_has_pdu(const struct pdu_rbuf* rbuf)
 {
   assert(rbuf);
-  return pdu_rbuf_has_pdu_hdr(rbuf) && (rbuf->len == pdu_size(&rbuf->buf.pdu));
+  return pdu_rbuf_has_pdu_hdr(rbuf) && (rbuf->len >= pdu_size(&rbuf->buf.pdu));
 }
 
 int
@@ -55,44 +310,109 @@ pdu_rbuf_is_full(const struct pdu_rbuf* rbuf)
   return rbuf->len == rbuf->maxlen;
 }
 
+static unsigned long
+pdu_wbuf_tailoff(unsigned long maxdatalen)
+{
+  /* the tail holds iovecs and control messages */
+  return (sizeof(struct pdu_wbuf) + maxdatalen + sizeof(void*) - 1) &
+         ~(sizeof(void*) - 1);
+}
+
+static struct pdu_wbuf*
+init_pdu_wbuf(struct pdu_wbuf* wbuf, unsigned long tailoff)
+{
+  memset(&wbuf->msg, 0, sizeof(wbuf->msg));
+  wbuf->tailoff = tailoff;
+  wbuf->nrefs = 0;
+  wbuf->policy = 0;
+  wbuf->urgent = 0;
+
+  return wbuf;
+}
+
 struct pdu_wbuf*
 create_pdu_wbuf(unsigned long maxdatalen, unsigned long taillen)
 {
   struct pdu_wbuf* wbuf;
+  unsigned long tailoff;
 
-  errno = 0;
-  wbuf = malloc(sizeof(*wbuf) + maxdatalen + taillen);
-  if (errno) {
-    ALOGE_ERRNO("malloc");
-    goto err_malloc;
-  }
+  tailoff = pdu_wbuf_tailoff(maxdatalen);
 
-  wbuf->stailq.stqe_next = NULL;
-  wbuf->tailoff = sizeof(*wbuf) + maxdatalen;
-  wbuf->off = 0;
+  wbuf = alloc_pdu_buf(tailoff + taillen);
+  if (!wbuf)
+    goto err_alloc_pdu_buf;
 
-  return wbuf;
-err_malloc:
+  return init_pdu_wbuf(wbuf, tailoff);
+err_alloc_pdu_buf:
   return NULL;
 }
 
-void
-cleanup_pdu_wbuf(struct pdu_wbuf* wbuf)
+struct pdu_wbuf*
+create_rsp_pdu_wbuf(unsigned long maxdatalen, unsigned long taillen)
 {
-  assert(buf);
-  free(wbuf);
+  struct pdu_wbuf* wbuf;
+  unsigned long tailoff;
+
+  if (!cmd_arena_holds_rsp)
+    return create_pdu_wbuf(maxdatalen, taillen);
+
+  tailoff = pdu_wbuf_tailoff(maxdatalen);
+
+  wbuf = alloc_cmd_arena(tailoff + taillen);
+  if (!wbuf)
+    return create_pdu_wbuf(maxdatalen, taillen);
+
+  return init_pdu_wbuf(wbuf, tailoff);
 }
 
-int
-pdu_wbuf_consumed(const struct pdu_wbuf* wbuf)
+void
+cleanup_pdu_wbuf(struct pdu_wbuf* wbuf)
 {
   assert(wbuf);
-  return wbuf->off == pdu_size(&wbuf->buf.pdu);
+  free_pdu_buf(wbuf);
 }
 
 void*
 pdu_wbuf_tail(struct pdu_wbuf* wbuf)
 {
   assert(wbuf);
-  return wbuf->tail + wbuf->tailoff;
+  return (unsigned char*)wbuf + wbuf->tailoff;
+}
+
+struct pdu_wbuf_ref*
+ref_pdu_wbuf(struct pdu_wbuf* wbuf)
+{
+  struct pdu_wbuf_ref* ref;
+
+  assert(wbuf);
+
+  ref = alloc_pdu_buf(sizeof(*ref));
+  if (!ref)
+    return NULL;
+
+  ref->wbuf = wbuf;
+  ref->iov.iov_base = wbuf->buf.raw;
+  ref->iov.iov_len = pdu_size(&wbuf->buf.pdu);
+
+  /* The caller holds a reference or owns the new wbuf, so the
+   * count can't drop to zero concurrently. */
+  __atomic_add_fetch(&wbuf->nrefs, 1, __ATOMIC_RELAXED);
+
+  return ref;
+}
+
+void
+unref_pdu_wbuf(struct pdu_wbuf_ref* ref)
+{
+  struct pdu_wbuf* wbuf;
+
+  assert(ref);
+
+  wbuf = ref->wbuf;
+  free_pdu_buf(ref);
+
+  /* Releasing orders this thread's reads of the wbuf before the
+   * free on the thread that drops the last reference. */
+  if (!__atomic_sub_fetch(&wbuf->nrefs, 1, __ATOMIC_ACQ_REL))
+    cleanup_pdu_wbuf(wbuf);
 }
@@ -8,6 +8,38 @@
 #include <sys/socket.h>
 #include "bt-proto.h"
 
+struct pdu_buf_pool_stats {
+  unsigned long size; /* block size */
+  unsigned long nblocks;
+  unsigned long long hits;
+  unsigned long long misses; /* served by malloc() */
+};
+
+/* Call once before creating PDU buffers; before, all buffers are
+ * allocated with malloc(). */
+void
+init_pdu_buf_pool(void);
+
+/* Returns -1 if there's no size class |cls|. */
+int
+get_pdu_buf_pool_stats(unsigned long cls, struct pdu_buf_pool_stats* stats);
+
+/* Returns scratch memory for the command that the I/O thread is
+ * handling, or NULL if the command arena is exhausted. The memory
+ * is valid until the command has been handled. */
+void*
+alloc_cmd_arena(unsigned long size);
+
+/* Releases all scratch memory; called after each command. */
+void
+reset_cmd_arena(void);
+
+/* While set, create_rsp_pdu_wbuf() builds responses in the command
+ * arena. Only set this while responses are consumed before the
+ * command completes. */
+void
+set_cmd_arena_holds_rsp(int holds_rsp);
+
 struct pdu_rbuf {
   unsigned long maxlen;
   unsigned long len;
@@ -32,11 +64,17 @@ pdu_rbuf_has_pdu(const struct pdu_rbuf* rbuf);
 int
 pdu_rbuf_is_full(const struct pdu_rbuf* rbuf);
 
+/* A serialized PDU and the message that carries it. Send queues
+ * hold references to the wbuf; once the first reference has been
+ * taken, the PDU and its message are immutable.
+ */
 struct pdu_wbuf {
-  STAILQ_ENTRY(pdu_wbuf) stailq;
   struct msghdr msg;
   unsigned long tailoff;
-  unsigned long off;
+  unsigned long nrefs; /* atomic */
+  unsigned char policy; /* overload policy for notifications */
+  unsigned char urgent; /* notification bypasses coalescing */
+  unsigned char head[4]; /* room for a sequenced response's header */
   union {
     struct pdu pdu;
     unsigned char raw[0];
@@ -47,11 +85,30 @@ struct pdu_wbuf {
 struct pdu_wbuf*
 create_pdu_wbuf(unsigned long maxdatalen, unsigned long taillen);
 
+/* Creates the wbuf for a command's response; call on the I/O thread
+ * only. Release it with cleanup_pdu_wbuf(), as any other wbuf. */
+struct pdu_wbuf*
+create_rsp_pdu_wbuf(unsigned long maxdatalen, unsigned long taillen);
+
 void
 cleanup_pdu_wbuf(struct pdu_wbuf* wbuf);
 
-int
-pdu_wbuf_consumed(const struct pdu_wbuf* wbuf);
-
 void*
 pdu_wbuf_tail(struct pdu_wbuf* wbuf);
+
+/* A send queue's reference to a wbuf. Notifications for multiple
+ * clients share their wbuf, and each reference keeps its own send
+ * progress in |iov|. References can be released on any thread;
+ * the last one frees the wbuf.
+ */
+struct pdu_wbuf_ref {
+  STAILQ_ENTRY(pdu_wbuf_ref) stailq;
+  struct pdu_wbuf* wbuf;
+  struct iovec iov; /* bytes not sent yet */
+};
+
+struct pdu_wbuf_ref*
+ref_pdu_wbuf(struct pdu_wbuf* wbuf);
+
+void
+unref_pdu_wbuf(struct pdu_wbuf_ref* ref);
@@ -4,8 +4,10 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include "log.h"
 #include "bt-proto.h"
+#include "pdu-codec.h"
 
 void
 init_pdu(struct pdu* pdu, uint8_t service, uint8_t opcode)
@@ -23,38 +25,6 @@ pdu_size(const struct pdu* pdu)
   return sizeof(*pdu) + pdu->len;
 }
 
-static bt_status_t
-handle_pdu(const char* field, uint8_t value, const struct pdu* cmd,
-           bt_status_t (* const handler[256])(const struct pdu*))
-{
-  assert(field);
-  assert(pdu);
-  assert(handler);
-
-  if (!handler[value]) {
-    ALOGE("unsupported %s 0x%x", field, value);
-    return BT_STATUS_UNSUPPORTED;
-  }
-  return handler[value](cmd);
-err_handler:
-err_not_handler:
-  return -1;
-}
-
-bt_status_t
-handle_pdu_by_service(const struct pdu* cmd,
-                      bt_status_t (* const handler[256])(const struct pdu*))
-{
-  return handle_pdu("service", cmd->service, cmd, handler);
-}
-
-bt_status_t
-handle_pdu_by_opcode(const struct pdu* cmd,
-                     bt_status_t (* const handler[256])(const struct pdu*))
-{
-  return handle_pdu("opcode", cmd->opcode, cmd, handler);
-}
-
 static long
 read_pdu_at_va(const struct pdu* pdu, unsigned long off,
                const char* fmt, va_list ap)
@@ -129,7 +99,8 @@ read_pdu_at(const struct pdu* pdu, unsigned long off, const char* fmt, ...)
 }
 
 static long
-write_pdu_at_va(struct pdu* pdu, unsigned long off, const char* fmt, va_list ap)
+write_pdu_va(struct pdu* pdu, unsigned long off, unsigned long maxlen,
+             const char* fmt, va_list ap)
 {
   int8_t c;
   uint8_t C;
@@ -145,22 +116,22 @@ write_pdu_at_va(struct pdu* pdu, unsigned long off, const char* fmt, va_list ap)
   for (; *fmt; ++fmt) {
     switch (*fmt) {
       case 'c': /* signed 8 bit */
-        c = va_arg(ap, int8_t);
+        c = va_arg(ap, int); /* promoted */
         src = &c;
         len = 1;
         break;
       case 'C': /* unsigned 8 bit*/
-        C = va_arg(ap, uint8_t);
+        C = va_arg(ap, int); /* promoted */
         src = &C;
         len = 1;
         break;
       case 's': /* signed 16 bit */
-        s = va_arg(ap, int16_t);
+        s = va_arg(ap, int); /* promoted */
         src = &s;
         len = 2;
         break;
       case 'S': /* unsigned 16 bit */
-        S = va_arg(ap, uint16_t);
+        S = va_arg(ap, int); /* promoted */
         src = &S;
         len = 2;
         break;
@@ -192,7 +163,7 @@ write_pdu_at_va(struct pdu* pdu, unsigned long off, const char* fmt, va_list ap)
         ALOGE("invalid format character %c", *fmt);
         return -1;
     }
-    if (off+len > pdu->len) {
+    if (off+len > maxlen) {
       ALOGE("PDU overflow");
       return -1;
     }
@@ -203,69 +174,6 @@ write_pdu_at_va(struct pdu* pdu, unsigned long off, const char* fmt, va_list ap)
   return off;
 }
 
-long
-read_bt_property_t(const struct pdu* pdu, unsigned long off,
-                   bt_property_t* property)
-{
-  uint8_t type;
-  uint16_t len;
-  long res;
-  void* val;
-
-  assert(property);
-
-  res = read_pdu_at(pdu, off, "CS", &type, &len);
-  if (res < 0)
-    return -1;
-  off = res;
-
-  errno = 0;
-  val = malloc(len);
-  if (errno) {
-    ALOGE_ERRNO("malloc");
-    return -1;
-  }
-
-  res = read_pdu_at(pdu, off, "m", val, (size_t)len);
-  if (res < 0)
-    goto err_read_pdu_at;
-  off = res;
-
-  property->type = type;
-  property->len = len;
-  property->val = val;
-
-  return off;
-err_read_pdu_at:
-  free(val);
-  return -1;
-}
-
-long
-read_bt_bdaddr_t(const struct pdu* pdu, unsigned long off, bt_bdaddr_t* addr)
-{
-  assert(addr);
-
-  return read_pdu_at(pdu, off, "m", addr->address, (size_t)6);
-}
-
-long
-read_bt_uuid_t(const struct pdu* pdu, unsigned long off, bt_uuid_t* uuid)
-{
-  assert(addr);
-
-  return read_pdu_at(pdu, off, "m", uuid->uu, (size_t)16);
-}
-
-long
-read_bt_pin_code_t(const struct pdu* pdu, unsigned long off,
-                   bt_pin_code_t* pin_code)
-{
-  assert(addr);
-
-  return read_pdu_at(pdu, off, "m", pin_code->pin, (size_t)16);
-}
-
 long
 write_pdu_at(struct pdu* pdu, unsigned long off, const char* fmt, ...)
 {
@@ -273,7 +181,7 @@ write_pdu_at(struct pdu* pdu, unsigned long off, const char* fmt, ...)
   long res;
 
   va_start(ap, fmt);
-  res = write_pdu_at(pdu, off, fmt, ap);
+  res = write_pdu_va(pdu, off, pdu->len, fmt, ap);
   va_end(ap);
 
   return res;
@@ -285,8 +193,9 @@ append_to_pdu(struct pdu* pdu, const char* fmt, ...)
   va_list ap;
   long res;
 
+  /* the caller allocated the PDU's buffer large enough */
   va_start(ap, fmt);
-  res = write_pdu_at(pdu, pdu->len, fmt, ap);
+  res = write_pdu_va(pdu, pdu->len, UINT16_MAX, fmt, ap);
   va_end(ap);
 
   if (res > 0)
@@ -296,23 +205,68 @@ append_to_pdu(struct pdu* pdu, const char* fmt, ...)
 }
 
 long
-append_bt_property_t(struct pdu* pdu, const bt_property_t* property)
+read_pdu_mem_at(const struct pdu* pdu, unsigned long off,
+                void* dst, size_t len)
 {
-  uint8_t type = property->type;
-  uint16_t len = property->len;
-  const void* val = property->val;
+  if (off+len > pdu->len) {
+    ALOGE("PDU overflow");
+    return -1;
+  }
+  memcpy(dst, pdu->data+off, len);
 
-  return append_to_pdu(pdu, "CSm", type, len, val, (size_t)len);
+  return off+len;
 }
 
 long
-append_bt_bdaddr_t(struct pdu* pdu, const bt_bdaddr_t* addr)
+append_mem_to_pdu(struct pdu* pdu, const void* src, size_t len)
 {
-  return append_to_pdu(pdu, "m", addr->address, (size_t)6);
+  /* the caller allocated the PDU's buffer large enough */
+  if (pdu->len+len > UINT16_MAX) {
+    ALOGE("PDU overflow");
+    return -1;
+  }
+  memcpy(pdu->data+pdu->len, src, len);
+  pdu->len += len;
+
+  return pdu->len;
 }
 
 long
-append_bt_bdname_t(struct pdu* pdu, const bt_bdname_t* name)
+read_bt_property_t(const struct pdu* pdu, unsigned long off,
+                   bt_property_t* property)
 {
-  return append_to_pdu(pdu, "m", name->name, (size_t)249);
+  struct bt_property_hdr hdr;
+  long res;
+
+  assert(property);
+
+  res = read_bt_property_hdr(pdu, off, &hdr);
+  if (res < 0)
+    return -1;
+  off = res;
+
+  if (off+hdr.len > pdu->len) {
+    ALOGE("PDU overflow");
+    return -1;
+  }
+
+  property->type = hdr.type;
+  property->len = hdr.len;
+  property->val = (void*)(pdu->data+off);
+
+  return off+hdr.len;
+}
+
+long
+append_bt_property_t(struct pdu* pdu, const bt_property_t* property)
+{
+  const struct bt_property_hdr hdr = {
+    .type = property->type,
+    .len = property->len
+  };
+
+  if (append_bt_property_hdr(pdu, &hdr) < 0)
+    return -1;
+
+  return append_mem_to_pdu(pdu, property->val, hdr.len);
 }
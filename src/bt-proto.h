@@ -13,6 +13,13 @@ enum {
   SERVICE_BT_SOCK = 0x02
 };
 
+/* Commands with this bit set in their service are sequenced. Their
+ * data starts with a 32-bit sequence ID, which the daemon copies into
+ * the response. A client can keep many sequenced commands in flight,
+ * and match their responses by ID in whatever order they arrive.
+ */
+#define PDU_SERVICE_SEQUENCED 0x80
+
 struct pdu {
   uint8_t service;
   uint8_t opcode;
@@ -26,45 +33,37 @@ init_pdu(struct pdu* pdu, uint8_t service, uint8_t opcode);
 size_t
 pdu_size(const struct pdu* pdu);
 
-bt_status_t
-handle_pdu_by_service(const struct pdu* cmd,
-                      bt_status_t (* const handler[256])(const struct pdu*));
-
-bt_status_t
-handle_pdu_by_opcode(const struct pdu* cmd,
-                     bt_status_t (* const handler[256])(const struct pdu*));
+/* Format-string driven accessors; see read_pdu_at_va() for the
+ * format characters. Daemon code uses the generated codecs from
+ * pdu-codec.h instead, which are type-checked and faster.
+ */
 
 long
 read_pdu_at(const struct pdu* pdu, unsigned long off, const char* fmt, ...);
 
 long
-read_bt_property_t(const struct pdu* pdu, unsigned long off,
-                   bt_property_t* property);
-
-long
-read_bt_bdaddr_t(const struct pdu* pdu, unsigned long off, bt_bdaddr_t* addr);
+write_pdu_at(struct pdu* pdu, unsigned long off, const char* fmt, ...);
 
 long
-read_bt_uuid_t(const struct pdu* pdu, unsigned long off, bt_uuid_t* uuid);
+append_to_pdu(struct pdu* pdu, const char* fmt, ...);
 
-long
-read_bt_pin_code_t(const struct pdu* pdu, unsigned long off,
-                   bt_pin_code_t* pin_code);
+/* Accessors for variable-length data */
 
 long
-write_pdu_at(struct pdu* pdu, unsigned long off, const char* fmt, ...);
+read_pdu_mem_at(const struct pdu* pdu, unsigned long off,
+                void* dst, size_t len);
 
 long
-append_bt_property_t(struct pdu* pdu, const bt_property_t* property);
+append_mem_to_pdu(struct pdu* pdu, const void* src, size_t len);
 
+/* The property's value points into the PDU, so it is only valid
+ * while the PDU is, and must not be modified. PDUs are packed, so
+ * the value can be at any address; don't dereference it as a typed
+ * pointer without copying it first.
+ */
 long
-append_to_pdu(struct pdu* pdu, const char* fmt, ...);
+read_bt_property_t(const struct pdu* pdu, unsigned long off,
+                   bt_property_t* property);
 
 long
 append_bt_property_t(struct pdu* pdu, const bt_property_t* property);
-
-long
-append_bt_bdaddr_t(struct pdu* pdu, const bt_bdaddr_t* addr);
-
-long
-append_bt_bdname_t(struct pdu* pdu, const bt_bdname_t* name);
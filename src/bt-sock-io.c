@@ -6,7 +6,10 @@
 #include <string.h>
 #include <sys/socket.h>
 #include "bt-proto.h"
+#include "pdu-codec.h"
 #include "bt-pdubuf.h"
+#include "service.h"
+#include "task.h"
 #include "bt-sock.h"
 #include "bt-sock-io.h"
 
@@ -26,7 +29,7 @@ build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
 
   iov = pdu_wbuf_tail(wbuf);
   iov->iov_base = wbuf->buf.raw;
-  iov->iov_len = wbuf->off;
+  iov->iov_len = pdu_size(&wbuf->buf.pdu);
 
   memset(&wbuf->msg, 0, sizeof(wbuf->msg));
   wbuf->msg.msg_iov = iov;
@@ -35,30 +38,30 @@ build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
   return wbuf;
 }
 
+/* Size of the tail for a PDU with a file descriptor */
+#define PDU_WBUF_FD_TAILLEN \
+  (sizeof(struct iovec) + CMSG_SPACE(sizeof(int)))
+
 static struct pdu_wbuf*
 build_pdu_wbuf_msg_with_fd(struct pdu_wbuf* wbuf, int fd)
 {
   struct iovec* iov;
-  union {
-    struct cmsghdr chdr;
-    unsigned char data[CMSG_SPACE(sizeof(fd))];
-  } cmsg;
   struct cmsghdr* chdr;
 
   assert(wbuf);
 
   iov = pdu_wbuf_tail(wbuf);
   iov->iov_base = wbuf->buf.raw;
-  iov->iov_len = wbuf->off;
+  iov->iov_len = pdu_size(&wbuf->buf.pdu);
 
   memset(&wbuf->msg, 0, sizeof(wbuf->msg));
   wbuf->msg.msg_iov = iov;
   wbuf->msg.msg_iovlen = 1;
   wbuf->msg.msg_control = iov + 1;
-  wbuf->msg.msg_controllen = sizeof(cmsg);
+  wbuf->msg.msg_controllen = CMSG_SPACE(sizeof(fd));
 
   chdr = CMSG_FIRSTHDR(&wbuf->msg);
-  chdr->cmsg_len = sizeof(fd);
+  chdr->cmsg_len = CMSG_LEN(sizeof(fd));
   chdr->cmsg_level = SOL_SOCKET;
   chdr->cmsg_type = SCM_RIGHTS;
   *((int*)CMSG_DATA(chdr)) = fd;
@@ -73,25 +76,20 @@ build_pdu_wbuf_msg_with_fd(struct pdu_wbuf* wbuf, int fd)
 static bt_status_t
 opcode_listen(const struct pdu* cmd)
 {
-  uint8_t type;
-  int8_t service_name[256];
-  uint8_t uuid[16];
-  uint16_t channel;
-  uint8_t flags;
+  struct bt_sock_listen_cmd msg;
   int sock_fd;
   struct pdu_wbuf* wbuf;
   bt_status_t status;
 
-  if (read_pdu_at(cmd, 0, "CmmSC", &type,
-                                   service_name, (size_t)sizeof(service_name),
-                                   uuid, (size_t)uuid, &channel, &flags) < 0)
+  if (read_bt_sock_listen_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, PDU_WBUF_FD_TAILLEN);
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_sock_listen(type, (char*)service_name, uuid, channel, &sock_fd, flags);
+  status = bt_sock_listen(msg.type, (char*)msg.service_name, msg.uuid,
+                          msg.channel, &sock_fd, msg.flags);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_sock_listen;
 
@@ -107,28 +105,20 @@ err_bt_sock_listen:
 static bt_status_t
 opcode_connect(const struct pdu* cmd)
 {
-  long off;
-  bt_bdaddr_t bd_addr;
-  uint8_t type;
-  uint8_t uuid[16];
-  uint16_t channel;
-  uint8_t flags;
+  struct bt_sock_connect_cmd msg;
   int sock_fd;
   struct pdu_wbuf* wbuf;
   bt_status_t status;
 
-  off = read_bt_bdaddr_t(cmd, 0, &bd_addr);
-  if (off < 0)
-    return BT_STATUS_PARM_INVALID;
-  if (read_pdu_at(cmd, off, "CmSC", &type, uuid, (size_t)uuid,
-                                   &channel, &flags) < 0)
+  if (read_bt_sock_connect_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_PARM_INVALID;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, PDU_WBUF_FD_TAILLEN);
   if (!wbuf)
     return BT_STATUS_NOMEM;
 
-  status = bt_sock_connect(&bd_addr, type, uuid, channel, &sock_fd, flags);
+  status = bt_sock_connect(&msg.bd_addr, msg.type, msg.uuid,
+                           msg.channel, &sock_fd, msg.flags);
   if (status != BT_STATUS_SUCCESS)
     goto err_bt_sock_listen;
 
@@ -141,27 +131,25 @@ err_bt_sock_listen:
   return status;
 }
 
-static bt_status_t
-bt_sock_handler(const struct pdu* cmd)
-{
-  static bt_status_t (* const handler[256])(const struct pdu*) = {
-    [OPCODE_LISTEN] = opcode_listen,
-    [OPCODE_CONNECT] = opcode_connect,
-  };
-
-  return handle_pdu_by_opcode(cmd, handler);
-}
+static const struct service_op bt_sock_op[] = {
+  { OPCODE_LISTEN, TASK_CLASS_INTERACTIVE,
+    bt_sock_listen_cmd_len, bt_sock_listen_cmd_len,
+    opcode_listen, SERVICE_OP_UNBATCHED },
+  { OPCODE_CONNECT, TASK_CLASS_INTERACTIVE,
+    bt_sock_connect_cmd_len, bt_sock_connect_cmd_len,
+    opcode_connect, SERVICE_OP_UNBATCHED },
+  { 0, 0, 0, 0, NULL }
+};
 
-bt_status_t
-(*register_bt_sock(unsigned char mode,
-                   void (*send_pdu_cb)(struct pdu_wbuf*)))(const struct pdu*)
+const struct service_op*
+register_bt_sock(unsigned char mode, void (*send_pdu_cb)(struct pdu_wbuf*))
 {
   if (init_bt_sock() < 0)
     return NULL;
 
   send_pdu = send_pdu_cb;
 
-  return bt_sock_handler;
+  return bt_sock_op;
 }
 
 int
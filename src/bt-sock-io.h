@@ -4,12 +4,11 @@
 
 #pragma once
 
-struct pdu;
 struct pdu_wbuf;
+struct service_op;
 
-bt_status_t
-(*register_bt_sock(unsigned char mode,
-                   void (*send_pdu_cb)(struct pdu_wbuf*)))(const struct pdu*);
+const struct service_op*
+register_bt_sock(unsigned char mode, void (*send_pdu_cb)(struct pdu_wbuf*));
 
 int
 unregister_bt_sock(void);
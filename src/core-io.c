@@ -4,12 +4,22 @@
 
 #include <assert.h>
 #include <string.h>
+#include <sys/socket.h>
+#include "log.h"
 #include "bt-proto.h"
+#include "pdu-codec.h"
 #include "bt-pdubuf.h"
+#include "service.h"
+#include "task.h"
 #include "core.h"
 #include "core-io.h"
+#include "ntf-ring.h"
 
 static void (*send_pdu)(struct pdu_wbuf* wbuf);
+static int (*open_ntf_ring)(unsigned long size, int fd[2]);
+static int (*grant_ntf_credits)(unsigned long credits);
+static bt_status_t (*handle_batched_pdu)(const struct pdu* cmd,
+                                         struct pdu_wbuf** rsp);
 
 static struct pdu_wbuf*
 build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
@@ -20,7 +30,7 @@ build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
 
   iov = pdu_wbuf_tail(wbuf);
   iov->iov_base = wbuf->buf.raw;
-  iov->iov_len = wbuf->off;
+  iov->iov_len = pdu_size(&wbuf->buf.pdu);
 
   memset(&wbuf->msg, 0, sizeof(wbuf->msg));
   wbuf->msg.msg_iov = iov;
@@ -29,26 +39,62 @@ build_pdu_wbuf_msg(struct pdu_wbuf* wbuf)
   return wbuf;
 }
 
+/* Size of the tail for a PDU with two file descriptors */
+#define PDU_WBUF_FDS_TAILLEN \
+  (sizeof(struct iovec) + CMSG_SPACE(2 * sizeof(int)))
+
+static struct pdu_wbuf*
+build_pdu_wbuf_msg_with_fds(struct pdu_wbuf* wbuf, const int fd[2])
+{
+  struct iovec* iov;
+  struct cmsghdr* chdr;
+
+  assert(wbuf);
+
+  iov = pdu_wbuf_tail(wbuf);
+  iov->iov_base = wbuf->buf.raw;
+  iov->iov_len = pdu_size(&wbuf->buf.pdu);
+
+  memset(&wbuf->msg, 0, sizeof(wbuf->msg));
+  wbuf->msg.msg_iov = iov;
+  wbuf->msg.msg_iovlen = 1;
+  wbuf->msg.msg_control = iov + 1;
+  wbuf->msg.msg_controllen = CMSG_SPACE(2 * sizeof(*fd));
+
+  chdr = CMSG_FIRSTHDR(&wbuf->msg);
+  chdr->cmsg_len = CMSG_LEN(2 * sizeof(*fd));
+  chdr->cmsg_level = SOL_SOCKET;
+  chdr->cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(chdr), fd, 2 * sizeof(*fd));
+
+  return wbuf;
+}
+
 enum {
+  /* commands/responses */
   OPCODE_REGISTER_MODULE = 0x01,
-  OPCODE_UNREGISTER_MODULE = 0x02
+  OPCODE_UNREGISTER_MODULE = 0x02,
+  OPCODE_OPEN_NTF_RING = 0x03,
+  OPCODE_GRANT_NTF_CREDITS = 0x04,
+  OPCODE_BATCH = 0x05,
+  /* notifications */
+  OPCODE_NTF_OVERFLOW_NTF = 0x81
 };
 
 static bt_status_t
 register_module(const struct pdu* cmd)
 {
-  uint8_t service;
-  uint8_t mode;
+  struct core_register_module_cmd msg;
   struct pdu_wbuf* wbuf;
 
-  if (read_pdu_at(cmd, 0, "CC", &service, &mode) < 0)
+  if (read_core_register_module_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_FAIL;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_FAIL;
 
-  if (core_register_module(service, mode) < 0)
+  if (core_register_module(msg.service, msg.mode) < 0)
     goto err_core_register_module;
 
   init_pdu(&wbuf->buf.pdu, cmd->service, cmd->opcode);
@@ -63,17 +109,17 @@ err_core_register_module:
 static bt_status_t
 unregister_module(const struct pdu* cmd)
 {
-  uint8_t service;
+  struct core_unregister_module_cmd msg;
   struct pdu_wbuf* wbuf;
 
-  if (read_pdu_at(cmd, 0, "C", &service) < 0)
+  if (read_core_unregister_module_cmd(cmd, 0, &msg) < 0)
     return BT_STATUS_FAIL;
 
-  wbuf = create_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
   if (!wbuf)
     return BT_STATUS_FAIL;
 
-  if (core_unregister_module(service) < 0)
+  if (core_unregister_module(msg.service) < 0)
     goto err_core_unregister_module;
 
   init_pdu(&wbuf->buf.pdu, cmd->service, cmd->opcode);
@@ -85,26 +131,210 @@ err_core_unregister_module:
   return BT_STATUS_FAIL;
 }
 
+/* The response carries the ring's memfd and eventfd. A size of 0
+ * selects the default size. */
+static bt_status_t
+opcode_open_ntf_ring(const struct pdu* cmd)
+{
+  struct core_open_ntf_ring_cmd msg;
+  struct pdu_wbuf* wbuf;
+  int fd[2];
+
+  if (read_core_open_ntf_ring_cmd(cmd, 0, &msg) < 0)
+    return BT_STATUS_FAIL;
+
+  wbuf = create_rsp_pdu_wbuf(0, PDU_WBUF_FDS_TAILLEN);
+  if (!wbuf)
+    return BT_STATUS_FAIL;
+
+  if (open_ntf_ring(msg.size ? msg.size : NTF_RING_DEFAULT_SIZE, fd) < 0)
+    goto err_open_ntf_ring;
+
+  init_pdu(&wbuf->buf.pdu, cmd->service, cmd->opcode);
+  send_pdu(build_pdu_wbuf_msg_with_fds(wbuf, fd));
+
+  return BT_STATUS_SUCCESS;
+err_open_ntf_ring:
+  cleanup_pdu_wbuf(wbuf);
+  return BT_STATUS_FAIL;
+}
+
+/* Each notification costs a credit. Once a client has granted
+ * credits, it has to keep granting them to receive notifications. */
 static bt_status_t
-core_handler(const struct pdu* cmd)
+opcode_grant_ntf_credits(const struct pdu* cmd)
 {
-  static bt_status_t (* const handler[256])(const struct pdu*) = {
-    [OPCODE_REGISTER_MODULE] = register_module,
-    [OPCODE_UNREGISTER_MODULE] = unregister_module
+  struct core_grant_ntf_credits_cmd msg;
+  struct pdu_wbuf* wbuf;
+
+  if (read_core_grant_ntf_credits_cmd(cmd, 0, &msg) < 0)
+    return BT_STATUS_FAIL;
+
+  wbuf = create_rsp_pdu_wbuf(0, sizeof(*wbuf->msg.msg_iov));
+  if (!wbuf)
+    return BT_STATUS_FAIL;
+
+  if (grant_ntf_credits(msg.credits) < 0)
+    goto err_grant_ntf_credits;
+
+  init_pdu(&wbuf->buf.pdu, cmd->service, cmd->opcode);
+  send_pdu(build_pdu_wbuf_msg(wbuf));
+
+  return BT_STATUS_SUCCESS;
+err_grant_ntf_credits:
+  cleanup_pdu_wbuf(wbuf);
+  return BT_STATUS_FAIL;
+}
+
+/* A batch holds a count and that many commands back to back. They
+ * are handled in order, and the response holds a status for each,
+ * followed by the command's response if the status is success.
+ * Commands marked SERVICE_OP_UNBATCHED, such as BATCH itself and
+ * commands whose responses carry file descriptors, are rejected
+ * before their handlers run.
+ */
+static bt_status_t
+opcode_batch(const struct pdu* cmd)
+{
+  struct core_batch_cmd msg;
+  struct core_batch_rsp batch_rsp;
+  struct core_batch_entry_rsp entry_rsp;
+  uint8_t i, n;
+  unsigned long off, len;
+  const struct pdu* entry;
+  struct pdu_wbuf** rsp;
+  bt_status_t* status;
+  struct pdu_wbuf* wbuf;
+
+  if (read_core_batch_cmd(cmd, 0, &msg) < 0)
+    return BT_STATUS_FAIL;
+
+  rsp = alloc_cmd_arena(msg.count * sizeof(*rsp));
+  status = alloc_cmd_arena(msg.count * sizeof(*status));
+  if (!rsp || !status)
+    return BT_STATUS_NOMEM;
+
+  len = core_batch_rsp_len + msg.count * core_batch_entry_rsp_len;
+
+  for (off = core_batch_cmd_len, n = 0; n < msg.count;
+       ++n, off += pdu_size(entry)) {
+    entry = (const struct pdu*)(cmd->data + off);
+    if ((off + sizeof(*entry) > cmd->len) ||
+        (off + pdu_size(entry) > cmd->len)) {
+      ALOGE("batch entry %u exceeds PDU", n);
+      goto err_entry;
+    }
+    rsp[n] = NULL;
+    status[n] = handle_batched_pdu(entry, rsp + n);
+    if ((status[n] == BT_STATUS_SUCCESS) && !rsp[n])
+      status[n] = BT_STATUS_FAIL;
+    if (rsp[n] && (status[n] != BT_STATUS_SUCCESS)) {
+      cleanup_pdu_wbuf(rsp[n]);
+      rsp[n] = NULL;
+    }
+    if (rsp[n])
+      len += pdu_size(&rsp[n]->buf.pdu);
+  }
+
+  if (len > UINT16_MAX) {
+    ALOGE("batch response of %lu bytes exceeds PDU", len);
+    goto err_len;
+  }
+
+  wbuf = create_rsp_pdu_wbuf(len, sizeof(*wbuf->msg.msg_iov));
+  if (!wbuf)
+    goto err_create_rsp_pdu_wbuf;
+
+  init_pdu(&wbuf->buf.pdu, cmd->service, cmd->opcode);
+  batch_rsp.count = msg.count;
+  append_core_batch_rsp(&wbuf->buf.pdu, &batch_rsp);
+  for (i = 0; i < msg.count; ++i) {
+    entry_rsp.status = status[i];
+    append_core_batch_entry_rsp(&wbuf->buf.pdu, &entry_rsp);
+    if (!rsp[i])
+      continue;
+    append_mem_to_pdu(&wbuf->buf.pdu, rsp[i]->buf.raw,
+                      pdu_size(&rsp[i]->buf.pdu));
+    cleanup_pdu_wbuf(rsp[i]);
+  }
+  send_pdu(build_pdu_wbuf_msg(wbuf));
+
+  return BT_STATUS_SUCCESS;
+err_create_rsp_pdu_wbuf:
+err_len:
+err_entry:
+  for (i = 0; i < n; ++i) {
+    if (rsp[i])
+      cleanup_pdu_wbuf(rsp[i]);
+  }
+  return BT_STATUS_FAIL;
+}
+
+static const struct service_op core_op[] = {
+  { OPCODE_REGISTER_MODULE, TASK_CLASS_STATE,
+    core_register_module_cmd_len, core_register_module_cmd_len,
+    register_module },
+  { OPCODE_UNREGISTER_MODULE, TASK_CLASS_STATE,
+    core_unregister_module_cmd_len, core_unregister_module_cmd_len,
+    unregister_module },
+  { OPCODE_OPEN_NTF_RING, TASK_CLASS_STATE,
+    core_open_ntf_ring_cmd_len, core_open_ntf_ring_cmd_len,
+    opcode_open_ntf_ring, SERVICE_OP_UNBATCHED },
+  { OPCODE_GRANT_NTF_CREDITS, TASK_CLASS_INTERACTIVE,
+    core_grant_ntf_credits_cmd_len, core_grant_ntf_credits_cmd_len,
+    opcode_grant_ntf_credits },
+  { OPCODE_BATCH, TASK_CLASS_BULK,
+    core_batch_cmd_len, UINT16_MAX,
+    opcode_batch, SERVICE_OP_UNBATCHED },
+  { 0, 0, 0, 0, NULL }
+};
+
+/*
+ * Notifications
+ */
+
+struct pdu_wbuf*
+create_ntf_overflow_pdu_wbuf(uint32_t ndropped)
+{
+  const struct core_ntf_overflow_ntf ntf = {
+    .ndropped = ndropped
   };
+  struct pdu_wbuf* wbuf;
 
-  return handle_pdu_by_opcode(cmd, handler);
+  wbuf = create_pdu_wbuf(core_ntf_overflow_ntf_len,
+                         sizeof(*wbuf->msg.msg_iov));
+  if (!wbuf)
+    return NULL;
+
+  init_pdu(&wbuf->buf.pdu, SERVICE_CORE, OPCODE_NTF_OVERFLOW_NTF);
+  if (append_core_ntf_overflow_ntf(&wbuf->buf.pdu, &ntf) < 0)
+    goto err_append_core_ntf_overflow_ntf;
+
+  return build_pdu_wbuf_msg(wbuf);
+err_append_core_ntf_overflow_ntf:
+  cleanup_pdu_wbuf(wbuf);
+  return NULL;
 }
 
 int
-init_core_io(void (*send_pdu_cb)(struct pdu_wbuf*))
+init_core_io(void (*send_pdu_cb)(struct pdu_wbuf*),
+             int (*open_ntf_ring_cb)(unsigned long, int[2]),
+             int (*grant_ntf_credits_cb)(unsigned long),
+             bt_status_t (*handle_batched_pdu_cb)(const struct pdu*,
+                                                  struct pdu_wbuf**))
 {
   assert(send_pdu_cb);
+  assert(open_ntf_ring_cb);
+  assert(grant_ntf_credits_cb);
+  assert(handle_batched_pdu_cb);
 
-  if (init_core(core_handler, send_pdu_cb) < 0)
+  if (init_core(core_op, send_pdu_cb) < 0)
     return -1;
 
   send_pdu = send_pdu_cb;
+  open_ntf_ring = open_ntf_ring_cb;
+  grant_ntf_credits = grant_ntf_credits_cb;
+  handle_batched_pdu = handle_batched_pdu_cb;
 
   return 0;
 }
@@ -112,5 +342,8 @@ init_core_io(void (*send_pdu_cb)(struct pdu_wbuf*))
 void
 uninit_core_io()
 {
+  handle_batched_pdu = NULL;
+  grant_ntf_credits = NULL;
+  open_ntf_ring = NULL;
   send_pdu = NULL;
 }
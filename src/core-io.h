@@ -4,10 +4,28 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <hardware/bluetooth.h>
+
+struct pdu;
 struct pdu_wbuf;
 
+/* Returns a notification that tells the client how many
+ * notifications have been dropped from its backlog. */
+struct pdu_wbuf*
+create_ntf_overflow_pdu_wbuf(uint32_t ndropped);
+
+/* The callbacks act on the client whose command is being handled.
+ * |open_ntf_ring_cb| opens a shared-memory notification ring and
+ * returns its memfd and eventfd; |grant_ntf_credits_cb| adds to the
+ * client's notification credits; |handle_batched_pdu_cb| handles a
+ * command and returns its response instead of sending it. */
 int
-init_core_io(void (*send_pdu_cb)(struct pdu_wbuf*));
+init_core_io(void (*send_pdu_cb)(struct pdu_wbuf*),
+             int (*open_ntf_ring_cb)(unsigned long, int[2]),
+             int (*grant_ntf_credits_cb)(unsigned long),
+             bt_status_t (*handle_batched_pdu_cb)(const struct pdu*,
+                                                  struct pdu_wbuf**));
 
 void
 uninit_core_io(void);
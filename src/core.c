@@ -15,51 +15,62 @@ static void (*send_pdu)(struct pdu_wbuf*);
 int
 core_register_module(unsigned char service, unsigned char mode)
 {
-  bt_status_t (*handler)(const struct pdu*);
+  register_func register_service;
+  int (*unregister_service)(void);
+  const struct service_op* op;
 
-  if (!service_handler[service]) {
+  if (has_service_ops(service)) {
     ALOGE("service 0x%x already registered", service);
     return -1;
   }
-  if (!register_service[service]) {
+  if (find_service(service, &register_service, &unregister_service) < 0) {
     ALOGE("invalid service id 0x%x", service);
     return -1;
   }
-  handler = register_service[service](mode, send_pdu);
-  if (!handler)
+  op = register_service(mode, send_pdu);
+  if (!op)
     return -1;
 
-  service_handler[service] = handler;
+  if (add_service_ops(service, op) < 0)
+    goto err_add_service_ops;
 
   return 0;
+err_add_service_ops:
+  unregister_service();
+  return -1;
 }
 
 int
 core_unregister_module(unsigned char service)
 {
+  register_func register_service;
+  int (*unregister_service)(void);
+
   if (service == SERVICE_CORE) {
     ALOGE("service CORE cannot be unregistered");
     return -1;
   }
-  if (!unregister_service[service]) {
+  if (!has_service_ops(service) ||
+      (find_service(service, &register_service, &unregister_service) < 0)) {
     ALOGE("service 0x%x not registered", service);
     return -1;
   }
-  if (unregister_service[service]() < 0)
+  if (unregister_service() < 0)
     return -1;
 
-  service_handler[service] = NULL;
+  remove_service_ops(service);
 
   return 0;
 }
 
 int
-init_core(bt_status_t (*core_handler)(const struct pdu*),
+init_core(const struct service_op* core_op,
           void (*send_pdu_cb)(struct pdu_wbuf*))
 {
-  assert(core_handler);
+  assert(core_op);
 
-  service_handler[SERVICE_CORE] = core_handler;
+  if (add_service_ops(SERVICE_CORE, core_op) < 0)
+    return -1;
   send_pdu = send_pdu_cb;
 
   return 0;
@@ -69,5 +80,5 @@ void
 uninit_core()
 {
   send_pdu = NULL;
-  service_handler[SERVICE_CORE] = NULL;
+  remove_service_ops(SERVICE_CORE);
 }
@@ -6,8 +6,8 @@
 
 #include <hardware/bluetooth.h>
 
-struct pdu;
 struct pdu_wbuf;
+struct service_op;
 
 int
 core_register_module(unsigned char service, unsigned char mode);
@@ -16,7 +16,7 @@ int
 core_unregister_module(unsigned char service);
 
 int
-init_core(bt_status_t (*core_handler)(const struct pdu*),
+init_core(const struct service_op* core_op,
           void (*send_pdu_cb)(struct pdu_wbuf*));
 
 void
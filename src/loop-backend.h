@@ -0,0 +1,39 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct epoll_event;
+struct epoll_loop_stats;
+struct msghdr;
+
+/* The loop reads the fd; see add_read_fd_to_epoll_loop() */
+#define LOOP_FD_READS 0x01
+
+/* A backend waits for fds and reports ready fds as epoll events with
+ * |data.ptr| set to the pointer that has been given to |add|. The
+ * |cookie| is private to the backend and kept by the loop. |read| and
+ * |send| implement read_from_epoll_loop() and send_to_epoll_loop(). */
+struct loop_backend {
+  const char* name;
+  int (*init)(struct epoll_loop_stats* stats);
+  void (*uninit)(void);
+  int (*add)(int fd, uint32_t events, unsigned int flags, void* ptr,
+             void** cookie);
+  int (*mod)(int fd, uint32_t events, void* ptr, void** cookie);
+  void (*del)(int fd, void* cookie);
+  ssize_t (*read)(int fd, void* cookie, void* buf, size_t len);
+  ssize_t (*send)(int fd, void* cookie, const struct msghdr* msg, int flags,
+                  void (*func)(ssize_t, void*), void* data);
+  int (*wait)(struct epoll_event* events, int maxevents, int timeout);
+};
+
+extern const struct loop_backend epoll_loop_backend;
+
+#ifdef LOOP_IO_URING
+extern const struct loop_backend io_uring_loop_backend;
+#endif
@@ -0,0 +1,165 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Benchmark for the epoll loop's fd registry
+ *
+ * Registers many eventfds with the loop, signals all of them per
+ * round, and prints the time per registration and per dispatched
+ * event. The handlers do no work of their own, so the dispatch cost
+ * is the backend's wait plus the loop's lookup of the fd's state.
+ * Run as
+ *
+ *   loop-bench [fds [rounds]]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "loop.h"
+
+#define DEFAULT_NFDS 10000UL
+#define DEFAULT_NROUNDS 100UL
+
+static unsigned long nfds = DEFAULT_NFDS;
+static unsigned long nrounds = DEFAULT_NROUNDS;
+
+static int* fd;
+static unsigned long nevents;
+static unsigned long round;
+static double round_t0;
+static double dispatch_ns;
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(const char* name, const char* path, unsigned long n, double ns)
+{
+  printf("%-28s %-8s %7.1f ns/op\n", name, path, ns / n);
+}
+
+/* Signals every eventfd once. With EPOLLET, each write is an edge,
+ * so the handlers don't have to reset the counters. */
+static void
+start_round(void)
+{
+  static const uint64_t value = 1;
+  unsigned long i;
+
+  for (i = 0; i < nfds; ++i) {
+    if (TEMP_FAILURE_RETRY(write(fd[i], &value, sizeof(value))) < 0) {
+      ALOGE_ERRNO("write");
+      exit(EXIT_FAILURE);
+    }
+  }
+  nevents = 0;
+  round_t0 = now_ns();
+}
+
+static void
+fd_event(int fd, uint32_t events, void* data)
+{
+  if (++nevents < nfds)
+    return;
+
+  dispatch_ns += now_ns() - round_t0;
+
+  if (++round < nrounds) {
+    start_round();
+    return;
+  }
+
+  report("dispatch", epoll_loop_backend_name(), nfds * nrounds,
+         dispatch_ns);
+  exit(EXIT_SUCCESS);
+}
+
+static int
+raise_fd_limit(rlim_t n)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+    ALOGE_ERRNO("getrlimit");
+    return -1;
+  }
+  if (rl.rlim_cur >= n)
+    return 0;
+
+  rl.rlim_cur = n;
+  if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+    ALOGE_ERRNO("setrlimit");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+init(void* data)
+{
+  unsigned long i;
+  double t0, add_ns;
+
+  /* stdio and the loop's own fds need a few more */
+  if (raise_fd_limit(nfds + 64) < 0)
+    return -1;
+
+  fd = calloc(nfds, sizeof(*fd));
+  if (!fd) {
+    ALOGE_ERRNO("calloc");
+    return -1;
+  }
+
+  add_ns = 0;
+
+  for (i = 0; i < nfds; ++i) {
+    fd[i] = eventfd(0, EFD_NONBLOCK);
+    if (fd[i] < 0) {
+      ALOGE_ERRNO("eventfd");
+      return -1;
+    }
+    t0 = now_ns();
+    if (add_fd_to_epoll_loop(fd[i], EPOLLIN|EPOLLET, fd_event, NULL) < 0)
+      return -1;
+    add_ns += now_ns() - t0;
+  }
+
+  report("register", epoll_loop_backend_name(), nfds, add_ns);
+
+  start_round();
+
+  return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc > 1)
+    nfds = strtoul(argv[1], NULL, 0);
+  if (argc > 2)
+    nrounds = strtoul(argv[2], NULL, 0);
+  if (!nfds || !nrounds) {
+    fprintf(stderr, "usage: loop-bench [fds [rounds]]\n");
+    return EXIT_FAILURE;
+  }
+
+  if (epoll_loop(init, NULL) < 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "log.h"
+#include "loop.h"
+#include "loop-backend.h"
+
+#define EPOLL_SIZE_HINT 64
+
+static int epfd;
+static struct epoll_loop_stats* stats;
+
+static int
+epoll_init(struct epoll_loop_stats* loop_stats)
+{
+  epfd = epoll_create(EPOLL_SIZE_HINT);
+  if (epfd < 0) {
+    ALOGE_ERRNO("epoll_create");
+    return -1;
+  }
+  stats = loop_stats;
+
+  return 0;
+}
+
+static void
+epoll_uninit(void)
+{
+  if (TEMP_FAILURE_RETRY(close(epfd)) < 0)
+    ALOGW_ERRNO("close");
+  stats = NULL;
+}
+
+static int
+epoll_ctl_fd(int op, int fd, uint32_t events, void* ptr)
+{
+  struct epoll_event event;
+
+  event.events = events;
+  event.data.ptr = ptr;
+
+  ++stats->syscalls;
+
+  if (epoll_ctl(epfd, op, fd, &event) < 0) {
+    ALOGE_ERRNO("epoll_ctl");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+epoll_add(int fd, uint32_t events, unsigned int flags, void* ptr,
+          void** cookie)
+{
+  return epoll_ctl_fd(EPOLL_CTL_ADD, fd, events, ptr);
+}
+
+static int
+epoll_mod(int fd, uint32_t events, void* ptr, void** cookie)
+{
+  return epoll_ctl_fd(EPOLL_CTL_MOD, fd, events, ptr);
+}
+
+static void
+epoll_del(int fd, void* cookie)
+{
+  ++stats->syscalls;
+
+  if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+    ALOGW_ERRNO("epoll_ctl");
+}
+
+static ssize_t
+epoll_read(int fd, void* cookie, void* buf, size_t len)
+{
+  ++stats->syscalls;
+
+  return TEMP_FAILURE_RETRY(read(fd, buf, len));
+}
+
+/* Sends are always synchronous. */
+static ssize_t
+epoll_send(int fd, void* cookie, const struct msghdr* msg, int flags,
+           void (*func)(ssize_t, void*), void* data)
+{
+  ++stats->syscalls;
+
+  return TEMP_FAILURE_RETRY(sendmsg(fd, msg, flags));
+}
+
+static int
+epoll_wait_events(struct epoll_event* events, int maxevents, int timeout)
+{
+  int nevents;
+
+  ++stats->syscalls;
+
+  nevents = TEMP_FAILURE_RETRY(epoll_wait(epfd, events, maxevents, timeout));
+  if (nevents < 0) {
+    ALOGE_ERRNO("epoll_wait");
+    return -1;
+  }
+  return nevents;
+}
+
+const struct loop_backend epoll_loop_backend = {
+  .name = "epoll",
+  .init = epoll_init,
+  .uninit = epoll_uninit,
+  .add = epoll_add,
+  .mod = epoll_mod,
+  .del = epoll_del,
+  .read = epoll_read,
+  .send = epoll_send,
+  .wait = epoll_wait_events
+};
@@ -0,0 +1,934 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "log.h"
+#include "loop.h"
+#include "loop-backend.h"
+
+/*
+ * io_uring backend
+ *
+ * Every registered fd has a state that keeps its requests in the
+ * ring. Fds that the loop reads don't poll for EPOLLIN. Instead,
+ * sockets have a multishot recv and other fds a read that is renewed
+ * once its data has been taken. The kernel picks the receive buffers
+ * from a ring of provided buffers; read_from_epoll_loop() copies the
+ * data out and returns the buffers. Sends become sendmsg requests
+ * that complete asynchronously.
+ *
+ * All other events are polled. Edge-triggered fds use multishot polls
+ * that stay armed; level-triggered fds use one-shot polls that get
+ * re-armed after their completion has been dispatched. New events
+ * update the existing poll request.
+ *
+ * New, updated and removed requests are only queued in the submission
+ * ring and go to the kernel with the next wait, so a full loop
+ * iteration costs a single io_uring_enter().
+ */
+
+#define URING_ENTRIES 256
+
+/* provided receive buffers; the count is a power of two */
+#define URING_NBUFS 64
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+
+/* The low bits of a request's user data tell the request's type. */
+enum {
+  REQ_POLL = 1,
+  REQ_READ = 2,
+  REQ_SEND = 3
+};
+
+#define REQ_TYPE_MASK 0x3
+
+struct uring_buf {
+  unsigned int len;
+  unsigned int off;
+  STAILQ_ENTRY(uring_buf) entry;
+};
+
+struct uring_fd {
+  void* ptr;
+  uint32_t events;
+  int fd;
+  unsigned char active; /* cleared on removal; completions get dropped */
+  unsigned char reads; /* the loop reads the fd */
+  unsigned char socket;
+  /* requests that are known to the kernel */
+  unsigned char poll_armed;
+  unsigned char read_armed;
+  unsigned char sending;
+  /* received data */
+  unsigned char read_reported; /* EPOLLIN has been dispatched */
+  unsigned char read_done; /* end of stream or error in |read_res| */
+  unsigned char read_stalled; /* waits for free receive buffers */
+  int read_res;
+  STAILQ_HEAD(, uring_buf) rbufs;
+  struct uring_fd* next_stalled;
+  /* pending send */
+  struct msghdr send_msg;
+  struct iovec* send_iov;
+  size_t send_iovcap;
+  void (*send_func)(ssize_t, void*);
+  void* send_data;
+};
+
+struct uring_sq {
+  unsigned* head;
+  unsigned* tail;
+  unsigned* mask;
+  unsigned* entries;
+  unsigned* array;
+  struct io_uring_sqe* sqes;
+  unsigned local_tail;
+};
+
+struct uring_cq {
+  unsigned* head;
+  unsigned* tail;
+  unsigned* mask;
+  struct io_uring_cqe* cqes;
+};
+
+static int ring_fd;
+static void* sq_ring;
+static size_t sq_ring_len;
+static void* cq_ring;
+static size_t cq_ring_len;
+static struct io_uring_sqe* sqes;
+static size_t sqes_len;
+static struct uring_sq sq;
+static struct uring_cq cq;
+static struct epoll_loop_stats* stats;
+
+/* provided buffers */
+static struct io_uring_buf_ring* buf_ring;
+static unsigned char* buf_mem;
+static size_t buf_mem_len;
+static unsigned short buf_tail;
+static struct uring_buf bufs[URING_NBUFS];
+
+/* reads that ran out of receive buffers */
+static struct uring_fd* stalled_reads;
+
+/* Before Linux 6.0, recvs are one-shot. */
+static int recv_multishot;
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags)
+{
+  ++stats->syscalls;
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nargs)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static unsigned
+sq_pending(void)
+{
+  return sq.local_tail - *sq.tail;
+}
+
+static int
+submit_and_wait(unsigned min_complete)
+{
+  unsigned to_submit;
+  int res;
+
+  to_submit = sq_pending();
+
+  /* publish queued SQEs */
+  __atomic_store_n(sq.tail, sq.local_tail, __ATOMIC_RELEASE);
+
+  res = TEMP_FAILURE_RETRY(sys_io_uring_enter(ring_fd, to_submit,
+                                              min_complete,
+                                              IORING_ENTER_GETEVENTS));
+  if (res < 0) {
+    /* EBUSY signals an overflowing completion queue; we'll drain
+     * the queue and try again in the next iteration */
+    if (errno == EBUSY)
+      return 0;
+    ALOGE_ERRNO("io_uring_enter");
+    return -1;
+  }
+  return 0;
+}
+
+static struct io_uring_sqe*
+get_sqe(void)
+{
+  struct io_uring_sqe* sqe;
+  unsigned head, idx;
+
+  head = __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+
+  if (sq.local_tail - head == *sq.entries) {
+    /* ring is full; hand the queued SQEs to the kernel */
+    if (submit_and_wait(0) < 0)
+      return NULL;
+    head = __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+    if (sq.local_tail - head == *sq.entries) {
+      ALOGE("io_uring submission queue is full");
+      return NULL;
+    }
+  }
+
+  idx = sq.local_tail & *sq.mask;
+  sqe = sq.sqes + idx;
+  sq.array[idx] = idx;
+  ++sq.local_tail;
+
+  memset(sqe, 0, sizeof(*sqe));
+
+  return sqe;
+}
+
+static uint64_t
+req_user_data(const struct uring_fd* f, int type)
+{
+  return (uintptr_t)f | type;
+}
+
+/*
+ * Provided buffers
+ */
+
+static unsigned char*
+buf_data(const struct uring_buf* buf)
+{
+  return buf_mem + (buf - bufs) * URING_BUF_SIZE;
+}
+
+static void
+put_buf(struct uring_buf* buf)
+{
+  struct io_uring_buf* entry;
+
+  entry = buf_ring->bufs + (buf_tail & (URING_NBUFS - 1));
+  entry->addr = (uintptr_t)buf_data(buf);
+  entry->len = URING_BUF_SIZE;
+  entry->bid = buf - bufs;
+
+  ++buf_tail;
+  __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static void
+put_bufs(struct uring_fd* f)
+{
+  struct uring_buf* buf;
+
+  while ((buf = STAILQ_FIRST(&f->rbufs))) {
+    STAILQ_REMOVE_HEAD(&f->rbufs, entry);
+    put_buf(buf);
+  }
+}
+
+/*
+ * Requests
+ */
+
+static uint32_t
+poll_events(const struct uring_fd* f)
+{
+  uint32_t events;
+
+  events = f->events & ~EPOLLET;
+  if (f->reads)
+    events &= ~EPOLLIN; /* reads report data, errors and hang-ups */
+
+  return events;
+}
+
+static int
+needs_poll(const struct uring_fd* f)
+{
+  return f->active &&
+    (!f->reads || (poll_events(f) & ~(EPOLLERR|EPOLLHUP)));
+}
+
+static int
+queue_poll_add(struct uring_fd* f)
+{
+  struct io_uring_sqe* sqe;
+
+  sqe = get_sqe();
+  if (!sqe)
+    return -1;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = f->fd;
+  sqe->poll32_events = poll_events(f);
+  if (f->events & EPOLLET)
+    sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = req_user_data(f, REQ_POLL);
+
+  f->poll_armed = 1;
+
+  return 0;
+}
+
+/* Changes the events of the armed poll in place. If the poll has
+ * already completed, the update fails and the poll gets re-armed with
+ * the new events when its completion arrives. */
+static int
+queue_poll_update(struct uring_fd* f)
+{
+  struct io_uring_sqe* sqe;
+
+  sqe = get_sqe();
+  if (!sqe)
+    return -1;
+
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->addr = req_user_data(f, REQ_POLL);
+  sqe->len = IORING_POLL_UPDATE_EVENTS;
+  if (f->events & EPOLLET)
+    sqe->len |= IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = poll_events(f);
+  sqe->user_data = 0; /* completion is ignored */
+
+  return 0;
+}
+
+static int
+queue_cancel(struct uring_fd* f, int type)
+{
+  struct io_uring_sqe* sqe;
+
+  sqe = get_sqe();
+  if (!sqe)
+    return -1;
+
+  sqe->opcode = (type == REQ_POLL) ? IORING_OP_POLL_REMOVE
+                                   : IORING_OP_ASYNC_CANCEL;
+  sqe->addr = req_user_data(f, type);
+  sqe->user_data = 0; /* completion is ignored */
+
+  return 0;
+}
+
+static int
+queue_read(struct uring_fd* f)
+{
+  struct io_uring_sqe* sqe;
+
+  sqe = get_sqe();
+  if (!sqe)
+    return -1;
+
+  sqe->fd = f->fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  if (!f->socket) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->off = (uint64_t)-1; /* current position */
+    sqe->len = URING_BUF_SIZE;
+  } else if (recv_multishot) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+  } else {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->len = URING_BUF_SIZE;
+  }
+  sqe->user_data = req_user_data(f, REQ_READ);
+
+  f->read_armed = 1;
+
+  return 0;
+}
+
+static void
+free_fd_if_unused(struct uring_fd* f)
+{
+  if (f->active || f->poll_armed || f->read_armed || f->sending ||
+      f->read_stalled)
+    return;
+
+  put_bufs(f);
+  free(f->send_iov);
+  free(f);
+}
+
+/* Sockets keep reading while data waits in the loop; other fds read
+ * the next value after the current one has been taken. */
+static void
+rearm_read(struct uring_fd* f)
+{
+  if (!f->active || f->read_armed || f->read_done || f->read_stalled)
+    return;
+  if (!f->socket && !STAILQ_EMPTY(&f->rbufs))
+    return;
+  if (queue_read(f) < 0)
+    ALOGE("can't re-arm read for fd %d", f->fd);
+}
+
+static void
+resume_stalled_reads(void)
+{
+  struct uring_fd* f;
+
+  while ((f = stalled_reads)) {
+    stalled_reads = f->next_stalled;
+    f->read_stalled = 0;
+    rearm_read(f);
+    free_fd_if_unused(f);
+  }
+}
+
+/*
+ * Backend interface
+ */
+
+static void*
+map_ring(size_t len, off_t off)
+{
+  void* ptr;
+
+  ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+             ring_fd, off);
+  if (ptr == MAP_FAILED) {
+    ALOGE_ERRNO("mmap");
+    return NULL;
+  }
+  return ptr;
+}
+
+/* Returns 0 if the kernel supports all opcodes that we use. */
+static int
+probe_ops(void)
+{
+  static const unsigned char op[] = {
+    IORING_OP_POLL_ADD,
+    IORING_OP_POLL_REMOVE,
+    IORING_OP_ASYNC_CANCEL,
+    IORING_OP_READ,
+    IORING_OP_RECV,
+    IORING_OP_SENDMSG
+  };
+  struct io_uring_probe* probe;
+  size_t i;
+
+  errno = 0;
+  probe = calloc(1, sizeof(*probe) +
+                    IORING_OP_LAST * sizeof(probe->ops[0]));
+  if (errno) {
+    ALOGE_ERRNO("calloc");
+    return -1;
+  }
+
+  if (sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe,
+                            IORING_OP_LAST) < 0) {
+    ALOGW_ERRNO("io_uring_register");
+    goto err_io_uring_register;
+  }
+
+  for (i = 0; i < sizeof(op) / sizeof(op[0]); ++i) {
+    if ((op[i] > probe->last_op) ||
+        !(probe->ops[op[i]].flags & IO_URING_OP_SUPPORTED)) {
+      ALOGW("io_uring lacks opcode %u", op[i]);
+      goto err_op;
+    }
+  }
+
+  free(probe);
+
+  return 0;
+err_op:
+err_io_uring_register:
+  free(probe);
+  return -1;
+}
+
+/* Registers the provided buffers. Their ring and the buffers share
+ * one mapping. */
+static int
+init_bufs(void)
+{
+  struct io_uring_buf_reg reg;
+  size_t ring_len;
+  unsigned long i;
+  void* mem;
+
+  ring_len = URING_NBUFS * sizeof(struct io_uring_buf);
+  buf_mem_len = ring_len + URING_NBUFS * URING_BUF_SIZE;
+
+  mem = mmap(NULL, buf_mem_len, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    ALOGE_ERRNO("mmap");
+    goto err_mmap;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)mem;
+  reg.ring_entries = URING_NBUFS;
+  reg.bgid = URING_BUF_GROUP;
+
+  if (sys_io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    ALOGW_ERRNO("io_uring_register");
+    goto err_io_uring_register;
+  }
+
+  buf_ring = mem;
+  buf_mem = (unsigned char*)mem + ring_len;
+  buf_tail = 0;
+
+  for (i = 0; i < URING_NBUFS; ++i)
+    put_buf(bufs + i);
+
+  return 0;
+err_io_uring_register:
+  munmap(mem, buf_mem_len);
+err_mmap:
+  return -1;
+}
+
+static int
+uring_init(struct epoll_loop_stats* loop_stats)
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+
+  ring_fd = sys_io_uring_setup(URING_ENTRIES, &p);
+  if (ring_fd < 0) {
+    ALOGW_ERRNO("io_uring_setup");
+    goto err_io_uring_setup;
+  }
+
+  if (probe_ops() < 0)
+    goto err_probe_ops;
+
+  sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_len > sq_ring_len)
+      sq_ring_len = cq_ring_len;
+    cq_ring_len = 0;
+  }
+
+  sq_ring = map_ring(sq_ring_len, IORING_OFF_SQ_RING);
+  if (!sq_ring)
+    goto err_map_sq_ring;
+
+  if (cq_ring_len) {
+    cq_ring = map_ring(cq_ring_len, IORING_OFF_CQ_RING);
+    if (!cq_ring)
+      goto err_map_cq_ring;
+  } else {
+    cq_ring = sq_ring;
+  }
+
+  sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = map_ring(sqes_len, IORING_OFF_SQES);
+  if (!sqes)
+    goto err_map_sqes;
+
+  /* provided buffer rings arrived in Linux 5.19 */
+  if (init_bufs() < 0)
+    goto err_init_bufs;
+
+  sq.head = (unsigned*)((unsigned char*)sq_ring + p.sq_off.head);
+  sq.tail = (unsigned*)((unsigned char*)sq_ring + p.sq_off.tail);
+  sq.mask = (unsigned*)((unsigned char*)sq_ring + p.sq_off.ring_mask);
+  sq.entries = (unsigned*)((unsigned char*)sq_ring + p.sq_off.ring_entries);
+  sq.array = (unsigned*)((unsigned char*)sq_ring + p.sq_off.array);
+  sq.sqes = sqes;
+  sq.local_tail = *sq.tail;
+
+  cq.head = (unsigned*)((unsigned char*)cq_ring + p.cq_off.head);
+  cq.tail = (unsigned*)((unsigned char*)cq_ring + p.cq_off.tail);
+  cq.mask = (unsigned*)((unsigned char*)cq_ring + p.cq_off.ring_mask);
+  cq.cqes = (struct io_uring_cqe*)((unsigned char*)cq_ring + p.cq_off.cqes);
+
+  stalled_reads = NULL;
+  recv_multishot = 1;
+  stats = loop_stats;
+
+  return 0;
+err_init_bufs:
+  munmap(sqes, sqes_len);
+err_map_sqes:
+  if (cq_ring_len)
+    munmap(cq_ring, cq_ring_len);
+err_map_cq_ring:
+  munmap(sq_ring, sq_ring_len);
+err_map_sq_ring:
+err_probe_ops:
+  if (TEMP_FAILURE_RETRY(close(ring_fd)) < 0)
+    ALOGW_ERRNO("close");
+err_io_uring_setup:
+  return -1;
+}
+
+static void
+uring_uninit(void)
+{
+  munmap(sqes, sqes_len);
+  if (cq_ring_len)
+    munmap(cq_ring, cq_ring_len);
+  munmap(sq_ring, sq_ring_len);
+  if (TEMP_FAILURE_RETRY(close(ring_fd)) < 0)
+    ALOGW_ERRNO("close");
+  /* closing the ring released the buffers */
+  munmap(buf_ring, buf_mem_len);
+  stats = NULL;
+}
+
+static void
+uring_del(int fd, void* cookie)
+{
+  struct uring_fd* f = cookie;
+
+  f->active = 0;
+
+  /* A send in progress completes and calls its function. */
+  if (f->poll_armed && (queue_cancel(f, REQ_POLL) < 0))
+    ALOGW("poll for fd %d remains in io_uring", fd);
+  if (f->read_armed && (queue_cancel(f, REQ_READ) < 0))
+    ALOGW("read for fd %d remains in io_uring", fd);
+
+  put_bufs(f);
+  free_fd_if_unused(f);
+}
+
+static int
+uring_add(int fd, uint32_t events, unsigned int flags, void* ptr,
+          void** cookie)
+{
+  struct uring_fd* f;
+  struct stat st;
+
+  errno = 0;
+  f = calloc(1, sizeof(*f));
+  if (errno) {
+    ALOGE_ERRNO("calloc");
+    goto err_calloc;
+  }
+
+  f->ptr = ptr;
+  f->events = events;
+  f->fd = fd;
+  f->active = 1;
+  f->reads = !!(flags & LOOP_FD_READS);
+  STAILQ_INIT(&f->rbufs);
+
+  if (f->reads) {
+    ++stats->syscalls;
+    if (fstat(fd, &st) < 0) {
+      ALOGE_ERRNO("fstat");
+      goto err_fstat;
+    }
+    f->socket = S_ISSOCK(st.st_mode);
+    if (queue_read(f) < 0)
+      goto err_queue_read;
+  }
+
+  if (needs_poll(f) && (queue_poll_add(f) < 0))
+    goto err_queue_poll_add;
+
+  *cookie = f;
+
+  return 0;
+err_queue_poll_add:
+  uring_del(fd, f); /* the queued read refers to |f| */
+  return -1;
+err_queue_read:
+err_fstat:
+  free(f);
+err_calloc:
+  return -1;
+}
+
+static int
+uring_mod(int fd, uint32_t events, void* ptr, void** cookie)
+{
+  struct uring_fd* f = *cookie;
+
+  f->events = events;
+
+  if (!f->poll_armed) {
+    if (needs_poll(f))
+      return queue_poll_add(f);
+    return 0;
+  }
+  if (!needs_poll(f))
+    return queue_cancel(f, REQ_POLL);
+
+  return queue_poll_update(f);
+}
+
+static ssize_t
+uring_read(int fd, void* cookie, void* buf, size_t len)
+{
+  struct uring_fd* f = cookie;
+  struct uring_buf* rbuf;
+  size_t n, chunk;
+
+  n = 0;
+
+  while ((n < len) && (rbuf = STAILQ_FIRST(&f->rbufs))) {
+    chunk = rbuf->len - rbuf->off;
+    if (chunk > len - n)
+      chunk = len - n;
+    memcpy((unsigned char*)buf + n, buf_data(rbuf) + rbuf->off, chunk);
+    n += chunk;
+    rbuf->off += chunk;
+    if (rbuf->off == rbuf->len) {
+      STAILQ_REMOVE_HEAD(&f->rbufs, entry);
+      put_buf(rbuf);
+    }
+  }
+
+  if (stalled_reads)
+    resume_stalled_reads();
+
+  if (!STAILQ_EMPTY(&f->rbufs))
+    return n;
+
+  rearm_read(f);
+
+  if (!f->read_done) {
+    f->read_reported = 0; /* new data gets reported */
+    if (n)
+      return n;
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (n) {
+    /* The short read looks like the end of the data; call the
+     * handler again for the end of the stream. */
+    requeue_fd_in_epoll_loop(fd, EPOLLIN);
+    return n;
+  }
+
+  if (f->read_res < 0) {
+    errno = -f->read_res;
+    return -1;
+  }
+  return 0;
+}
+
+static ssize_t
+uring_send(int fd, void* cookie, const struct msghdr* msg, int flags,
+           void (*func)(ssize_t, void*), void* data)
+{
+  struct uring_fd* f = cookie;
+  struct io_uring_sqe* sqe;
+  struct iovec* iov;
+
+  assert(!f->sending);
+
+  /* The kernel reads the message header when it starts sending;
+   * keep a copy. */
+  if (msg->msg_iovlen > f->send_iovcap) {
+    errno = 0;
+    iov = realloc(f->send_iov, msg->msg_iovlen * sizeof(*iov));
+    if (errno) {
+      ALOGE_ERRNO("realloc");
+      return -1;
+    }
+    f->send_iov = iov;
+    f->send_iovcap = msg->msg_iovlen;
+  }
+  memcpy(f->send_iov, msg->msg_iov, msg->msg_iovlen * sizeof(*f->send_iov));
+  f->send_msg = *msg;
+  f->send_msg.msg_iov = f->send_iov;
+
+  sqe = get_sqe();
+  if (!sqe) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)&f->send_msg;
+  sqe->msg_flags = flags;
+  sqe->user_data = req_user_data(f, REQ_SEND);
+
+  f->sending = 1;
+  f->send_func = func;
+  f->send_data = data;
+
+  errno = EINPROGRESS;
+  return -1;
+}
+
+static void
+complete_send(struct uring_fd* f, int res)
+{
+  void (*func)(ssize_t, void*);
+  void* data;
+
+  func = f->send_func;
+  data = f->send_data;
+
+  f->sending = 0;
+  free_fd_if_unused(f);
+
+  /* |f| might be gone from here on */
+  func(res, data);
+}
+
+/* Returns 1 if the handler should learn about the completion. */
+static int
+complete_read(struct uring_fd* f, const struct io_uring_cqe* cqe)
+{
+  struct uring_buf* buf;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    f->read_armed = 0;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    buf = bufs + (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (!f->active || (cqe->res <= 0)) {
+      put_buf(buf);
+    } else {
+      buf->len = cqe->res;
+      buf->off = 0;
+      STAILQ_INSERT_TAIL(&f->rbufs, buf, entry);
+    }
+  }
+
+  if (!f->active) {
+    free_fd_if_unused(f);
+    return 0;
+  }
+
+  if (cqe->res == -ENOBUFS) {
+    if (!f->read_stalled) {
+      f->read_stalled = 1;
+      f->next_stalled = stalled_reads;
+      stalled_reads = f;
+    }
+    return 0;
+  } else if ((cqe->res == -EINVAL) && f->socket && recv_multishot) {
+    ALOGW("io_uring lacks multishot recv");
+    recv_multishot = 0;
+  } else if (cqe->res <= 0) {
+    f->read_done = 1;
+    f->read_res = cqe->res;
+  }
+
+  rearm_read(f);
+
+  if (f->read_reported)
+    return 0;
+  if (STAILQ_EMPTY(&f->rbufs) && !f->read_done)
+    return 0;
+
+  f->read_reported = 1;
+
+  return 1;
+}
+
+/* Returns 1 if the handler should learn about the completion. */
+static int
+complete_poll(struct uring_fd* f, const struct io_uring_cqe* cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    f->poll_armed = 0;
+
+  if (!f->active) {
+    free_fd_if_unused(f);
+    return 0;
+  }
+
+  /* One-shot polls are re-armed after their event has been
+   * dispatched, since the request only goes out with the next
+   * submission. Polls that have been updated after they completed
+   * get their new events here. */
+  if (!f->poll_armed && needs_poll(f) && (queue_poll_add(f) < 0))
+    ALOGE("can't re-arm poll for fd %d", f->fd);
+
+  return cqe->res != -ECANCELED;
+}
+
+static int
+uring_wait(struct epoll_event* events, int maxevents, int timeout)
+{
+  unsigned head, tail;
+  int nevents;
+
+  head = *cq.head;
+  tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+
+  /* only enter the kernel if we have to submit or wait */
+  if (sq_pending() || ((head == tail) && timeout)) {
+    if (submit_and_wait((head == tail) && timeout ? 1 : 0) < 0)
+      return -1;
+    tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+  }
+
+  for (nevents = 0; (head != tail) && (nevents < maxevents); ++head) {
+    const struct io_uring_cqe* cqe = cq.cqes + (head & *cq.mask);
+    struct uring_fd* f;
+    int type;
+
+    if (!cqe->user_data)
+      continue; /* updates and removals */
+
+    f = (struct uring_fd*)(uintptr_t)(cqe->user_data & ~REQ_TYPE_MASK);
+    type = cqe->user_data & REQ_TYPE_MASK;
+
+    if (type == REQ_SEND) {
+      complete_send(f, cqe->res);
+    } else if (type == REQ_READ) {
+      if (complete_read(f, cqe)) {
+        events[nevents].events = EPOLLIN;
+        events[nevents].data.ptr = f->ptr;
+        ++nevents;
+      }
+    } else if (complete_poll(f, cqe)) {
+      events[nevents].events = (cqe->res < 0) ? EPOLLERR : cqe->res;
+      events[nevents].data.ptr = f->ptr;
+      ++nevents;
+    }
+  }
+
+  __atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+
+  return nevents;
+}
+
+const struct loop_backend io_uring_loop_backend = {
+  .name = "io_uring",
+  .init = uring_init,
+  .uninit = uring_uninit,
+  .add = uring_add,
+  .mod = uring_mod,
+  .del = uring_del,
+  .read = uring_read,
+  .send = uring_send,
+  .wait = uring_wait
+};
@@ -4,110 +4,432 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <sys/queue.h>
 #include <unistd.h>
 #include "log.h"
 #include "loop.h"
+#include "loop-backend.h"
 
-#define MAXNFDS 64
+#define MAXNEVENTS 64
+
+/* fd states are allocated in chunks of this many slots; a slot never
+ * moves once allocated, so the backend can carry a pointer to it */
+#define NSLOTS_PER_CHUNK 64
 
 #define ARRAYLEN(x) \
   (sizeof(x) / sizeof(x[0]))
 
 struct fd_state {
-  struct epoll_event event;
+  int fd;
+  uint32_t events;
   void (*func)(int, uint32_t, void*);
   void* data;
+  void* cookie; /* backend data */
+  struct fd_state* next;
+  /* requeued fds */
+  int pending;
+  uint32_t pending_events;
+  TAILQ_ENTRY(fd_state) ready;
 };
 
-static struct fd_state fd_state[MAXNFDS];
-static int epfd;
+static const struct loop_backend* backend;
+static struct epoll_loop_stats stats;
 
-int
-add_fd_to_epoll_loop(int fd, uint32_t epoll_events,
-                     void (*func)(int, uint32_t, void*), void* data)
+/* fd number -> slot */
+static struct fd_state** fd_slot;
+static unsigned long fd_slot_len;
+
+/* slot storage */
+static struct fd_state** fd_chunk;
+static unsigned long fd_chunk_len;
+
+/* unused slots */
+static struct fd_state* free_slots;
+
+/* slots removed during the current iteration; they are not reused
+ * before the iteration completes, so pending events for a removed fd
+ * can never be delivered to a new registration */
+static struct fd_state* released_slots;
+
+/* fds that stopped early and wait for another call to their handler */
+static TAILQ_HEAD(ready_head, fd_state) ready_slots =
+  TAILQ_HEAD_INITIALIZER(ready_slots);
+static unsigned long nready_slots;
+
+static int
+grow_fd_slot(int fd)
+{
+  unsigned long len;
+  struct fd_state** slot;
+
+  len = fd_slot_len ? fd_slot_len : NSLOTS_PER_CHUNK;
+  while (len <= (unsigned long)fd)
+    len *= 2;
+
+  errno = 0;
+  slot = realloc(fd_slot, len * sizeof(*slot));
+  if (errno) {
+    ALOGE_ERRNO("realloc");
+    return -1;
+  }
+  memset(slot + fd_slot_len, 0, (len - fd_slot_len) * sizeof(*slot));
+
+  fd_slot = slot;
+  fd_slot_len = len;
+
+  return 0;
+}
+
+static int
+grow_fd_chunk(void)
+{
+  struct fd_state** chunk;
+  struct fd_state* state;
+  unsigned long i;
+
+  errno = 0;
+  chunk = realloc(fd_chunk, (fd_chunk_len + 1) * sizeof(*chunk));
+  if (errno) {
+    ALOGE_ERRNO("realloc");
+    goto err_realloc;
+  }
+  fd_chunk = chunk;
+
+  errno = 0;
+  state = calloc(NSLOTS_PER_CHUNK, sizeof(*state));
+  if (errno) {
+    ALOGE_ERRNO("calloc");
+    goto err_calloc;
+  }
+  fd_chunk[fd_chunk_len++] = state;
+
+  /* push in reverse order to hand out low addresses first */
+  for (i = NSLOTS_PER_CHUNK; i;) {
+    --i;
+    state[i].fd = -1;
+    state[i].next = free_slots;
+    free_slots = state + i;
+  }
+
+  return 0;
+err_calloc:
+err_realloc:
+  return -1;
+}
+
+static struct fd_state*
+acquire_slot(void)
+{
+  struct fd_state* state;
+
+  if (!free_slots && (grow_fd_chunk() < 0))
+    return NULL;
+
+  state = free_slots;
+  free_slots = state->next;
+  state->next = NULL;
+
+  return state;
+}
+
+static void
+unqueue_slot(struct fd_state* state)
+{
+  if (!state->pending)
+    return;
+
+  TAILQ_REMOVE(&ready_slots, state, ready);
+  --nready_slots;
+  state->pending = 0;
+  state->pending_events = 0;
+}
+
+static void
+release_slot(struct fd_state* state)
+{
+  unqueue_slot(state);
+
+  state->fd = -1;
+  state->events = 0;
+  state->func = NULL;
+  state->data = NULL;
+  state->cookie = NULL;
+  state->next = released_slots;
+  released_slots = state;
+}
+
+static void
+recycle_released_slots(void)
 {
+  while (released_slots) {
+    struct fd_state* state = released_slots;
+    released_slots = state->next;
+    state->next = free_slots;
+    free_slots = state;
+  }
+}
+
+static void
+cleanup_fd_states(void)
+{
+  unsigned long i;
+
+  for (i = 0; i < fd_chunk_len; ++i)
+    free(fd_chunk[i]);
+  free(fd_chunk);
+  fd_chunk = NULL;
+  fd_chunk_len = 0;
+
+  free(fd_slot);
+  fd_slot = NULL;
+  fd_slot_len = 0;
+
+  free_slots = NULL;
+  released_slots = NULL;
+
+  TAILQ_INIT(&ready_slots);
+  nready_slots = 0;
+}
+
+static int
+add_fd(int fd, uint32_t epoll_events, unsigned int flags,
+       void (*func)(int, uint32_t, void*), void* data)
+{
+  struct fd_state* state;
   int enabled;
   int res;
 
   assert(fd >= 0);
   assert(func);
 
-  if ((ssize_t)fd >= (ssize_t)ARRAYLEN(fd_state)) {
-    ALOGE("too many open file descriptors");
-    goto err_fd;
-  }
+  if (((unsigned long)fd >= fd_slot_len) && (grow_fd_slot(fd) < 0))
+    goto err_grow_fd_slot;
 
-  enabled = !!fd_state[fd].event.events;
+  state = fd_slot[fd];
+  enabled = !!state;
 
-  fd_state[fd].event.events = epoll_events;
-  fd_state[fd].event.data.fd = fd;
+  if (!enabled) {
+    state = acquire_slot();
+    if (!state)
+      goto err_acquire_slot;
+  }
 
   if (enabled)
-    res = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &fd_state[fd].event);
+    res = backend->mod(fd, epoll_events, state, &state->cookie);
   else
-    res = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &fd_state[fd].event);
+    res = backend->add(fd, epoll_events, flags, state, &state->cookie);
 
-  if (res < 0) {
-    ALOGE_ERRNO("epoll_ctl");
-    goto err_epoll_ctl;
-  }
+  if (res < 0)
+    goto err_backend;
 
-  fd_state[fd].func = func;
-  fd_state[fd].data = data;
+  state->fd = fd;
+  state->events = epoll_events;
+  state->func = func;
+  state->data = data;
+
+  fd_slot[fd] = state;
 
   return 0;
-err_epoll_ctl:
-err_fd:
+err_backend:
+  if (!enabled) {
+    state->next = free_slots;
+    free_slots = state;
+  }
+err_acquire_slot:
+err_grow_fd_slot:
   return -1;
 }
 
+int
+add_fd_to_epoll_loop(int fd, uint32_t epoll_events,
+                     void (*func)(int, uint32_t, void*), void* data)
+{
+  return add_fd(fd, epoll_events, 0, func, data);
+}
+
+int
+add_read_fd_to_epoll_loop(int fd, uint32_t epoll_events,
+                          void (*func)(int, uint32_t, void*), void* data)
+{
+  return add_fd(fd, epoll_events, LOOP_FD_READS, func, data);
+}
+
 void
 remove_fd_from_epoll_loop(int fd)
 {
-  int res;
+  struct fd_state* state;
 
-  assert(fd_state[fd].events);
+  assert(fd >= 0);
+  assert((unsigned long)fd < fd_slot_len);
 
-  res = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-  if (res < 0)
-    ALOGW_ERRNO("epoll_ctl");
+  state = fd_slot[fd];
+  assert(state);
+
+  backend->del(fd, state->cookie);
+
+  fd_slot[fd] = NULL;
+  release_slot(state);
+}
+
+ssize_t
+read_from_epoll_loop(int fd, void* buf, size_t len)
+{
+  struct fd_state* state;
+
+  assert(fd >= 0);
+  assert((unsigned long)fd < fd_slot_len);
+
+  state = fd_slot[fd];
+  assert(state);
+
+  return backend->read(fd, state->cookie, buf, len);
+}
+
+ssize_t
+send_to_epoll_loop(int fd, const struct msghdr* msg, int flags,
+                   void (*func)(ssize_t, void*), void* data)
+{
+  struct fd_state* state;
+
+  assert(fd >= 0);
+  assert((unsigned long)fd < fd_slot_len);
+  assert(func);
+
+  state = fd_slot[fd];
+  assert(state);
+
+  return backend->send(fd, state->cookie, msg, flags, func, data);
+}
+
+void
+requeue_fd_in_epoll_loop(int fd, uint32_t epoll_events)
+{
+  struct fd_state* state;
+
+  assert(fd >= 0);
+  assert((unsigned long)fd < fd_slot_len);
+
+  state = fd_slot[fd];
+  assert(state);
+
+  state->pending_events |= epoll_events;
+
+  if (state->pending)
+    return;
+
+  TAILQ_INSERT_TAIL(&ready_slots, state, ready);
+  ++nready_slots;
+  state->pending = 1;
+}
+
+static void
+dispatch_ready_slots(void)
+{
+  unsigned long n;
+
+  /* Only serve fds that have been queued before; fds that requeue
+   * themselves now run in the next iteration, after epoll had a chance
+   * to report other fds. */
+  for (n = nready_slots; n && !TAILQ_EMPTY(&ready_slots); --n) {
+    struct fd_state* state = TAILQ_FIRST(&ready_slots);
+    uint32_t events = state->pending_events;
+
+    unqueue_slot(state);
+    state->func(state->fd, events, state->data);
+  }
 }
 
 static int
 epoll_loop_iteration(void)
 {
-  struct epoll_event events[MAXNFDS];
+  struct epoll_event events[MAXNEVENTS];
   int nevents, i;
 
-  nevents = TEMP_FAILURE_RETRY(epoll_wait(epfd, events, ARRAYLEN(events), -1));
-  if (nevents < 0) {
-    ALOGE_ERRNO("epoll_wait");
-    goto err_epoll_wait;
-  }
+  /* don't block while requeued fds wait for their handlers */
+  nevents = backend->wait(events, ARRAYLEN(events), nready_slots ? 0 : -1);
+  if (nevents < 0)
+    goto err_wait;
+
+  ++stats.iterations;
+  stats.events += nevents;
 
   for (i = 0; i < nevents; ++i) {
-    int fd = events[i].data.fd;
+    struct fd_state* state = events[i].data.ptr;
+
+    /* skip events of fds removed by an earlier handler */
+    if (!state->func)
+      continue;
+
+    /* requeued fds get their new events with the queued call */
+    if (state->pending) {
+      state->pending_events |= events[i].events;
+      continue;
+    }
 
-    assert(fd_state[fd].func);
-    fd_state[fd].func(fd, events[i].events, fd_state[fd].data);
+    state->func(state->fd, events[i].events, state->data);
   }
-  return 0;
 
-err_epoll_wait:
+  dispatch_ready_slots();
+
+  recycle_released_slots();
+
+  return 0;
+err_wait:
   return -1;
 }
 
+void
+get_epoll_loop_stats(struct epoll_loop_stats* loop_stats)
+{
+  assert(loop_stats);
+
+  *loop_stats = stats;
+}
+
+const char*
+epoll_loop_backend_name()
+{
+  return backend ? backend->name : NULL;
+}
+
+static int
+init_backend(void)
+{
+  memset(&stats, 0, sizeof(stats));
+
+#ifdef LOOP_IO_URING
+  if (!io_uring_loop_backend.init(&stats)) {
+    backend = &io_uring_loop_backend;
+    return 0;
+  }
+  ALOGW("io_uring not available, falling back to epoll");
+#endif
+
+  if (epoll_loop_backend.init(&stats) < 0)
+    return -1;
+
+  backend = &epoll_loop_backend;
+
+  return 0;
+}
+
+static void
+uninit_backend(void)
+{
+  backend->uninit();
+  backend = NULL;
+}
+
 int
 epoll_loop(int (*init)(void*), void* data)
 {
   int res;
 
-  epfd = epoll_create(ARRAYLEN(fd_state));
-  if (epfd < 0) {
-    ALOGE_ERRNO("epoll_create");
-    goto err_epoll_create;
-  }
+  if (init_backend() < 0)
+    goto err_init_backend;
 
   if (init && (init(data) < 0))
     goto err_init;
@@ -119,14 +441,14 @@ epoll_loop(int (*init)(void*), void* data)
   if (res < 0)
     goto err_epoll_loop_iteration;
 
-  if (TEMP_FAILURE_RETRY(close(epfd)) < 0)
-    ALOGW_ERRNO("close");
+  uninit_backend();
+  cleanup_fd_states();
 
   return 0;
 err_epoll_loop_iteration:
 err_init:
-  if (TEMP_FAILURE_RETRY(close(epfd)) < 0)
-    ALOGW_ERRNO("close");
-err_epoll_create:
+  uninit_backend();
+  cleanup_fd_states();
+err_init_backend:
   return -1;
 }
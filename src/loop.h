@@ -5,13 +5,61 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/types.h>
+
+struct msghdr;
+
+/* Handlers of edge-triggered fds (EPOLLET) drain their fd until EAGAIN,
+ * but process at most this many messages per call. If the budget runs
+ * out first, the handler calls requeue_fd_in_epoll_loop() and gets
+ * called again after the other ready fds have been served. */
+#define EPOLL_LOOP_BUDGET 16
+
+struct epoll_loop_stats {
+  unsigned long long iterations;
+  unsigned long long events; /* dispatched fd events */
+  unsigned long long syscalls; /* made by the loop's backend, including
+                                * reads and sends for handlers */
+};
 
 int
 add_fd_to_epoll_loop(int fd, uint32_t epoll_events,
                      void (*func)(int, uint32_t, void*), void* data);
 
+/* Adds an fd whose data the loop receives for the handler. The
+ * handler gets EPOLLIN as usual, but takes the data with
+ * read_from_epoll_loop() instead of read(). With io_uring, the data
+ * arrives without a syscall of the handler's own. */
+int
+add_read_fd_to_epoll_loop(int fd, uint32_t epoll_events,
+                          void (*func)(int, uint32_t, void*), void* data);
+
 void
 remove_fd_from_epoll_loop(int fd);
 
+/* Like read(), for fds that have been added with
+ * add_read_fd_to_epoll_loop(). */
+ssize_t
+read_from_epoll_loop(int fd, void* buf, size_t len);
+
+/* Like sendmsg() on a socket in the loop. A backend that sends
+ * asynchronously returns -1 with errno set to EINPROGRESS, and calls
+ * |func| with the number of bytes sent, or a negative errno, when the
+ * send completes; even if the fd has been removed meanwhile. Until
+ * then, the message's data and control buffers have to stay valid and
+ * the fd can't send again. */
+ssize_t
+send_to_epoll_loop(int fd, const struct msghdr* msg, int flags,
+                   void (*func)(ssize_t, void*), void* data);
+
+void
+requeue_fd_in_epoll_loop(int fd, uint32_t epoll_events);
+
+void
+get_epoll_loop_stats(struct epoll_loop_stats* stats);
+
+const char*
+epoll_loop_backend_name(void);
+
 int
 epoll_loop(int (*init)(void*), void* data);
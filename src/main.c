@@ -4,33 +4,97 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include "log.h"
 #include "loop.h"
 #include "task.h"
+#include "timer.h"
+#include "bt-pdubuf.h"
 #include "bt-io.h"
 
 static int
 init(void* data)
 {
+  init_pdu_buf_pool();
+
   if (init_task_queue() < 0)
     goto err_init_task_queue;
 
+  if (init_timer_wheel() < 0)
+    goto err_init_timer_wheel;
+
   if (init_bt_io() < 0)
     goto err_init_bt_io;
 
   return 0;
 err_init_bt_io:
+  uninit_timer_wheel();
+err_init_timer_wheel:
   uninit_task_queue();
 err_init_task_queue:
   return -1;
 }
 
+static int
+parse_ulong(const char* str, unsigned long* value)
+{
+  char* end;
+
+  errno = 0;
+  *value = strtoul(str, &end, 0);
+  if (errno || !*str || *end)
+    return -1;
+  return 0;
+}
+
+/* Options
+ *
+ *  -b <bytes>  flush held notifications at this backlog size
+ *  -d <msec>   hold notifications for at most this long; 0 disables
+ *              notification coalescing
+ */
+static int
+parse_options(int argc, char* argv[])
+{
+  unsigned long bytes, msec;
+  int opt;
+
+  bytes = BT_IO_NTF_COALESCE_BYTES;
+  msec = BT_IO_NTF_COALESCE_MSEC;
+
+  while ((opt = getopt(argc, argv, "b:d:")) != -1) {
+    switch (opt) {
+      case 'b':
+        if (parse_ulong(optarg, &bytes) < 0)
+          goto err_optarg;
+        break;
+      case 'd':
+        if (parse_ulong(optarg, &msec) < 0)
+          goto err_optarg;
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  set_bt_io_ntf_coalescing(bytes, msec);
+
+  return 0;
+err_optarg:
+  ALOGE("invalid argument for -%c: %s", opt, optarg);
+  return -1;
+}
+
 int
 main(int argc, char* argv[])
 {
+  if (parse_options(argc, argv) < 0)
+    goto err_parse_options;
+
   if (epoll_loop(init, NULL) < 0)
     goto err_epoll_loop;
 
   exit(EXIT_SUCCESS);
 err_epoll_loop:
+err_parse_options:
   exit(EXIT_FAILURE);
 }
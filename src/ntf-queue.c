@@ -0,0 +1,240 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <assert.h>
+#include "log.h"
+#include "pdu-codec.h"
+#include "core-io.h"
+#include "ntf-queue.h"
+
+static int
+over_limits(const struct ntf_queue* queue, unsigned long len)
+{
+  return (queue->stats.count + 1 > queue->limit_count) ||
+         (queue->stats.bytes + len > queue->limit_bytes);
+}
+
+static void
+remove_ref(struct ntf_queue* queue, struct pdu_wbuf_ref* ref)
+{
+  STAILQ_REMOVE(&queue->refs, ref, pdu_wbuf_ref, stailq);
+  --queue->npolicy[ref->wbuf->policy];
+  --queue->stats.count;
+  queue->stats.bytes -= pdu_size(&ref->wbuf->buf.pdu);
+}
+
+static void
+append_ref(struct ntf_queue* queue, struct pdu_wbuf_ref* ref)
+{
+  STAILQ_INSERT_TAIL(&queue->refs, ref, stailq);
+  ++queue->npolicy[ref->wbuf->policy];
+  ++queue->stats.count;
+  queue->stats.bytes += pdu_size(&ref->wbuf->buf.pdu);
+  ++queue->stats.queued;
+
+  if (queue->stats.count > queue->stats.max_count)
+    queue->stats.max_count = queue->stats.count;
+  if (queue->stats.bytes > queue->stats.max_bytes)
+    queue->stats.max_bytes = queue->stats.bytes;
+}
+
+static struct pdu_wbuf_ref*
+find_coalescable(struct ntf_queue* queue, const struct pdu* pdu)
+{
+  struct pdu_wbuf_ref* ref;
+
+  /* don't walk a long backlog in vain */
+  if (!queue->npolicy[NTF_POLICY_COALESCE_LATEST])
+    return NULL;
+
+  STAILQ_FOREACH(ref, &queue->refs, stailq) {
+    if ((ref->wbuf->policy == NTF_POLICY_COALESCE_LATEST) &&
+        (ref->wbuf->buf.pdu.service == pdu->service) &&
+        (ref->wbuf->buf.pdu.opcode == pdu->opcode))
+      return ref;
+  }
+  return NULL;
+}
+
+static struct pdu_wbuf_ref*
+find_droppable(struct ntf_queue* queue)
+{
+  struct pdu_wbuf_ref* ref;
+
+  if (!queue->npolicy[NTF_POLICY_DROP_OLDEST])
+    return NULL;
+
+  STAILQ_FOREACH(ref, &queue->refs, stailq) {
+    if (ref->wbuf->policy == NTF_POLICY_DROP_OLDEST)
+      return ref;
+  }
+  return NULL;
+}
+
+static void
+drop_ref(struct ntf_queue* queue, struct pdu_wbuf_ref* ref)
+{
+  unref_pdu_wbuf(ref);
+  ++queue->ndropped;
+  ++queue->stats.dropped;
+}
+
+/* Tells the client how many notifications it has missed. A queued
+ * overflow notification is updated in place, so a storm of drops
+ * costs at most one PDU in the backlog.
+ */
+static void
+report_overflow(struct ntf_queue* queue)
+{
+  struct core_ntf_overflow_ntf ntf;
+  struct pdu_wbuf* wbuf;
+  struct pdu_wbuf_ref* ref;
+
+  if (queue->overflow) {
+    /* Only this backlog references the overflow notification, so
+     * it can still be modified. */
+    ntf.ndropped = queue->ndropped;
+    if (write_core_ntf_overflow_ntf(&queue->overflow->buf.pdu, 0, &ntf) < 0)
+      ALOGW("overflow notification not updated");
+    return;
+  }
+
+  wbuf = create_ntf_overflow_pdu_wbuf(queue->ndropped);
+  if (!wbuf)
+    return; /* retry on next drop */
+
+  ref = ref_pdu_wbuf(wbuf);
+  if (!ref) {
+    cleanup_pdu_wbuf(wbuf);
+    return;
+  }
+
+  /* not subject to limits; there's at most one */
+  append_ref(queue, ref);
+  queue->overflow = wbuf;
+}
+
+void
+init_ntf_queue(struct ntf_queue* queue,
+               unsigned long limit_count, unsigned long limit_bytes)
+{
+  assert(queue);
+
+  STAILQ_INIT(&queue->refs);
+  queue->limit_count = limit_count;
+  queue->limit_bytes = limit_bytes;
+  memset(queue->npolicy, 0, sizeof(queue->npolicy));
+  queue->ndropped = 0;
+  queue->overflow = NULL;
+  memset(&queue->stats, 0, sizeof(queue->stats));
+}
+
+void
+uninit_ntf_queue(struct ntf_queue* queue)
+{
+  struct pdu_wbuf_ref* ref;
+
+  assert(queue);
+
+  while ((ref = ntf_queue_pop(queue)))
+    unref_pdu_wbuf(ref);
+}
+
+void
+ntf_queue_push(struct ntf_queue* queue, struct pdu_wbuf_ref* ref)
+{
+  struct pdu_wbuf_ref* old;
+  unsigned long len;
+  unsigned long ndropped;
+  unsigned char policy;
+
+  assert(queue);
+  assert(ref);
+
+  ndropped = queue->ndropped;
+  len = pdu_size(&ref->wbuf->buf.pdu);
+  policy = ref->wbuf->policy;
+
+  if (policy == NTF_POLICY_COALESCE_LATEST) {
+    old = find_coalescable(queue, &ref->wbuf->buf.pdu);
+    if (old) {
+      /* the latest state goes to the end, behind everything that
+       * happened before it */
+      remove_ref(queue, old);
+      unref_pdu_wbuf(old);
+      ++queue->stats.coalesced;
+    }
+  }
+
+  while (over_limits(queue, len)) {
+    old = find_droppable(queue);
+    if (!old)
+      break;
+    remove_ref(queue, old);
+    drop_ref(queue, old);
+  }
+
+  if (!over_limits(queue, len)) {
+    append_ref(queue, ref);
+  } else if (policy == NTF_POLICY_DROP_OLDEST) {
+    /* there's nothing older left to drop */
+    drop_ref(queue, ref);
+  } else {
+    append_ref(queue, ref);
+    ++queue->stats.overlimit;
+  }
+
+  if (queue->ndropped != ndropped)
+    report_overflow(queue);
+}
+
+void
+ntf_queue_discard(struct ntf_queue* queue)
+{
+  assert(queue);
+
+  ++queue->ndropped;
+  ++queue->stats.dropped;
+  report_overflow(queue);
+}
+
+struct pdu_wbuf_ref*
+ntf_queue_pop(struct ntf_queue* queue)
+{
+  struct pdu_wbuf_ref* ref;
+
+  assert(queue);
+
+  ref = STAILQ_FIRST(&queue->refs);
+  if (!ref)
+    return NULL;
+
+  remove_ref(queue, ref);
+
+  if (ref->wbuf == queue->overflow) {
+    /* the client learns about all drops until now */
+    queue->overflow = NULL;
+    queue->ndropped = 0;
+  }
+
+  return ref;
+}
+
+int
+ntf_queue_is_empty(const struct ntf_queue* queue)
+{
+  assert(queue);
+
+  return STAILQ_EMPTY(&queue->refs);
+}
+
+void
+get_ntf_queue_stats(const struct ntf_queue* queue,
+                    struct ntf_queue_stats* stats)
+{
+  assert(queue);
+  assert(stats);
+
+  *stats = queue->stats;
+}
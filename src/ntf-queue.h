@@ -0,0 +1,69 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <sys/queue.h>
+#include "bt-pdubuf.h"
+
+/* What to do with a notification while the backlog is over its
+ * limits. Services store the policy in |struct pdu_wbuf::policy|.
+ */
+enum {
+  /* Never drop; the backlog exceeds its limits instead. */
+  NTF_POLICY_NEVER_DROP = 0,
+  /* Drop the oldest notification of this policy to make room. */
+  NTF_POLICY_DROP_OLDEST,
+  /* Only the latest notification with the same service and
+   * opcode is of interest; it replaces any queued one. */
+  NTF_POLICY_COALESCE_LATEST
+};
+
+struct ntf_queue_stats {
+  unsigned long count; /* queued notifications */
+  unsigned long bytes; /* queued bytes */
+  unsigned long max_count;
+  unsigned long max_bytes;
+  unsigned long long queued;
+  unsigned long long dropped;
+  unsigned long long coalesced;
+  unsigned long long overlimit; /* never-drop PDUs queued over limits */
+};
+
+struct ntf_queue {
+  STAILQ_HEAD(, pdu_wbuf_ref) refs;
+  unsigned long limit_count;
+  unsigned long limit_bytes;
+  unsigned long npolicy[3]; /* queued notifications per policy */
+  unsigned long ndropped; /* dropped since last overflow notification */
+  struct pdu_wbuf* overflow; /* queued overflow notification */
+  struct ntf_queue_stats stats;
+};
+
+void
+init_ntf_queue(struct ntf_queue* queue,
+               unsigned long limit_count, unsigned long limit_bytes);
+
+void
+uninit_ntf_queue(struct ntf_queue* queue);
+
+/* Takes ownership of |ref|, which might get dropped immediately. */
+void
+ntf_queue_push(struct ntf_queue* queue, struct pdu_wbuf_ref* ref);
+
+/* Counts a notification that was discarded without being queued.
+ * The client learns about it from the overflow notification. */
+void
+ntf_queue_discard(struct ntf_queue* queue);
+
+/* Returns the oldest notification and hands it to the caller. */
+struct pdu_wbuf_ref*
+ntf_queue_pop(struct ntf_queue* queue);
+
+int
+ntf_queue_is_empty(const struct ntf_queue* queue);
+
+void
+get_ntf_queue_stats(const struct ntf_queue* queue,
+                    struct ntf_queue_stats* stats);
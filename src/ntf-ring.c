@@ -0,0 +1,229 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "log.h"
+#include "ntf-ring.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+/* Bionic's older releases lack memfd_create(). */
+static int
+sys_memfd_create(const char* name, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+  return syscall(__NR_memfd_create, name, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static uint32_t
+round_ring_size(unsigned long size)
+{
+  uint32_t ring_size;
+
+  for (ring_size = NTF_RING_MIN_SIZE;
+       ring_size < size && ring_size < NTF_RING_MAX_SIZE;
+       ring_size <<= 1) {
+  }
+  return ring_size;
+}
+
+int
+init_ntf_ring(struct ntf_ring* ring, unsigned long size)
+{
+  size_t data_off;
+  void* ptr;
+
+  assert(ring);
+
+  ring->size = round_ring_size(size);
+
+  /* the data area starts on its own page */
+  data_off = (sizeof(*ring->shared) + getpagesize() - 1) &
+             ~((size_t)getpagesize() - 1);
+  ring->maplen = data_off + ring->size;
+
+  ring->memfd = sys_memfd_create("bluetoothd-ntf-ring",
+                                 MFD_CLOEXEC|MFD_ALLOW_SEALING);
+  if (ring->memfd < 0) {
+    ALOGE_ERRNO("memfd_create");
+    goto err_memfd_create;
+  }
+
+  if (TEMP_FAILURE_RETRY(ftruncate(ring->memfd, ring->maplen)) < 0) {
+    ALOGE_ERRNO("ftruncate");
+    goto err_ftruncate;
+  }
+
+  /* The client gets a duplicate of the memfd. If it could shrink the
+   * file, the daemon's next store into the mapping would fault. */
+  if (TEMP_FAILURE_RETRY(fcntl(ring->memfd, F_ADD_SEALS,
+                               F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL)) < 0) {
+    ALOGE_ERRNO("fcntl");
+    goto err_fcntl;
+  }
+
+  ptr = mmap(NULL, ring->maplen, PROT_READ|PROT_WRITE, MAP_SHARED,
+             ring->memfd, 0);
+  if (ptr == MAP_FAILED) {
+    ALOGE_ERRNO("mmap");
+    goto err_mmap;
+  }
+
+  ring->eventfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (ring->eventfd < 0) {
+    ALOGE_ERRNO("eventfd");
+    goto err_eventfd;
+  }
+
+  ring->shared = ptr;
+  ring->data = (unsigned char*)ptr + data_off;
+  ring->tail = 0;
+  memset(&ring->stats, 0, sizeof(ring->stats));
+
+  ring->shared->magic = NTF_RING_MAGIC;
+  ring->shared->size = ring->size;
+  ring->shared->data_off = data_off;
+  ring->shared->head = 0;
+  ring->shared->tail = 0;
+
+  return 0;
+err_eventfd:
+  if (munmap(ptr, ring->maplen) < 0)
+    ALOGW_ERRNO("munmap");
+err_mmap:
+err_fcntl:
+err_ftruncate:
+  if (TEMP_FAILURE_RETRY(close(ring->memfd)) < 0)
+    ALOGW_ERRNO("close");
+err_memfd_create:
+  return -1;
+}
+
+void
+uninit_ntf_ring(struct ntf_ring* ring)
+{
+  assert(ring);
+
+  if (TEMP_FAILURE_RETRY(close(ring->eventfd)) < 0)
+    ALOGW_ERRNO("close");
+  if (munmap(ring->shared, ring->maplen) < 0)
+    ALOGW_ERRNO("munmap");
+  if (TEMP_FAILURE_RETRY(close(ring->memfd)) < 0)
+    ALOGW_ERRNO("close");
+}
+
+int
+ntf_ring_write(struct ntf_ring* ring, const void* buf, size_t len)
+{
+  uint32_t head, used, off;
+  size_t n;
+
+  assert(ring);
+
+  /* The client owns |head|. A bogus value only makes the ring look
+   * full; writes never leave the data area. */
+  head = __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE);
+  used = ring->tail - head;
+  if ((used > ring->size) || (len > ring->size - used)) {
+    ++ring->stats.full;
+    return -1;
+  }
+
+  off = ring->tail & (ring->size - 1);
+  n = ring->size - off;
+  if (n > len)
+    n = len;
+
+  memcpy(ring->data + off, buf, n);
+  memcpy(ring->data, (const unsigned char*)buf + n, len - n);
+
+  ring->tail += len;
+  ++ring->stats.pdus;
+  ring->stats.bytes += len;
+
+  return 0;
+}
+
+int
+ntf_ring_publish(struct ntf_ring* ring)
+{
+  uint32_t published, head;
+  uint64_t one;
+
+  assert(ring);
+
+  published = __atomic_load_n(&ring->shared->tail, __ATOMIC_RELAXED);
+  if (published == ring->tail)
+    return 0;
+
+  __atomic_store_n(&ring->shared->tail, ring->tail, __ATOMIC_RELEASE);
+
+  /* Pairs with the client's store of |head| and its second look at
+   * |tail|. If the client has consumed everything published before,
+   * it might be waiting for the eventfd. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  head = __atomic_load_n(&ring->shared->head, __ATOMIC_RELAXED);
+  if (head != published)
+    return 0;
+
+  one = 1;
+  if (TEMP_FAILURE_RETRY(write(ring->eventfd, &one, sizeof(one))) < 0) {
+    if (errno != EAGAIN) { /* counter is saturated; client is awake */
+      ALOGE_ERRNO("write");
+      return -1;
+    }
+  }
+  ++ring->stats.wakeups;
+
+  return 0;
+}
+
+int
+dup_ntf_ring_fds(const struct ntf_ring* ring, int fd[2])
+{
+  assert(ring);
+  assert(fd);
+
+  fd[0] = TEMP_FAILURE_RETRY(dup(ring->memfd));
+  if (fd[0] < 0) {
+    ALOGE_ERRNO("dup");
+    goto err_dup_memfd;
+  }
+
+  fd[1] = TEMP_FAILURE_RETRY(dup(ring->eventfd));
+  if (fd[1] < 0) {
+    ALOGE_ERRNO("dup");
+    goto err_dup_eventfd;
+  }
+
+  return 0;
+err_dup_eventfd:
+  if (TEMP_FAILURE_RETRY(close(fd[0])) < 0)
+    ALOGW_ERRNO("close");
+err_dup_memfd:
+  return -1;
+}
@@ -0,0 +1,86 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Shared-memory notification ring
+ *
+ * The daemon writes notification PDUs back to back into a memfd
+ * that the client has mapped. The ring has a single producer, the
+ * daemon's I/O thread, and a single consumer, the client. Positions
+ * are free-running byte counters; a PDU's bytes are at position
+ * modulo |size| and might wrap around the end of the data area.
+ *
+ * The memfd's size is sealed, so the client can't truncate it under
+ * the daemon's mapping.
+ *
+ * The daemon writes to the eventfd when the ring goes from empty to
+ * non-empty. The client reads all PDUs up to |tail|, stores |head|,
+ * and checks |tail| again before it waits for the eventfd.
+ */
+
+#define NTF_RING_MAGIC 0x4e545231 /* "NTR1" */
+
+/* An empty ring always holds a PDU of maximum size, 4 + 65535 bytes.
+ * Otherwise such a PDU would never fit and the notifications behind
+ * it would wait forever. */
+#define NTF_RING_MIN_SIZE (128 * 1024)
+#define NTF_RING_MAX_SIZE (1024 * 1024)
+#define NTF_RING_DEFAULT_SIZE NTF_RING_MIN_SIZE
+
+/* Layout of the memfd's first bytes; the data area follows at
+ * |data_off|. All fields are in host byte order.
+ */
+struct ntf_ring_shared {
+  uint32_t magic;
+  uint32_t size; /* of the data area; a power of two */
+  uint32_t data_off;
+  uint32_t head __attribute__((aligned(64))); /* written by the client */
+  uint32_t tail __attribute__((aligned(64))); /* written by the daemon */
+} __attribute__((aligned(64)));
+
+struct ntf_ring_stats {
+  unsigned long long pdus;
+  unsigned long long bytes;
+  unsigned long long wakeups; /* eventfd writes */
+  unsigned long long full; /* writes refused for lack of space */
+};
+
+struct ntf_ring {
+  int memfd;
+  int eventfd;
+  struct ntf_ring_shared* shared;
+  unsigned char* data;
+  size_t maplen;
+  uint32_t size;
+  uint32_t tail; /* written, but not yet published */
+  struct ntf_ring_stats stats;
+};
+
+/* |size| is rounded up to a power of two within the limits. */
+int
+init_ntf_ring(struct ntf_ring* ring, unsigned long size);
+
+void
+uninit_ntf_ring(struct ntf_ring* ring);
+
+/* Copies a PDU into the ring. Returns 0 on success, or -1 if the
+ * ring doesn't have enough space. The PDU becomes visible to the
+ * client with the next call to ntf_ring_publish(). */
+int
+ntf_ring_write(struct ntf_ring* ring, const void* buf, size_t len);
+
+/* Makes all written PDUs visible and wakes up the client if it
+ * might be waiting. Returns 0 on success, or -1 on errors. */
+int
+ntf_ring_publish(struct ntf_ring* ring);
+
+/* Duplicates the memfd and the eventfd for handing them to the
+ * client. Returns 0 on success, or -1 on errors. */
+int
+dup_ntf_ring_fds(const struct ntf_ring* ring, int fd[2]);
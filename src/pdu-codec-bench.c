@@ -0,0 +1,169 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Microbenchmark for the PDU codecs
+ *
+ * Encodes and decodes a few representative PDUs with the generated
+ * codecs from pdu-codec.h and with the format-string accessors, and
+ * prints the time per message for each. Run as
+ *
+ *   pdu-codec-bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bt-proto.h"
+#include "pdu-codec.h"
+
+#define DEFAULT_ITERATIONS 10000000UL
+
+static union {
+  struct pdu pdu;
+  unsigned char raw[sizeof(struct pdu) + UINT16_MAX];
+} buf;
+
+/* Keeps the compiler from discarding decoded values */
+static volatile unsigned long sink;
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(const char* name, const char* path, unsigned long n, double t0)
+{
+  printf("%-28s %-8s %7.1f ns/msg\n", name, path, (now_ns() - t0) / n);
+}
+
+static void
+bench_ssp_reply_cmd(unsigned long n)
+{
+  struct bt_core_ssp_reply_cmd msg = {
+    .bd_addr = { { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 } },
+    .variant = 1,
+    .accept = 1,
+    .passkey = 123456
+  };
+  bt_bdaddr_t bd_addr;
+  uint8_t variant, accept;
+  uint32_t passkey;
+  unsigned long i;
+  double t0;
+
+  init_pdu(&buf.pdu, SERVICE_BT_CORE, 0x11);
+  append_bt_core_ssp_reply_cmd(&buf.pdu, &msg);
+
+  t0 = now_ns();
+  for (i = 0; i < n; ++i) {
+    if (read_pdu_at(&buf.pdu, 0, "mCCI",
+                    bd_addr.address, sizeof(bd_addr.address),
+                    &variant, &accept, &passkey) < 0)
+      abort();
+    sink += passkey + accept + variant + bd_addr.address[5];
+  }
+  report("bt_core_ssp_reply_cmd", "varargs", n, t0);
+
+  t0 = now_ns();
+  for (i = 0; i < n; ++i) {
+    if (read_bt_core_ssp_reply_cmd(&buf.pdu, 0, &msg) < 0)
+      abort();
+    sink += msg.passkey + msg.accept + msg.variant + msg.bd_addr.address[5];
+  }
+  report("bt_core_ssp_reply_cmd", "codec", n, t0);
+}
+
+static void
+bench_sock_listen_cmd(unsigned long n)
+{
+  struct bt_sock_listen_cmd msg = {
+    .type = 1,
+    .service_name = "bench",
+    .channel = 3,
+    .flags = 0
+  };
+  uint8_t type, flags;
+  int8_t service_name[256];
+  uint8_t uuid[16];
+  uint16_t channel;
+  unsigned long i;
+  double t0;
+
+  init_pdu(&buf.pdu, SERVICE_BT_SOCK, 0x01);
+  append_bt_sock_listen_cmd(&buf.pdu, &msg);
+
+  t0 = now_ns();
+  for (i = 0; i < n; ++i) {
+    if (read_pdu_at(&buf.pdu, 0, "CmmSC", &type,
+                    service_name, sizeof(service_name),
+                    uuid, sizeof(uuid), &channel, &flags) < 0)
+      abort();
+    sink += type + service_name[0] + uuid[0] + channel + flags;
+  }
+  report("bt_sock_listen_cmd", "varargs", n, t0);
+
+  t0 = now_ns();
+  for (i = 0; i < n; ++i) {
+    if (read_bt_sock_listen_cmd(&buf.pdu, 0, &msg) < 0)
+      abort();
+    sink += msg.type + msg.service_name[0] + msg.uuid[0] + msg.channel +
+            msg.flags;
+  }
+  report("bt_sock_listen_cmd", "codec", n, t0);
+}
+
+static void
+bench_bond_state_changed_ntf(unsigned long n)
+{
+  struct bt_core_bond_state_changed_ntf ntf = {
+    .status = BT_STATUS_SUCCESS,
+    .remote_bd_addr = { { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 } },
+    .state = BT_BOND_STATE_BONDED
+  };
+  unsigned long i;
+  double t0;
+
+  t0 = now_ns();
+  for (i = 0; i < n; ++i) {
+    init_pdu(&buf.pdu, SERVICE_BT_CORE, 0x88);
+    if (append_to_pdu(&buf.pdu, "CmC", ntf.status,
+                      ntf.remote_bd_addr.address,
+                      sizeof(ntf.remote_bd_addr.address), ntf.state) < 0)
+      abort();
+    sink += buf.pdu.len;
+  }
+  report("bt_core_bond_state_changed", "varargs", n, t0);
+
+  t0 = now_ns();
+  for (i = 0; i < n; ++i) {
+    init_pdu(&buf.pdu, SERVICE_BT_CORE, 0x88);
+    if (append_bt_core_bond_state_changed_ntf(&buf.pdu, &ntf) < 0)
+      abort();
+    sink += buf.pdu.len;
+  }
+  report("bt_core_bond_state_changed", "codec", n, t0);
+}
+
+int
+main(int argc, char* argv[])
+{
+  unsigned long n;
+
+  n = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+  if (!n)
+    n = DEFAULT_ITERATIONS;
+
+  bench_ssp_reply_cmd(n);
+  bench_sock_listen_cmd(n);
+  bench_bond_state_changed_ntf(n);
+
+  return EXIT_SUCCESS;
+}
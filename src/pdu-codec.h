@@ -0,0 +1,122 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "log.h"
+#include "bt-proto.h"
+#include "pdu-layout.h"
+
+/*
+ * PDU codecs
+ *
+ * For each entry |name| in PDU_LAYOUTS, this file generates
+ *
+ *  - struct name, with one member per field,
+ *  - name_len, the length of the fixed-size part on the wire,
+ *  - read_name(pdu, off, msg), which decodes the fields at |off|,
+ *  - write_name(pdu, off, msg), which encodes the fields at |off|, and
+ *  - append_name(pdu, msg), which encodes the fields at the PDU's end.
+ *
+ * The functions check the bounds once per message and copy each field
+ * from a fixed offset. They return the offset after the fields, or -1
+ * if the message exceeds the PDU.
+ */
+
+#define PDU_STRUCT_FIELD(_t, _f) \
+  _t _f;
+
+#define PDU_STRUCT_ARRAY(_t, _f, _n) \
+  _t _f[_n];
+
+#define PDU_STRUCT(_name, _fields) \
+  struct _name { \
+    _fields \
+  };
+
+PDU_LAYOUTS(PDU_STRUCT, PDU_STRUCT_FIELD, PDU_STRUCT_ARRAY)
+
+#define PDU_LEN_FIELD(_t, _f) \
+  + sizeof(_t)
+
+#define PDU_LEN_ARRAY(_t, _f, _n) \
+  + (_n) * sizeof(_t)
+
+#define PDU_LEN(_name, _fields) \
+  enum { \
+    _name##_len = 0 _fields \
+  };
+
+PDU_LAYOUTS(PDU_LEN, PDU_LEN_FIELD, PDU_LEN_ARRAY)
+
+#define PDU_DECODE_FIELD(_t, _f) \
+  memcpy(&msg->_f, src, sizeof(msg->_f)); \
+  src += sizeof(msg->_f);
+
+#define PDU_DECODE_ARRAY(_t, _f, _n) \
+  PDU_DECODE_FIELD(_t, _f)
+
+#define PDU_DECODER(_name, _fields) \
+  static inline void \
+  decode_##_name(const unsigned char* src, struct _name* msg) \
+  { \
+    _fields \
+  } \
+  \
+  static inline long \
+  read_##_name(const struct pdu* pdu, unsigned long off, \
+               struct _name* msg) \
+  { \
+    if (off + _name##_len > pdu->len) { \
+      ALOGE("PDU overflow"); \
+      return -1; \
+    } \
+    decode_##_name(pdu->data + off, msg); \
+    return off + _name##_len; \
+  }
+
+PDU_LAYOUTS(PDU_DECODER, PDU_DECODE_FIELD, PDU_DECODE_ARRAY)
+
+#define PDU_ENCODE_FIELD(_t, _f) \
+  memcpy(dst, &msg->_f, sizeof(msg->_f)); \
+  dst += sizeof(msg->_f);
+
+#define PDU_ENCODE_ARRAY(_t, _f, _n) \
+  PDU_ENCODE_FIELD(_t, _f)
+
+#define PDU_ENCODER(_name, _fields) \
+  static inline void \
+  encode_##_name(unsigned char* dst, const struct _name* msg) \
+  { \
+    _fields \
+  } \
+  \
+  static inline long \
+  write_##_name(struct pdu* pdu, unsigned long off, \
+                const struct _name* msg) \
+  { \
+    if (off + _name##_len > pdu->len) { \
+      ALOGE("PDU overflow"); \
+      return -1; \
+    } \
+    encode_##_name(pdu->data + off, msg); \
+    return off + _name##_len; \
+  } \
+  \
+  static inline long \
+  append_##_name(struct pdu* pdu, const struct _name* msg) \
+  { \
+    /* the caller allocated the PDU's buffer large enough */ \
+    if (pdu->len + _name##_len > UINT16_MAX) { \
+      ALOGE("PDU overflow"); \
+      return -1; \
+    } \
+    encode_##_name(pdu->data + pdu->len, msg); \
+    pdu->len += _name##_len; \
+    return pdu->len; \
+  }
+
+PDU_LAYOUTS(PDU_ENCODER, PDU_ENCODE_FIELD, PDU_ENCODE_ARRAY)
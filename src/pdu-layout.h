@@ -0,0 +1,132 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+/*
+ * PDU layouts
+ *
+ * Each entry L(name, fields) describes the fixed-size part of one
+ * PDU's data, with its fields in wire order. F(type, field) is a
+ * field of the given type, A(type, field, n) an array of n elements.
+ * Fields are in host byte order and unaligned. Variable-length data,
+ * such as properties or DUT buffers, follows the fixed-size part.
+ *
+ * Don't include this file directly; pdu-codec.h expands the list
+ * into a struct, an encoder and a decoder per entry.
+ */
+
+#define PDU_LAYOUTS(L, F, A) \
+  /* SERVICE_CORE */ \
+  L(core_status_rsp, \
+    F(uint8_t, status)) \
+  L(core_register_module_cmd, \
+    F(uint8_t, service) \
+    F(uint8_t, mode)) \
+  L(core_unregister_module_cmd, \
+    F(uint8_t, service)) \
+  L(core_open_ntf_ring_cmd, \
+    F(uint32_t, size)) \
+  L(core_grant_ntf_credits_cmd, \
+    F(uint32_t, credits)) \
+  L(core_batch_cmd, \
+    F(uint8_t, count)) \
+  L(core_batch_rsp, \
+    F(uint8_t, count)) \
+  L(core_batch_entry_rsp, \
+    F(uint8_t, status)) \
+  L(core_ntf_overflow_ntf, \
+    F(uint32_t, ndropped)) \
+  /* SERVICE_BT_CORE */ \
+  L(bt_property_hdr, \
+    F(uint8_t, type) \
+    F(uint16_t, len)) \
+  L(bt_core_get_adapter_property_cmd, \
+    F(uint8_t, type)) \
+  L(bt_core_get_remote_device_properties_cmd, \
+    F(bt_bdaddr_t, remote_addr)) \
+  L(bt_core_get_remote_device_property_cmd, \
+    F(bt_bdaddr_t, remote_addr) \
+    F(uint8_t, type)) \
+  L(bt_core_set_remote_device_property_cmd, \
+    F(bt_bdaddr_t, remote_addr)) \
+  L(bt_core_get_remote_service_record_cmd, \
+    F(bt_bdaddr_t, remote_addr) \
+    F(bt_uuid_t, uuid)) \
+  L(bt_core_get_remote_services_cmd, \
+    F(bt_bdaddr_t, remote_addr)) \
+  L(bt_core_create_bond_cmd, \
+    F(bt_bdaddr_t, bd_addr)) \
+  L(bt_core_remove_bond_cmd, \
+    F(bt_bdaddr_t, bd_addr)) \
+  L(bt_core_cancel_bond_cmd, \
+    F(bt_bdaddr_t, bd_addr)) \
+  L(bt_core_pin_reply_cmd, \
+    F(bt_bdaddr_t, bd_addr) \
+    F(uint8_t, accept) \
+    F(uint8_t, pin_len) \
+    F(bt_pin_code_t, pin_code)) \
+  L(bt_core_ssp_reply_cmd, \
+    F(bt_bdaddr_t, bd_addr) \
+    F(uint8_t, variant) \
+    F(uint8_t, accept) \
+    F(uint32_t, passkey)) \
+  L(bt_core_dut_mode_configure_cmd, \
+    F(uint8_t, enable)) \
+  L(bt_core_dut_mode_send_cmd, \
+    F(uint16_t, opcode) \
+    F(uint8_t, len)) \
+  L(bt_core_le_test_mode_cmd, \
+    F(uint16_t, opcode) \
+    F(uint8_t, len)) \
+  L(bt_core_adapter_state_changed_ntf, \
+    F(uint8_t, state)) \
+  L(bt_core_adapter_properties_changed_ntf, \
+    F(uint8_t, status) \
+    F(uint8_t, num_properties)) \
+  L(bt_core_remote_device_properties_ntf, \
+    F(uint8_t, status) \
+    F(bt_bdaddr_t, bd_addr) \
+    F(uint8_t, num_properties)) \
+  L(bt_core_device_found_ntf, \
+    F(uint8_t, num_properties)) \
+  L(bt_core_discovery_state_changed_ntf, \
+    F(uint8_t, state)) \
+  L(bt_core_pin_request_ntf, \
+    F(bt_bdaddr_t, remote_bd_addr) \
+    F(bt_bdname_t, bd_name) \
+    F(uint32_t, cod)) \
+  L(bt_core_ssp_request_ntf, \
+    F(bt_bdaddr_t, remote_bd_addr) \
+    F(bt_bdname_t, bd_name) \
+    F(uint32_t, cod) \
+    F(uint8_t, pairing_variant) \
+    F(uint32_t, pass_key)) \
+  L(bt_core_bond_state_changed_ntf, \
+    F(uint8_t, status) \
+    F(bt_bdaddr_t, remote_bd_addr) \
+    F(uint8_t, state)) \
+  L(bt_core_acl_state_changed_ntf, \
+    F(uint8_t, status) \
+    F(bt_bdaddr_t, remote_bd_addr) \
+    F(uint8_t, state)) \
+  L(bt_core_dut_mode_receive_ntf, \
+    F(uint16_t, opcode) \
+    F(uint8_t, len)) \
+  L(bt_core_le_test_mode_ntf, \
+    F(uint8_t, status) \
+    F(uint16_t, num_packets)) \
+  /* SERVICE_BT_SOCK */ \
+  L(bt_sock_listen_cmd, \
+    F(uint8_t, type) \
+    A(int8_t, service_name, 256) \
+    A(uint8_t, uuid, 16) \
+    F(uint16_t, channel) \
+    F(uint8_t, flags)) \
+  L(bt_sock_connect_cmd, \
+    F(bt_bdaddr_t, bd_addr) \
+    F(uint8_t, type) \
+    A(uint8_t, uuid, 16) \
+    F(uint16_t, channel) \
+    F(uint8_t, flags))
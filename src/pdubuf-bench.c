@@ -0,0 +1,206 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Benchmark for the PDU buffer pool
+ *
+ * Creates and releases wbufs of the sizes that the daemon sends most,
+ * once with the pool and once with plain malloc(). The same-thread
+ * case frees each buffer right away; the cross-thread case allocates
+ * batches on one thread and frees them on another, as Bluedroid's
+ * callbacks and the I/O thread do. Prints the time per buffer and the
+ * pool's hits and misses. Run as
+ *
+ *   pdubuf-bench [iterations]
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "bt-pdubuf.h"
+#include "pdu-codec.h"
+
+#define DEFAULT_ITERATIONS 10000000UL
+
+/* buffers per hand-over between the threads */
+#define BATCH_SIZE 64
+
+/* acks, state notifications, pin requests and a device with a few
+ * properties */
+static const unsigned long datalen[] = {
+  0,
+  bt_core_adapter_state_changed_ntf_len,
+  bt_core_pin_request_ntf_len,
+  bt_core_device_found_ntf_len + 3 * 3 + 6 + 4 + 16
+};
+
+#define NSIZES (sizeof(datalen) / sizeof(datalen[0]))
+
+struct allocator {
+  const char* name;
+  void* (*alloc)(unsigned long datalen);
+  void (*free)(void* buf);
+};
+
+static void*
+pool_alloc(unsigned long datalen)
+{
+  return create_pdu_wbuf(datalen, sizeof(struct iovec));
+}
+
+static void
+pool_free(void* buf)
+{
+  cleanup_pdu_wbuf(buf);
+}
+
+/* create_pdu_wbuf() before the pool; it initializes the header, too */
+static void*
+malloc_alloc(unsigned long datalen)
+{
+  struct pdu_wbuf* wbuf;
+
+  wbuf = malloc(sizeof(*wbuf) + datalen + sizeof(struct iovec));
+  if (wbuf)
+    memset(wbuf, 0, sizeof(*wbuf));
+  return wbuf;
+}
+
+static const struct allocator allocator[] = {
+  { "malloc", malloc_alloc, free },
+  { "pool", pool_alloc, pool_free }
+};
+
+#define NALLOCATORS (sizeof(allocator) / sizeof(allocator[0]))
+
+/* Two batches alternate between the threads, so that allocations and
+ * releases overlap on hosts with more than one CPU. */
+static void* batch[2][BATCH_SIZE];
+static sem_t batch_empty;
+static sem_t batch_full;
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(const char* name, const char* path, unsigned long n, double t0)
+{
+  printf("%-28s %-8s %7.1f ns/buf\n", name, path, (now_ns() - t0) / n);
+}
+
+static void
+bench_same_thread(const struct allocator* a, unsigned long n)
+{
+  unsigned long i;
+  void* buf;
+  double t0;
+
+  t0 = now_ns();
+  for (i = 0; i < n; ++i) {
+    buf = a->alloc(datalen[i % NSIZES]);
+    if (!buf)
+      abort();
+    a->free(buf);
+  }
+  report("same thread", a->name, n, t0);
+}
+
+struct release_args {
+  const struct allocator* a;
+  unsigned long nbatches;
+};
+
+static void*
+release_batches(void* arg)
+{
+  const struct release_args* args = arg;
+  unsigned long i, j;
+
+  for (i = 0; i < args->nbatches; ++i) {
+    TEMP_FAILURE_RETRY(sem_wait(&batch_full));
+    for (j = 0; j < BATCH_SIZE; ++j)
+      args->a->free(batch[i % 2][j]);
+    sem_post(&batch_empty);
+  }
+  return NULL;
+}
+
+static void
+bench_cross_thread(const struct allocator* a, unsigned long n)
+{
+  struct release_args args = {
+    .a = a,
+    .nbatches = n / BATCH_SIZE
+  };
+  pthread_t thread;
+  unsigned long i, j;
+  double t0;
+  int err;
+
+  sem_init(&batch_empty, 0, 2);
+  sem_init(&batch_full, 0, 0);
+
+  t0 = now_ns();
+
+  err = pthread_create(&thread, NULL, release_batches, &args);
+  if (err) {
+    ALOGE("pthread_create failed: %s", strerror(err));
+    abort();
+  }
+
+  for (i = 0; i < args.nbatches; ++i) {
+    TEMP_FAILURE_RETRY(sem_wait(&batch_empty));
+    for (j = 0; j < BATCH_SIZE; ++j) {
+      batch[i % 2][j] = a->alloc(datalen[j % NSIZES]);
+      if (!batch[i % 2][j])
+        abort();
+    }
+    sem_post(&batch_full);
+  }
+  pthread_join(thread, NULL);
+
+  report("cross thread", a->name, args.nbatches * BATCH_SIZE, t0);
+
+  sem_destroy(&batch_full);
+  sem_destroy(&batch_empty);
+}
+
+int
+main(int argc, char* argv[])
+{
+  unsigned long n, i;
+  struct pdu_buf_pool_stats stats;
+
+  n = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+  if (n < BATCH_SIZE) {
+    fprintf(stderr, "usage: pdubuf-bench [iterations]\n");
+    return EXIT_FAILURE;
+  }
+
+  init_pdu_buf_pool();
+
+  for (i = 0; i < NALLOCATORS; ++i)
+    bench_same_thread(allocator + i, n);
+  for (i = 0; i < NALLOCATORS; ++i)
+    bench_cross_thread(allocator + i, n);
+
+  for (i = 0; !get_pdu_buf_pool_stats(i, &stats); ++i) {
+    printf("pool %-4lu x %-18lu %12llu hits %8llu misses\n",
+           stats.size, stats.nblocks, stats.hits, stats.misses);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -2,22 +2,232 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this file,
  * You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <assert.h>
+#include <string.h>
+#include "log.h"
 #include "bt-proto.h"
 #include "bt-core-io.h"
 #include "bt-sock-io.h"
 #include "core-io.h"
 #include "service.h"
 
-bt_status_t (*service_handler[256])(const struct pdu*);
-
-register_func
-  (* const register_service[256])(unsigned char, void (*)(struct pdu_wbuf*)) = {
+static const struct {
+  uint8_t service;
+  register_func register_service;
+  int (*unregister_service)(void);
+} services[] = {
   /* SERVICE_CORE is special and not handled here */
-  [SERVICE_BT_CORE] = register_bt_core,
-  [SERVICE_BT_SOCK] = register_bt_sock
+  { SERVICE_BT_CORE, register_bt_core, unregister_bt_core },
+  { SERVICE_BT_SOCK, register_bt_sock, unregister_bt_sock }
 };
 
-int (*unregister_service[256])() = {
-  [SERVICE_BT_CORE] = unregister_bt_core,
-  [SERVICE_BT_SOCK] = unregister_bt_sock
+#define NSERVICES (sizeof(services) / sizeof(services[0]))
+
+int
+find_service(uint8_t service, register_func* register_service,
+             int (**unregister_service)(void))
+{
+  size_t i;
+
+  assert(register_service);
+  assert(unregister_service);
+
+  for (i = 0; i < NSERVICES; ++i) {
+    if (services[i].service == service) {
+      *register_service = services[i].register_service;
+      *unregister_service = services[i].unregister_service;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Dispatch table
+ *
+ * All registered commands are stored densely in |op|, keyed by
+ * service << 8 | opcode. An open-addressing hash table maps keys
+ * to entries. Its slots hold the key and a 1-based index into |op|,
+ * so a lookup usually reads one cache line of slots and then the
+ * entry. Registering or removing a service rebuilds the table.
+ *
+ * The table is only used on the I/O thread.
+ */
+
+#define DISPATCH_NOPS 64
+#define DISPATCH_SLOT_BITS 7
+#define DISPATCH_NSLOTS (1ul << DISPATCH_SLOT_BITS) /* twice DISPATCH_NOPS */
+
+#define DISPATCH_KEY(_service, _opcode) \
+  ((uint16_t)(((_service) << 8) | (_opcode)))
+
+struct dispatch_op {
+  uint16_t key;
+  uint16_t min_len;
+  uint16_t max_len;
+  unsigned char cls;
+  unsigned char flags;
+  bt_status_t (*handler)(const struct pdu*);
+  unsigned long long hits;
+  unsigned long long rejected;
 };
+
+static struct {
+  uint16_t key[DISPATCH_NSLOTS];
+  uint8_t index[DISPATCH_NSLOTS]; /* 0 if the slot is empty */
+} slots;
+
+static struct dispatch_op op[DISPATCH_NOPS];
+static unsigned long nops;
+
+static unsigned long
+hash_key(uint16_t key)
+{
+  /* Fibonacci hashing; takes the top bits of the 16-bit product */
+  return ((key * 40503u) & 0xffff) >> (16 - DISPATCH_SLOT_BITS);
+}
+
+static void
+rebuild_slots(void)
+{
+  unsigned long i, slot;
+
+  memset(&slots, 0, sizeof(slots));
+
+  for (i = 0; i < nops; ++i) {
+    slot = hash_key(op[i].key);
+    while (slots.index[slot])
+      slot = (slot + 1) & (DISPATCH_NSLOTS - 1);
+    slots.key[slot] = op[i].key;
+    slots.index[slot] = i + 1;
+  }
+}
+
+static struct dispatch_op*
+find_op(uint16_t key)
+{
+  unsigned long slot;
+
+  for (slot = hash_key(key); slots.index[slot];
+       slot = (slot + 1) & (DISPATCH_NSLOTS - 1)) {
+    if (slots.key[slot] == key)
+      return op + slots.index[slot] - 1;
+  }
+  return NULL;
+}
+
+int
+add_service_ops(uint8_t service, const struct service_op* sop)
+{
+  unsigned long n;
+
+  assert(sop);
+
+  for (n = 0; sop[n].handler; ++n) {
+    if (find_op(DISPATCH_KEY(service, sop[n].opcode))) {
+      ALOGE("opcode 0x%x of service 0x%x already registered",
+            sop[n].opcode, service);
+      return -1;
+    }
+  }
+  if (n > DISPATCH_NOPS - nops) {
+    ALOGE("dispatch table full");
+    return -1;
+  }
+
+  for (; sop->handler; ++sop, ++nops) {
+    op[nops].key = DISPATCH_KEY(service, sop->opcode);
+    op[nops].min_len = sop->min_len;
+    op[nops].max_len = sop->max_len;
+    op[nops].cls = sop->cls;
+    op[nops].flags = sop->flags;
+    op[nops].handler = sop->handler;
+    op[nops].hits = 0;
+    op[nops].rejected = 0;
+  }
+  rebuild_slots();
+
+  return 0;
+}
+
+void
+remove_service_ops(uint8_t service)
+{
+  unsigned long i, n;
+
+  for (i = 0, n = 0; i < nops; ++i) {
+    if ((op[i].key >> 8) != service)
+      op[n++] = op[i];
+  }
+  nops = n;
+  rebuild_slots();
+}
+
+int
+has_service_ops(uint8_t service)
+{
+  unsigned long i;
+
+  for (i = 0; i < nops; ++i) {
+    if ((op[i].key >> 8) == service)
+      return 1;
+  }
+  return 0;
+}
+
+/* Rejects commands with any of the flags in |reject| */
+static bt_status_t
+dispatch(const struct pdu* cmd, unsigned char reject)
+{
+  struct dispatch_op* dop;
+
+  assert(cmd);
+
+  dop = find_op(DISPATCH_KEY(cmd->service, cmd->opcode));
+  if (!dop) {
+    ALOGE("unsupported PDU(0x%x:0x%x)", cmd->service, cmd->opcode);
+    return BT_STATUS_UNSUPPORTED;
+  }
+  if (dop->flags & reject) {
+    ALOGE("PDU(0x%x:0x%x) not supported here", cmd->service, cmd->opcode);
+    return BT_STATUS_UNSUPPORTED;
+  }
+  if ((cmd->len < dop->min_len) || (cmd->len > dop->max_len)) {
+    ALOGE("PDU(0x%x:0x%x) with invalid length %u",
+          cmd->service, cmd->opcode, cmd->len);
+    ++dop->rejected;
+    return BT_STATUS_PARM_INVALID;
+  }
+  ++dop->hits;
+
+  return dop->handler(cmd);
+}
+
+bt_status_t
+dispatch_pdu(const struct pdu* cmd)
+{
+  return dispatch(cmd, 0);
+}
+
+bt_status_t
+dispatch_batched_pdu(const struct pdu* cmd)
+{
+  return dispatch(cmd, SERVICE_OP_UNBATCHED);
+}
+
+int
+get_service_op_stats(unsigned long i, struct service_op_stats* stats)
+{
+  assert(stats);
+
+  if (i >= nops)
+    return -1;
+
+  stats->service = op[i].key >> 8;
+  stats->opcode = op[i].key & 0xff;
+  stats->cls = op[i].cls;
+  stats->hits = op[i].hits;
+  stats->rejected = op[i].rejected;
+
+  return 0;
+}
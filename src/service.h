@@ -4,16 +4,69 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <hardware/bluetooth.h>
 
 struct pdu;
 struct pdu_wbuf;
 
-typedef bt_status_t (*register_func)(const struct pdu*);
+/* The command can't be part of a batch, such as because its
+ * response carries file descriptors. */
+#define SERVICE_OP_UNBATCHED 0x01
 
-extern bt_status_t (*service_handler[256])(const struct pdu*);
+/* A command that a service handles. Commands with less than
+ * |min_len| or more than |max_len| bytes of data are rejected before
+ * their handler runs. |cls| is the command's task class, |flags| a
+ * combination of the SERVICE_OP_ flags. A service's commands are
+ * listed in an array that ends with a NULL handler.
+ */
+struct service_op {
+  uint8_t opcode;
+  unsigned char cls;
+  uint16_t min_len;
+  uint16_t max_len;
+  bt_status_t (*handler)(const struct pdu*);
+  unsigned char flags;
+};
 
-extern register_func
-  (* const register_service[256])(unsigned char, void (*)(struct pdu_wbuf*));
+struct service_op_stats {
+  uint8_t service;
+  uint8_t opcode;
+  unsigned char cls;
+  unsigned long long hits;
+  unsigned long long rejected; /* invalid length */
+};
 
-extern int (*unregister_service[256])(void);
+typedef const struct service_op*
+  (*register_func)(unsigned char mode, void (*send_pdu)(struct pdu_wbuf*));
+
+/* Returns the functions that set up and tear down |service|, or -1
+ * if there is no such service. SERVICE_CORE is special and not
+ * handled here. */
+int
+find_service(uint8_t service, register_func* register_service,
+             int (**unregister_service)(void));
+
+/* Adds a service's commands to the dispatch table. */
+int
+add_service_ops(uint8_t service, const struct service_op* op);
+
+void
+remove_service_ops(uint8_t service);
+
+int
+has_service_ops(uint8_t service);
+
+/* Runs the handler of the command. Unknown commands and commands
+ * of invalid length are rejected without running a handler. */
+bt_status_t
+dispatch_pdu(const struct pdu* cmd);
+
+/* Like dispatch_pdu(), but also rejects commands that can't be part
+ * of a batch. */
+bt_status_t
+dispatch_batched_pdu(const struct pdu* cmd);
+
+/* Returns -1 if there's no command at index |i|. */
+int
+get_service_op_stats(unsigned long i, struct service_op_stats* stats);
@@ -0,0 +1,250 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Benchmark for the task queue
+ *
+ * Producer threads queue empty tasks for the I/O thread, first with
+ * run_task() and then with the former implementation, which mallocs
+ * each task and sends its pointer through a pipe. Producers keep at
+ * most MAX_PENDING tasks in flight, so neither queue runs full. Prints
+ * the time per task and the loop's syscalls per task. Run as
+ *
+ *   task-bench [producers [tasks per producer]]
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "loop.h"
+#include "task.h"
+
+#define DEFAULT_NPRODUCERS 4UL
+#define DEFAULT_NTASKS 250000UL
+
+/* below the size of the bulk lane */
+#define MAX_PENDING 1024
+
+static unsigned long nproducers = DEFAULT_NPRODUCERS;
+static unsigned long ntasks = DEFAULT_NTASKS;
+
+static int (*queue_task)(int (*)(void*), void*);
+static int (*task_func)(void*);
+static const char* queue_name;
+static pthread_t* producer;
+static unsigned long pending;
+static unsigned long executed;
+static struct epoll_loop_stats stats0;
+static double t0;
+
+static int pipefd[2];
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+ring_run_task(int (*func)(void*), void* data)
+{
+  return run_task(TASK_CLASS_BULK, func, data);
+}
+
+/* The pipe-based queue, as task.c implemented it before the ring */
+
+static int
+pipe_run_task(int (*func)(void*), void* data)
+{
+  struct task* task;
+
+  task = malloc(sizeof(*task));
+  if (!task) {
+    ALOGE_ERRNO("malloc");
+    goto err_malloc;
+  }
+  task->func = func;
+  task->data = data;
+
+  if (TEMP_FAILURE_RETRY(write(pipefd[1], &task, sizeof(task))) < 0) {
+    ALOGE_ERRNO("write");
+    goto err_write;
+  }
+
+  return 0;
+err_write:
+  free(task);
+err_malloc:
+  return -1;
+}
+
+static void
+pipe_exec_task(int fd, uint32_t flags, void* data)
+{
+  struct task* task[EPOLL_LOOP_BUDGET];
+  ssize_t res, i;
+
+  res = read_from_epoll_loop(fd, task, sizeof(task));
+  if (res < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      ALOGE_ERRNO("read");
+    return;
+  }
+
+  for (i = 0; i < res / (ssize_t)sizeof(task[0]); ++i) {
+    task[i]->func(task[i]->data);
+    free(task[i]);
+  }
+
+  if ((size_t)res == sizeof(task))
+    requeue_fd_in_epoll_loop(fd, flags);
+}
+
+static int
+init_pipe_queue(void)
+{
+  if (TEMP_FAILURE_RETRY(pipe(pipefd)) < 0) {
+    ALOGE_ERRNO("pipe");
+    goto err_pipe;
+  }
+  if (TEMP_FAILURE_RETRY(fcntl(pipefd[0], F_SETFL, O_NONBLOCK)) < 0) {
+    ALOGE_ERRNO("fcntl");
+    goto err_fcntl;
+  }
+  if (add_read_fd_to_epoll_loop(pipefd[0], EPOLLIN|EPOLLERR|EPOLLET,
+                                pipe_exec_task, NULL) < 0)
+    goto err_add_read_fd_to_epoll_loop;
+
+  return 0;
+err_add_read_fd_to_epoll_loop:
+err_fcntl:
+  if (TEMP_FAILURE_RETRY(close(pipefd[1])))
+    ALOGW_ERRNO("close");
+  if (TEMP_FAILURE_RETRY(close(pipefd[0])))
+    ALOGW_ERRNO("close");
+err_pipe:
+  return -1;
+}
+
+static void*
+produce(void* arg)
+{
+  unsigned long i;
+
+  for (i = 0; i < ntasks; ++i) {
+    while (__atomic_load_n(&pending, __ATOMIC_RELAXED) >= MAX_PENDING)
+      sched_yield();
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+    if (queue_task(task_func, NULL) < 0)
+      exit(EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+static void
+start_phase(int (*func)(int (*)(void*), void*), const char* name)
+{
+  unsigned long i;
+  int err;
+
+  queue_task = func;
+  queue_name = name;
+  executed = 0;
+  get_epoll_loop_stats(&stats0);
+  t0 = now_ns();
+
+  for (i = 0; i < nproducers; ++i) {
+    err = pthread_create(producer + i, NULL, produce, NULL);
+    if (err) {
+      ALOGE("pthread_create failed: %s", strerror(err));
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void
+finish_phase(void)
+{
+  struct epoll_loop_stats stats;
+  unsigned long i, n;
+  double ns;
+
+  ns = now_ns() - t0;
+  get_epoll_loop_stats(&stats);
+
+  for (i = 0; i < nproducers; ++i)
+    pthread_join(producer[i], NULL);
+
+  n = nproducers * ntasks;
+  printf("%-28s %-8s %7.1f ns/task %6.3f syscalls/task\n",
+         queue_name, epoll_loop_backend_name(), ns / n,
+         (double)(stats.syscalls - stats0.syscalls) / n);
+}
+
+static int
+count_task(void* data)
+{
+  __atomic_sub_fetch(&pending, 1, __ATOMIC_RELAXED);
+
+  if (++executed < nproducers * ntasks)
+    return 0;
+
+  finish_phase();
+
+  if (queue_task == ring_run_task) {
+    start_phase(pipe_run_task, "pipe+malloc");
+    return 0;
+  }
+  exit(EXIT_SUCCESS);
+}
+
+static int
+init(void* data)
+{
+  producer = calloc(nproducers, sizeof(*producer));
+  if (!producer) {
+    ALOGE_ERRNO("calloc");
+    return -1;
+  }
+
+  task_func = count_task;
+
+  if (init_task_queue() < 0)
+    return -1;
+  if (init_pipe_queue() < 0)
+    return -1;
+
+  start_phase(ring_run_task, "mpsc ring");
+
+  return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc > 1)
+    nproducers = strtoul(argv[1], NULL, 0);
+  if (argc > 2)
+    ntasks = strtoul(argv[2], NULL, 0);
+  if (!nproducers || !ntasks) {
+    fprintf(stderr, "usage: task-bench [producers [tasks per producer]]\n");
+    return EXIT_FAILURE;
+  }
+
+  if (epoll_loop(init, NULL) < 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
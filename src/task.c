@@ -4,154 +4,335 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <unistd.h>
 #include "log.h"
 #include "loop.h"
 #include "task.h"
 
-static int pipefd[2];
+/*
+ * Task queue
+ *
+ * Each task class has its own lane: a bounded multi-producer/single-
+ * consumer ring that stores tasks inline. Producers on any thread
+ * reserve a slot by advancing the lane's enqueue position, fill in the
+ * task and publish the slot by updating its sequence number. The I/O
+ * thread consumes slots in order.
+ *
+ * All lanes share one doorbell. The consumer arms it before it goes
+ * idle, and only the producer that finds it armed writes to the
+ * eventfd, so a burst of tasks costs a single wakeup.
+ */
 
-static struct task*
-fetch_task(void)
+#define CACHE_LINE_SIZE 64
+
+/* Number of times a non-empty lane can be passed over by tasks of
+ * higher classes before it gets served. */
+#define TASK_AGING_LIMIT 16
+
+/* maximum number of tasks served per wakeup */
+#define TASK_BUDGET 4096
+
+struct task_slot {
+  unsigned long seq;
+  struct timespec queued;
+  struct task task;
+};
+
+struct task_lane {
+  struct task_slot* ring;
+  unsigned long mask;
+
+  /* written by producers */
+  unsigned long enqueue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+  unsigned long long rejected;
+
+  /* written by the consumer */
+  unsigned long dequeue_pos __attribute__((aligned(CACHE_LINE_SIZE)));
+  unsigned long skipped;
+  struct task_queue_stats stats;
+};
+
+/* lane sizes must be powers of 2 */
+static struct task_slot interactive_ring[256];
+static struct task_slot state_ring[1024];
+static struct task_slot bulk_ring[4096];
+
+#define ARRAYLEN(x) \
+  (sizeof(x) / sizeof(x[0]))
+
+static struct task_lane lane[NUM_TASK_CLASSES] = {
+  [TASK_CLASS_INTERACTIVE] = {
+    .ring = interactive_ring,
+    .mask = ARRAYLEN(interactive_ring) - 1
+  },
+  [TASK_CLASS_STATE] = {
+    .ring = state_ring,
+    .mask = ARRAYLEN(state_ring) - 1
+  },
+  [TASK_CLASS_BULK] = {
+    .ring = bulk_ring,
+    .mask = ARRAYLEN(bulk_ring) - 1
+  }
+};
+
+static int doorbell_armed;
+
+static int evfd;
+
+static unsigned long long
+nsec_since(const struct timespec* ts)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (unsigned long long)(now.tv_sec - ts->tv_sec) * 1000000000ull +
+         now.tv_nsec - ts->tv_nsec;
+}
+
+static int
+has_task(const struct task_lane* lane)
 {
-  union {
-    struct task* task;
-    unsigned char raw[sizeof(struct task*)];
-  } buf;
-
-  size_t off;
-  size_t count;
-
-  off = 0;
-  count = sizeof(buf.task);
-
-  while (count) {
-    ssize_t res = TEMP_FAILURE_RETRY(read(pipefd[0], buf.raw+off, count));
-    if (res < 0) {
-      ALOGE_ERRNO("read");
-      goto err_read;
+  const struct task_slot* slot = lane->ring + (lane->dequeue_pos & lane->mask);
+
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) ==
+         lane->dequeue_pos + 1;
+}
+
+/* Fetches the lane's next task. Returns 1 if a task has been fetched,
+ * or 0 if the lane is empty. */
+static int
+fetch_task(struct task_lane* lane, struct task* task)
+{
+  struct task_slot* slot;
+  unsigned long seq, depth;
+  unsigned long long wait;
+
+  slot = lane->ring + (lane->dequeue_pos & lane->mask);
+
+  seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+  if (seq != lane->dequeue_pos + 1)
+    return 0; /* empty, or the producer hasn't finished yet */
+
+  *task = slot->task;
+
+  wait = nsec_since(&slot->queued);
+  lane->stats.wait_nsec += wait;
+  if (wait > lane->stats.max_wait_nsec)
+    lane->stats.max_wait_nsec = wait;
+
+  depth = __atomic_load_n(&lane->enqueue_pos, __ATOMIC_RELAXED) -
+          lane->dequeue_pos;
+  if (depth > lane->stats.max_depth)
+    lane->stats.max_depth = depth;
+
+  /* release the slot for the next round */
+  __atomic_store_n(&slot->seq, lane->dequeue_pos + lane->mask + 1,
+                   __ATOMIC_RELEASE);
+  ++lane->dequeue_pos;
+  ++lane->stats.executed;
+
+  return 1;
+}
+
+/* Fetches the next task by strict priority, except for lanes that
+ * have been passed over too often. */
+static int
+fetch_next_task(struct task* task)
+{
+  int cls, i;
+
+  for (cls = NUM_TASK_CLASSES - 1; cls > 0; --cls) {
+    if (lane[cls].skipped < TASK_AGING_LIMIT)
+      continue;
+    if (fetch_task(lane + cls, task)) {
+      lane[cls].skipped = 0;
+      return 1;
+    }
+  }
+
+  for (cls = 0; cls < NUM_TASK_CLASSES; ++cls) {
+    if (!fetch_task(lane + cls, task))
+      continue;
+    lane[cls].skipped = 0;
+    for (i = cls + 1; i < NUM_TASK_CLASSES; ++i) {
+      if (has_task(lane + i))
+        ++lane[i].skipped;
     }
-    count -= res;
-    off += res;
+    return 1;
   }
 
-  return buf.task;
-err_read:
-  /* if this fails, you best close the pipe and restart completely */
-  return NULL;
+  return 0;
 }
 
-static void
-delete_task(struct task* task)
+static int
+has_any_task(void)
 {
-  assert(task);
-  free(task);
+  int cls;
+
+  for (cls = 0; cls < NUM_TASK_CLASSES; ++cls) {
+    if (has_task(lane + cls))
+      return 1;
+  }
+  return 0;
 }
 
 static void
 exec_task(int fd, uint32_t flags, void* data)
 {
-  struct task* task = fetch_task();
-  if (!task)
-    goto err_fetch_task;
+  uint64_t value;
+  struct task task;
+  unsigned long i;
+
+  /* reset the eventfd counter */
+  if (read_from_epoll_loop(fd, &value, sizeof(value)) < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      ALOGW_ERRNO("read");
+  }
 
-  task->func(task->data);
-  delete_task(task);
+  for (;;) {
+    /* Serve a limited number of tasks, so that producers that keep
+     * adding tasks can't keep us here forever. */
+    for (i = 0; (i < TASK_BUDGET) && fetch_next_task(&task); ++i)
+      task.func(task.data);
+
+    if (i == TASK_BUDGET) {
+      /* leave the doorbell disarmed; we'll be back soon */
+      requeue_fd_in_epoll_loop(fd, flags);
+      return;
+    }
 
-  return;
-err_fetch_task:
-  return;
+    __atomic_store_n(&doorbell_armed, 1, __ATOMIC_SEQ_CST);
+
+    /* A producer might have published a task after we fetched the
+     * last one but before the doorbell was armed. */
+    if (!has_any_task())
+      return;
+
+    __atomic_store_n(&doorbell_armed, 0, __ATOMIC_SEQ_CST);
+  }
 }
 
 int
 init_task_queue()
 {
-  if (TEMP_FAILURE_RETRY(pipe(pipefd)) < 0) {
-    ALOGE_ERRNO("pipe");
-    goto err_pipe;
+  int cls;
+  unsigned long i;
+
+  for (cls = 0; cls < NUM_TASK_CLASSES; ++cls) {
+    for (i = 0; i <= lane[cls].mask; ++i)
+      lane[cls].ring[i].seq = i;
+    lane[cls].enqueue_pos = 0;
+    lane[cls].rejected = 0;
+    lane[cls].dequeue_pos = 0;
+    lane[cls].skipped = 0;
+    memset(&lane[cls].stats, 0, sizeof(lane[cls].stats));
   }
+  doorbell_armed = 1;
 
-  if (add_fd_to_epoll_loop(pipefd[0], EPOLLIN|EPOLLERR, exec_task, NULL) < 0)
+  evfd = eventfd(0, EFD_NONBLOCK);
+  if (evfd < 0) {
+    ALOGE_ERRNO("eventfd");
+    goto err_eventfd;
+  }
+
+  if (add_read_fd_to_epoll_loop(evfd, EPOLLIN|EPOLLERR|EPOLLET,
+                                exec_task, NULL) < 0)
     goto err_add_fd_to_epoll_loop;
 
   return 0;
 err_add_fd_to_epoll_loop:
-  if (TEMP_FAILURE_RETRY(close(pipefd[1])))
-    ALOGW_ERRNO("close");
-  if (TEMP_FAILURE_RETRY(close(pipefd[0])))
+  if (TEMP_FAILURE_RETRY(close(evfd)))
     ALOGW_ERRNO("close");
-err_pipe:
+err_eventfd:
   return -1;
 }
 
 void
 uninit_task_queue()
 {
-  if (TEMP_FAILURE_RETRY(close(pipefd[1])))
-    ALOGW_ERRNO("close");
-  if (TEMP_FAILURE_RETRY(close(pipefd[0])))
+  remove_fd_from_epoll_loop(evfd);
+  if (TEMP_FAILURE_RETRY(close(evfd)))
     ALOGW_ERRNO("close");
 }
 
-static int
-send_task(struct task* task)
+static void
+ring_doorbell(void)
 {
-  ssize_t res;
+  static const uint64_t value = 1;
 
-  assert(sizeof(task) <= PIPE_BUF); /* guarantee atomicity of pipe writes */
+  if (!__atomic_exchange_n(&doorbell_armed, 0, __ATOMIC_SEQ_CST))
+    return; /* consumer is already awake */
 
-  res = TEMP_FAILURE_RETRY(write(pipefd[1], task, sizeof(task)));
-  if (res < 0) {
+  if (TEMP_FAILURE_RETRY(write(evfd, &value, sizeof(value))) < 0)
     ALOGE_ERRNO("write");
-    goto err_write;
-  } else if (res != sizeof(task)) {
-    /* your OS is broken */
-    abort();
-  }
-
-  return 0;
-err_write:
-  return -1;
 }
 
-static struct task*
-create_task(int (*func)(void*), void* data)
+int
+run_task(enum task_class cls, int (*func)(void*), void* data)
 {
-  struct task* task;
+  struct task_lane* l;
+  struct task_slot* slot;
+  unsigned long pos, seq;
 
+  assert(cls < NUM_TASK_CLASSES);
   assert(func);
 
-  errno = 0;
-  task = malloc(sizeof(*task));
-  if (!errno) {
-    ALOGE_ERRNO("malloc");
-    goto err_malloc;
+  l = lane + cls;
+
+  pos = __atomic_load_n(&l->enqueue_pos, __ATOMIC_RELAXED);
+
+  for (;;) {
+    long diff;
+
+    slot = l->ring + (pos & l->mask);
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    diff = (long)(seq - pos);
+
+    if (!diff) {
+      if (__atomic_compare_exchange_n(&l->enqueue_pos, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+      /* |pos| has been updated by the failed exchange */
+    } else if (diff < 0) {
+      ALOGE("task queue %d is full", cls);
+      goto err_full;
+    } else {
+      pos = __atomic_load_n(&l->enqueue_pos, __ATOMIC_RELAXED);
+    }
   }
 
-  task->func = func;
-  task->data = data;
+  clock_gettime(CLOCK_MONOTONIC, &slot->queued);
+  slot->task.func = func;
+  slot->task.data = data;
+
+  /* publish the task */
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  ring_doorbell();
 
-  return task;
-err_malloc:
-  return NULL;
+  return 0;
+err_full:
+  __atomic_add_fetch(&l->rejected, 1, __ATOMIC_RELAXED);
+  return -1;
 }
 
-int
-run_task(int (*func)(void*), void* data)
+void
+get_task_queue_stats(enum task_class cls, struct task_queue_stats* stats)
 {
-  struct task* task;
+  const struct task_lane* l;
 
-  task = create_task(func, data);
-  if (!task)
-    goto err_create_task;
+  assert(cls < NUM_TASK_CLASSES);
+  assert(stats);
 
-  if (send_task(task) < 0)
-    goto err_send_task;
+  l = lane + cls;
 
-  return 0;
-err_send_task:
-  delete_task(task);
-err_create_task:
-  return -1;
+  *stats = l->stats;
+  stats->depth = __atomic_load_n(&l->enqueue_pos, __ATOMIC_RELAXED) -
+                 l->dequeue_pos;
+  stats->rejected = __atomic_load_n(&l->rejected, __ATOMIC_RELAXED);
 }
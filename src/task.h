@@ -7,6 +7,25 @@ struct task {
   void* data;
 };
 
+/* Tasks are served in order of their class. Lower classes get a turn
+ * after they've been passed over a number of times, so they can't
+ * starve. */
+enum task_class {
+  TASK_CLASS_INTERACTIVE, /* pairing; a user is waiting */
+  TASK_CLASS_STATE, /* adapter, ACL and discovery state */
+  TASK_CLASS_BULK, /* device found, properties */
+  NUM_TASK_CLASSES
+};
+
+struct task_queue_stats {
+  unsigned long depth;
+  unsigned long max_depth;
+  unsigned long long executed;
+  unsigned long long rejected; /* queue was full */
+  unsigned long long wait_nsec; /* total time between queuing and running */
+  unsigned long long max_wait_nsec;
+};
+
 int
 init_task_queue(void);
 
@@ -14,4 +33,7 @@ void
 uninit_task_queue(void);
 
 int
-run_task(int (*func)(void*), void* data);
+run_task(enum task_class cls, int (*func)(void*), void* data);
+
+void
+get_task_queue_stats(enum task_class cls, struct task_queue_stats* stats);
@@ -0,0 +1,118 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * Benchmark for the timer wheel
+ *
+ * Arms many timers with timeouts between one second and ten minutes,
+ * rearms random ones, and cancels them all again, as a daemon does
+ * with per-request timeouts that hardly ever expire. Prints the time
+ * per operation. Run as
+ *
+ *   timer-bench [timers [rearms]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "log.h"
+#include "loop.h"
+#include "timer.h"
+
+#define DEFAULT_NTIMERS 100000UL
+#define DEFAULT_NREARMS 10000000UL
+
+static unsigned long ntimers = DEFAULT_NTIMERS;
+static unsigned long nrearms = DEFAULT_NREARMS;
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(const char* name, unsigned long n, double t0)
+{
+  printf("%-28s %7.1f ns/op\n", name, (now_ns() - t0) / n);
+}
+
+/* a cheap, reproducible sequence of timeouts */
+static unsigned long
+next_msec(unsigned long* state)
+{
+  *state = *state * 6364136223846793005UL + 1442695040888963407UL;
+  return 1000 + (*state >> 33) % 599000;
+}
+
+static void
+timer_expired(struct timer* timer, void* data)
+{
+  /* timeouts start at one second; none expires during the run */
+}
+
+static int
+init(void* data)
+{
+  struct timer* timer;
+  unsigned long i, state;
+  double t0;
+
+  if (init_timer_wheel() < 0)
+    return -1;
+
+  timer = calloc(ntimers, sizeof(*timer));
+  if (!timer) {
+    ALOGE_ERRNO("calloc");
+    return -1;
+  }
+  for (i = 0; i < ntimers; ++i)
+    init_timer(timer + i, timer_expired, NULL);
+
+  state = 1;
+
+  t0 = now_ns();
+  for (i = 0; i < ntimers; ++i) {
+    if (add_timer(timer + i, next_msec(&state)) < 0)
+      return -1;
+  }
+  report("add", ntimers, t0);
+
+  t0 = now_ns();
+  for (i = 0; i < nrearms; ++i) {
+    if (rearm_timer(timer + next_msec(&state) % ntimers,
+                    next_msec(&state)) < 0)
+      return -1;
+  }
+  report("rearm", nrearms, t0);
+
+  t0 = now_ns();
+  for (i = 0; i < ntimers; ++i)
+    cancel_timer(timer + i);
+  report("cancel", ntimers, t0);
+
+  exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc > 1)
+    ntimers = strtoul(argv[1], NULL, 0);
+  if (argc > 2)
+    nrearms = strtoul(argv[2], NULL, 0);
+  if (!ntimers) {
+    fprintf(stderr, "usage: timer-bench [timers [rearms]]\n");
+    return EXIT_FAILURE;
+  }
+
+  if (epoll_loop(init, NULL) < 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,410 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <assert.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "loop.h"
+#include "timer.h"
+
+/*
+ * Hierarchical timing wheel
+ *
+ * A tick is one millisecond. Level 0 holds timers that expire within
+ * the next 64 ticks, level n holds timers within the next 64^(n+1)
+ * ticks. When the wheel reaches the start of a slot in a higher level,
+ * the slot's timers get cascaded into the lower levels. Timers beyond
+ * the wheel's range wait in the highest level and get re-inserted until
+ * they are in range.
+ *
+ * A single timerfd drives the wheel. It is only reprogrammed if a new
+ * timer expires before the currently programmed tick, or after the
+ * timerfd fired.
+ */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE (1ull << (WHEEL_BITS * WHEEL_LEVELS))
+
+#define NO_TICK UINT64_MAX
+
+TAILQ_HEAD(timer_list, timer);
+
+static struct timer_list wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t occupied[WHEEL_LEVELS];
+
+static unsigned long ntimers;
+
+/* next tick to process */
+static uint64_t wheel_tick;
+
+/* tick programmed into the timerfd */
+static uint64_t timerfd_tick;
+
+static struct timespec base;
+static int timerfd;
+
+static uint64_t
+elapsed_nsec(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)(now.tv_sec - base.tv_sec) * 1000000000ull +
+         now.tv_nsec - base.tv_nsec;
+}
+
+static uint64_t
+now_tick(void)
+{
+  return elapsed_nsec() / 1000000;
+}
+
+static uint64_t
+slots_from(unsigned int slot)
+{
+  return slot < WHEEL_SIZE ? ~0ull << slot : 0;
+}
+
+static void
+enqueue_timer(struct timer* timer)
+{
+  uint64_t expires, delta;
+  unsigned int level;
+
+  expires = timer->expires;
+  if (expires < wheel_tick)
+    expires = wheel_tick;
+
+  delta = expires - wheel_tick;
+  if (delta >= WHEEL_RANGE) {
+    /* out of range; park in the highest level */
+    delta = WHEEL_RANGE - 1;
+    expires = wheel_tick + delta;
+  }
+
+  for (level = 0; level < WHEEL_LEVELS - 1; ++level) {
+    if (delta < (1ull << (WHEEL_BITS * (level + 1))))
+      break;
+  }
+
+  timer->level = level;
+  timer->slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+  TAILQ_INSERT_TAIL(&wheel[timer->level][timer->slot], timer, entry);
+  occupied[timer->level] |= 1ull << timer->slot;
+}
+
+static void
+dequeue_timer(struct timer* timer)
+{
+  struct timer_list* list = &wheel[timer->level][timer->slot];
+
+  TAILQ_REMOVE(list, timer, entry);
+  if (TAILQ_EMPTY(list))
+    occupied[timer->level] &= ~(1ull << timer->slot);
+}
+
+/* Returns the first tick at which the wheel has work to do; either
+ * expiring level-0 timers or a cascade of a higher level. */
+static uint64_t
+next_wheel_tick(void)
+{
+  uint64_t next;
+  unsigned int level;
+
+  next = NO_TICK;
+
+  for (level = 0; level < WHEEL_LEVELS; ++level) {
+    unsigned int shift, idx;
+    uint64_t bits, cur, block, tick;
+
+    bits = occupied[level];
+    if (!bits)
+      continue;
+
+    shift = WHEEL_BITS * level;
+    idx = (wheel_tick >> shift) & WHEEL_MASK;
+    block = (wheel_tick >> shift) - idx;
+
+    /* Slots at or after the current index are in the current round
+     * of the wheel. In higher levels, the current slot has already been
+     * cascaded unless the wheel is at the slot's first tick, so its
+     * timers are in the next round. */
+    if (level && (wheel_tick & ((1ull << shift) - 1)))
+      cur = bits & slots_from(idx + 1);
+    else
+      cur = bits & slots_from(idx);
+    if (cur)
+      tick = (block + __builtin_ctzll(cur)) << shift;
+    else
+      tick = (block + WHEEL_SIZE + __builtin_ctzll(bits)) << shift;
+
+    if (tick < next)
+      next = tick;
+  }
+
+  return next;
+}
+
+static void
+cascade_timers(unsigned int level, unsigned int slot)
+{
+  struct timer_list* list = &wheel[level][slot];
+  struct timer_list cascade;
+  struct timer* timer;
+
+  TAILQ_INIT(&cascade);
+
+  while ((timer = TAILQ_FIRST(list))) {
+    TAILQ_REMOVE(list, timer, entry);
+    TAILQ_INSERT_TAIL(&cascade, timer, entry);
+  }
+  occupied[level] &= ~(1ull << slot);
+
+  while ((timer = TAILQ_FIRST(&cascade))) {
+    TAILQ_REMOVE(&cascade, timer, entry);
+    enqueue_timer(timer);
+  }
+}
+
+static void
+run_wheel_tick(void)
+{
+  uint64_t tick;
+  unsigned int level, slot;
+  struct timer_list* list;
+  struct timer* timer;
+
+  tick = wheel_tick;
+
+  for (level = 1; level < WHEEL_LEVELS; ++level) {
+    unsigned int shift = WHEEL_BITS * level;
+    if (tick & ((1ull << shift) - 1))
+      break;
+    cascade_timers(level, (tick >> shift) & WHEEL_MASK);
+  }
+
+  /* Timers added by callbacks expire at the next tick or later, so
+   * they never end up in the slot we're running. */
+  wheel_tick = tick + 1;
+
+  slot = tick & WHEEL_MASK;
+  list = &wheel[0][slot];
+
+  while ((timer = TAILQ_FIRST(list))) {
+    TAILQ_REMOVE(list, timer, entry);
+    if (TAILQ_EMPTY(list))
+      occupied[0] &= ~(1ull << slot);
+
+    if (timer->expires > tick) {
+      /* parked out-of-range timer */
+      enqueue_timer(timer);
+      continue;
+    }
+
+    timer->armed = 0;
+    --ntimers;
+    timer->func(timer, timer->data);
+  }
+}
+
+static void
+run_timers(uint64_t now)
+{
+  while (wheel_tick <= now) {
+    uint64_t next = ntimers ? next_wheel_tick() : NO_TICK;
+
+    if (next > now) {
+      wheel_tick = now + 1;
+      break;
+    }
+    wheel_tick = next;
+    run_wheel_tick();
+  }
+}
+
+static int
+program_timerfd(uint64_t tick)
+{
+  struct itimerspec its;
+  uint64_t msec;
+
+  msec = tick;
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = base.tv_sec + msec / 1000;
+  its.it_value.tv_nsec = base.tv_nsec + (msec % 1000) * 1000000;
+  if (its.it_value.tv_nsec >= 1000000000) {
+    ++its.it_value.tv_sec;
+    its.it_value.tv_nsec -= 1000000000;
+  }
+
+  if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    ALOGE_ERRNO("timerfd_settime");
+    return -1;
+  }
+
+  timerfd_tick = tick;
+
+  return 0;
+}
+
+static void
+timerfd_event_in(int fd, uint32_t events, void* data)
+{
+  uint64_t expirations;
+
+  if (read_from_epoll_loop(fd, &expirations, sizeof(expirations)) < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      ALOGE_ERRNO("read");
+      return;
+    }
+  }
+
+  timerfd_tick = NO_TICK;
+
+  run_timers(now_tick());
+
+  if (ntimers)
+    program_timerfd(next_wheel_tick());
+}
+
+static void
+timerfd_event(int fd, uint32_t events, void* data)
+{
+  if (events & EPOLLERR) {
+    ALOGE("error on timerfd");
+  } else if (events & EPOLLIN) {
+    timerfd_event_in(fd, events, data);
+  } else {
+    ALOGW("unsupported event mask: %u", events);
+  }
+}
+
+void
+init_timer(struct timer* timer,
+           void (*func)(struct timer*, void*), void* data)
+{
+  assert(timer);
+  assert(func);
+
+  timer->expires = 0;
+  timer->func = func;
+  timer->data = data;
+  timer->armed = 0;
+}
+
+int
+add_timer(struct timer* timer, unsigned long msec)
+{
+  uint64_t nsec, next;
+
+  assert(timer);
+  assert(!timer->armed);
+
+  nsec = elapsed_nsec();
+
+  /* an empty wheel can skip ahead without running any ticks */
+  if (!ntimers && (wheel_tick < nsec / 1000000))
+    wheel_tick = nsec / 1000000;
+
+  /* round up, so the timer never expires early */
+  timer->expires = (nsec + (uint64_t)msec * 1000000 + 999999) / 1000000;
+
+  enqueue_timer(timer);
+  timer->armed = 1;
+  ++ntimers;
+
+  next = next_wheel_tick();
+  if ((next < timerfd_tick) && (program_timerfd(next) < 0))
+    goto err_program_timerfd;
+
+  return 0;
+err_program_timerfd:
+  cancel_timer(timer);
+  return -1;
+}
+
+void
+cancel_timer(struct timer* timer)
+{
+  assert(timer);
+
+  if (!timer->armed)
+    return;
+
+  /* The timerfd stays programmed; an early wakeup is cheaper
+   * than another syscall. */
+  dequeue_timer(timer);
+  timer->armed = 0;
+  --ntimers;
+}
+
+int
+rearm_timer(struct timer* timer, unsigned long msec)
+{
+  cancel_timer(timer);
+  return add_timer(timer, msec);
+}
+
+int
+timer_is_armed(const struct timer* timer)
+{
+  assert(timer);
+
+  return timer->armed;
+}
+
+int
+init_timer_wheel()
+{
+  unsigned int level, slot;
+
+  for (level = 0; level < WHEEL_LEVELS; ++level) {
+    for (slot = 0; slot < WHEEL_SIZE; ++slot)
+      TAILQ_INIT(&wheel[level][slot]);
+    occupied[level] = 0;
+  }
+  ntimers = 0;
+  wheel_tick = 0;
+  timerfd_tick = NO_TICK;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &base) < 0) {
+    ALOGE_ERRNO("clock_gettime");
+    goto err_clock_gettime;
+  }
+
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (timerfd < 0) {
+    ALOGE_ERRNO("timerfd_create");
+    goto err_timerfd_create;
+  }
+
+  if (add_read_fd_to_epoll_loop(timerfd, EPOLLIN|EPOLLERR, timerfd_event,
+                                NULL) < 0)
+    goto err_add_fd_to_epoll_loop;
+
+  return 0;
+err_add_fd_to_epoll_loop:
+  if (TEMP_FAILURE_RETRY(close(timerfd)) < 0)
+    ALOGW_ERRNO("close");
+err_timerfd_create:
+err_clock_gettime:
+  return -1;
+}
+
+void
+uninit_timer_wheel()
+{
+  remove_fd_from_epoll_loop(timerfd);
+  if (TEMP_FAILURE_RETRY(close(timerfd)) < 0)
+    ALOGW_ERRNO("close");
+}
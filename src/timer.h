@@ -0,0 +1,43 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* Timers run on the I/O thread. The structure is owned by the caller
+ * and must stay valid while the timer is armed; adding, cancelling and
+ * rearming a timer never allocates memory. */
+struct timer {
+  TAILQ_ENTRY(timer) entry;
+  uint64_t expires;
+  void (*func)(struct timer*, void*);
+  void* data;
+  unsigned char armed;
+  unsigned char level;
+  unsigned char slot;
+};
+
+void
+init_timer(struct timer* timer,
+           void (*func)(struct timer*, void*), void* data);
+
+int
+add_timer(struct timer* timer, unsigned long msec);
+
+void
+cancel_timer(struct timer* timer);
+
+int
+rearm_timer(struct timer* timer, unsigned long msec);
+
+int
+timer_is_armed(const struct timer* timer);
+
+int
+init_timer_wheel(void);
+
+void
+uninit_timer_wheel(void);